@@ -7,22 +7,22 @@
 
 #define HASH_TABLE_ERROR 1
 #define HASH_TABLE_SUCCESS 0
-#define HASH_TABLE_DEFAULT_SIZE 10
+#define HASH_TABLE_DEFAULT_SIZE 16
 
+/* Open addressing with Robin Hood linear probing over a power of two number of slots. The
+   keys are the hashes themselves, a slot with hash 0 is empty; the entry of hash 0 lives in
+   the extra slot entries[capacity] */
 typedef struct hash_table_entry_t {
   unsigned long hash;
-  int filled;
-  int pad0;
   void *value;
-
-  struct hash_table_entry_t *next;
 } hash_table_entry_t;
 
 typedef struct hash_table_t {
-  unsigned long *hashes;
-  hash_table_entry_t *entries;
+  hash_table_entry_t *entries; /* capacity + 1 slots */
   size_t capacity;
   size_t n;
+  unsigned shift; /* 64 - log2(capacity), for the home slot of a hash */
+  int has_zero;   /* entries[capacity] is filled */
 } hash_table_t;
 
 // extern "C" {
@@ -30,15 +30,16 @@ unsigned long hash_djb2(const unsigned char *str);
 int init_hash_table(size_t start_capacity, hash_table_t *hash_table);
 void destroy_hash_table(hash_table_t *hash_table);
 void hash_table_clear(hash_table_t *hash_table);
-int hash_table_change_value(unsigned long hash, void *value, hash_table_t *hash_table);
-int hash_table_insert(unsigned long hash, void *value, hash_table_t *hash_table);
 int hash_table_remove(unsigned long hash, hash_table_t *hash_table);
 hash_table_entry_t *hash_table_find(unsigned long hash, hash_table_t *hash_table);
-void hash_table_maybe_grow(size_t new_n, hash_table_t *hash_table);
 int hash_table_exists(const char *name, hash_table_t *hash_table);
 void hash_table_set(const char *name, void *val, hash_table_t *hash_table);
 void hash_table_set_by_hash(unsigned long hash, void *val, hash_table_t *hash_table);
 void *hash_table_get(const char *name, hash_table_t *hash_table);
 void *hash_table_get_by_hash(unsigned long hash, hash_table_t *hash_table);
+/* iterate the filled entries: for (ent = hash_table_first(ht); ent; ent = hash_table_next(ht, ent)).
+   The table must not change meanwhile */
+hash_table_entry_t *hash_table_first(hash_table_t *hash_table);
+hash_table_entry_t *hash_table_next(hash_table_t *hash_table, hash_table_entry_t *entry);
 // }
 #endif // HASH_TABLE_H
@@ -65,6 +65,11 @@
 
 #include "tcc.h"
 
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 /********************************************************/
 /* global variables */
 
@@ -635,7 +640,7 @@ ST_FUNC void tcc_open_bf(TCCState *s1, const char *filename, int initlen)
   BufferedFile *bf;
   int buflen = initlen ? initlen : IO_BUF_SIZE;
 
-  bf = tcc_mallocz(sizeof(BufferedFile) + buflen);
+  bf = tcc_mallocz(sizeof(BufferedFile) + buflen + IO_BUF_PAD);
   bf->buf_ptr = bf->buffer;
   bf->buf_end = bf->buffer + initlen;
   bf->buf_end[0] = CH_EOB; /* put eob symbol */
@@ -660,6 +665,10 @@ ST_FUNC void tcc_close(void)
     close(bf->fd);
     total_lines += bf->line_num;
   }
+#ifndef _WIN32
+  if (bf->map)
+    munmap(bf->map - sysconf(_SC_PAGESIZE), bf->map_size);
+#endif
   if (bf->true_filename != bf->filename)
     tcc_free(bf->true_filename);
   file = bf->prev;
@@ -678,6 +687,35 @@ static int _tcc_open(TCCState *s1, const char *filename)
   return fd;
 }
 
+#ifndef _WIN32
+/* map a regular file larger than the read buffer so that the lexer scans all of it without
+   refills. The page in front of the file is for the '*--p' of parse_number(), and the file
+   ends with the CH_EOB sentinel and IO_BUF_PAD bytes in the zero filled rest of its last page
+   or the page after */
+static void tcc_map_file(TCCState *s1, BufferedFile *bf)
+{
+  struct stat st;
+  size_t page = sysconf(_SC_PAGESIZE), size;
+  uint8_t *base;
+
+  if (fstat(bf->fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= IO_BUF_SIZE)
+    return;
+  size = st.st_size;
+  bf->map_size = (page + size + IO_BUF_PAD + page - 1) & ~(page - 1);
+  base = mmap(NULL, bf->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return;
+  if (mmap(base + page, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, bf->fd, 0) == MAP_FAILED) {
+    munmap(base, bf->map_size);
+    return;
+  }
+  bf->map = bf->buf_ptr = base + page;
+  bf->buf_end = bf->map + size;
+  *bf->buf_end = CH_EOB;
+  total_bytes += size;
+}
+#endif
+
 ST_FUNC int tcc_open(TCCState *s1, const char *filename)
 {
   int fd = _tcc_open(s1, filename);
@@ -685,9 +723,30 @@ ST_FUNC int tcc_open(TCCState *s1, const char *filename)
     return -1;
   tcc_open_bf(s1, filename, 0);
   file->fd = fd;
+  if (s1->include_cache)
+    file->stamp = tcc_file_stamp(filename, fd, &file->size);
+#ifndef _WIN32
+  tcc_map_file(s1, file);
+#endif
   return 0;
 }
 
+/* mtime in ns and size of a file (of fd if >= 0), 0 if there is none */
+ST_FUNC uint64_t tcc_file_stamp(const char *filename, int fd, uint64_t *size)
+{
+  struct stat st;
+
+  if (fd >= 0 ? fstat(fd, &st) : stat(filename, &st))
+    return 0;
+  if (size)
+    *size = st.st_size;
+#ifdef __linux__
+  return st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+#else
+  return st.st_mtime * 1000000000ULL;
+#endif
+}
+
 /* compile the file opened in 'file'. Return non zero if errors. */
 static int tcc_compile(TCCState *s1, int filetype, const char *str, int fd)
 {
@@ -698,7 +757,11 @@ static int tcc_compile(TCCState *s1, int filetype, const char *str, int fd)
      Alternatively we could use thread local storage for those global
      variables, which may or may not have advantages */
 
+  uint64_t start, pp_ns;
+
   tcc_enter_state(s1);
+  start = tcc_clock_ns();
+  pp_ns = s1->stats.pp_ns;
 
   if (setjmp(s1->error_jmp_buf) == 0) {
     s1->error_set_jmp_enabled = 1;
@@ -712,6 +775,9 @@ static int tcc_compile(TCCState *s1, int filetype, const char *str, int fd)
     else {
       tcc_open_bf(s1, str, 0);
       file->fd = fd;
+#ifndef _WIN32
+      tcc_map_file(s1, file);
+#endif
     }
 
     tccelf_begin_file(s1);
@@ -734,6 +800,8 @@ static int tcc_compile(TCCState *s1, int filetype, const char *str, int fd)
   s1->error_set_jmp_enabled = 0;
   tccgen_finish(s1);
   preprocess_end(s1);
+  s1->stats.gen_ns += tcc_clock_ns() - start - (s1->stats.pp_ns - pp_ns);
+  ++s1->stats.nb_compiles;
   tcc_exit_state();
 
   tccelf_end_file(s1);
@@ -745,17 +813,31 @@ LIBTCCAPI int tcc_compile_string(TCCState *s, const char *str) { return tcc_comp
 
 void tcci_handle_error(void *opaque, const char *msg) { fprintf(opaque, "%s\n", msg); }
 
+static void _tcci_free_header_snapshot(TCCInterpState *itp);
+
 LIBTCCAPI int tcci_add_include_path(TCCInterpState *itp, const char *pathname)
 {
   char *path_dup = tcc_strdup(pathname);
   dynarray_add(&itp->include_paths, &itp->nb_include_paths, path_dup);
+  _tcci_free_header_snapshot(itp);
   return 0;
 }
 
+static void _tcci_clear_resolved_syms(TCCInterpState *itp)
+{
+  hash_table_entry_t *ent;
+
+  for (ent = hash_table_first(&itp->resolved_syms); ent; ent = hash_table_next(&itp->resolved_syms, ent))
+    tcc_free(ent->value);
+  hash_table_clear(&itp->resolved_syms);
+}
+
 LIBTCCAPI int tcci_add_library(TCCInterpState *itp, const char *libname)
 {
   char *lib_dup = tcc_strdup(libname);
   dynarray_add(&itp->libraries, &itp->nb_libraries, lib_dup);
+  /* the library may define names which were not found before */
+  _tcci_clear_resolved_syms(itp);
   return 0;
 }
 
@@ -779,12 +861,17 @@ LIBTCCINTERPAPI TCCInterpState *tcci_new(void)
 {
   TCCInterpState *itp = tcc_mallocz(sizeof(TCCInterpState));
   init_hash_table(677, &itp->symbols);
+  init_hash_table(677, &itp->definitions);
+  init_hash_table(677, &itp->resolved_syms);
 
   itp->debug_verbose = 0;
 
   char fyf[32], buf[512];
+  itp->nb_compile_threads = 1;
   itp->redir.do_subst = 0;
+  itp->redir.mode = TCCI_REDIRECT_HASH_LOOKUP;
   init_hash_table(133, &itp->redir.sym_index_to_filename);
+  init_hash_table(1011, &itp->redir.hash_to_cell);
   {
     // Hash-To-Addr
     // TODO -- add a param for expected function declarations &/ redefinitions?
@@ -816,8 +903,8 @@ LIBTCCINTERPAPI TCCInterpState *tcci_new(void)
     // itp->redir.get_by_hash_fptr = (void *)tcci_get_symbol(itp, fyf);
   }
   {
-    // Addr-To-Addr
-    init_hash_table(1937, &itp->redir.addr_to_addr);
+    // Addr-To-Sym
+    init_hash_table(1937, &itp->redir.addr_to_sym);
 
     strcpy(fyf, "__tcci_get_fptr_by_prev_addr_");
     sprintf(buf,
@@ -825,16 +912,12 @@ LIBTCCINTERPAPI TCCInterpState *tcci_new(void)
             "\n"
             "void *%s(void *prev_addr) {\n"
             // "  printf(\"!!__tcci_get_fptr_by_prev_addr_!! addr:%%p\", prev_addr);\n"
-            "  void *fp = prev_addr;\n"
-            "  while(prev_addr = ((void *(*)(unsigned long, void *))%p)((unsigned long)prev_addr, (void *)%p)) {\n"
-            // "    printf(\"==>%%p\", prev_addr);\n"
-            "    fp = prev_addr;\n"
-            "  }\n"
-            // "  puts(\"\");\n"
-            // "  printf(\"fp=%%p\\n\", fp);\n"
-            "  return fp;\n"
+            "  void *sym = ((void *(*)(unsigned long, void *))%p)((unsigned long)prev_addr, (void *)%p);\n"
+            "  if (!sym)\n"
+            "    return prev_addr;\n"
+            "  return *(void **)((char *)sym + %i);\n"
             "}",
-            fyf, &hash_table_get_by_hash, &itp->redir.addr_to_addr);
+            fyf, &hash_table_get_by_hash, &itp->redir.addr_to_sym, (int)offsetof(TCCISymbol, addr));
     // puts(buf);
     tcci_add_string(itp, "_tcci_init_b.gen", buf);
 
@@ -864,6 +947,17 @@ LIBTCCINTERPAPI TCCInterpState *tcci_new(void)
   return itp;
 }
 
+/* drop what incremental mode knows of earlier compilations. Units holding
+   variables stay alive, as code may still use them */
+static void _tcci_clear_definitions(TCCInterpState *itp)
+{
+  hash_table_entry_t *ent;
+
+  for (ent = hash_table_first(&itp->definitions); ent; ent = hash_table_next(&itp->definitions, ent))
+    tcc_free(ent->value);
+  hash_table_clear(&itp->definitions);
+}
+
 /* free a TCC interpretation context */
 LIBTCCINTERPAPI void tcci_delete(TCCInterpState *itp)
 {
@@ -891,30 +985,37 @@ LIBTCCINTERPAPI void tcci_delete(TCCInterpState *itp)
 #endif
 
   // tcc_delete(itp->s1);
-  for (a = 0; a < itp->nb_runtime_mem_blocks; ++a) {
-    free(itp->runtime_mem_blocks[a]);
-  }
-  free(itp->runtime_mem_blocks);
+  tcci_arenas_delete(itp);
 
   hash_table_entry_t *ent;
-  for (ent = itp->symbols.entries; ent < itp->symbols.entries + itp->symbols.capacity; ++ent) {
-    if (!ent->filled)
-      continue;
-
+  for (ent = hash_table_first(&itp->symbols); ent; ent = hash_table_next(&itp->symbols, ent)) {
     TCCISymbol *sym = (TCCISymbol *)ent->value;
     if (sym->filename)
       free(sym->filename);
     if (sym->name)
       free(sym->name);
-    if (sym->nb_got_users)
-      free(sym->got_users);
+    tcc_free(sym->got_users);
     free(sym);
   }
   destroy_hash_table(&itp->symbols);
 
+  _tcci_clear_definitions(itp);
+  destroy_hash_table(&itp->definitions);
+  _tcci_clear_resolved_syms(itp);
+  destroy_hash_table(&itp->resolved_syms);
+
+  tcci_set_single_use_cache(itp, 0);
+  tcc_free(itp->single_use.refs);
+
+  _tcci_free_header_snapshot(itp);
+  tcci_set_include_cache(itp, NULL);
+  tcci_set_perf_map(itp, 0);
+
   destroy_hash_table(&itp->redir.sym_index_to_filename);
-  destroy_hash_table(&itp->redir.addr_to_addr);
+  destroy_hash_table(&itp->redir.addr_to_sym);
   destroy_hash_table(&itp->redir.hash_to_addr);
+  destroy_hash_table(&itp->redir.hash_to_cell);
+  tcc_free(itp->redir.cell_blocks); /* allocated from the arenas */
 
   if (itp->nb_cmdline_def_pairs) {
     for (a = 0; a < itp->nb_cmdline_def_pairs; ++a) {
@@ -942,16 +1043,42 @@ LIBTCCINTERPAPI void tcci_delete(TCCInterpState *itp)
 
 LIBTCCINTERPAPI void tcci_set_Werror(TCCInterpState *itp, unsigned char value) { itp->warn_error = value; }
 
-static int _tcci_pre_compile(TCCInterpState *itp)
+LIBTCCINTERPAPI int tcci_set_redirect_mode(TCCInterpState *itp, int mode)
+{
+#ifndef TCCI_HAVE_REDIRECT_CELLS
+  if (mode == TCCI_REDIRECT_CELLS)
+    return -1;
+#endif
+  itp->redir.mode = mode;
+  return 0;
+}
+
+LIBTCCINTERPAPI void tcci_set_incremental(TCCInterpState *itp, unsigned char enabled)
+{
+  itp->incremental = enabled;
+  if (!enabled)
+    _tcci_clear_definitions(itp);
+}
+
+LIBTCCINTERPAPI void tcci_get_stats(TCCInterpState *itp, TCCStats *stats) { *stats = itp->stats; }
+
+LIBTCCINTERPAPI void tcci_reset_stats(TCCInterpState *itp) { memset(&itp->stats, 0, sizeof itp->stats); }
+
+LIBTCCINTERPAPI void tcci_set_pp_timing(TCCInterpState *itp, unsigned char enabled) { itp->pp_timing = enabled; }
+
+/* set up a compilation state with the interpreter-scope options. Libraries are only
+   needed by the state which is relocated */
+static int _tcci_init_state(TCCInterpState *itp, TCCState *s1, hash_table_t *sym_filenames, int with_libraries)
 {
   int res;
 
-  tcci_state = itp;
-  itp->s1 = tcc_new();
-  itp->s1->warn_error = itp->warn_error;
+  s1->warn_error = itp->warn_error;
+  s1->sym_index_to_filename = sym_filenames;
+  s1->do_bench = itp->pp_timing;
+  s1->optimize = itp->optimize;
 
   // Initialize the output
-  res = tcc_set_output_type(itp->s1, TCC_OUTPUT_MEMORY);
+  res = tcc_set_output_type(s1, TCC_OUTPUT_MEMORY);
   if (res) {
     puts("ERR[5424]"); // TODO
     return res;
@@ -959,7 +1086,7 @@ static int _tcci_pre_compile(TCCInterpState *itp)
 
   // Interpreter-scope include paths
   for (int a = 0; a < itp->nb_include_paths; ++a) {
-    res = tcc_add_include_path(itp->s1, itp->include_paths[a]);
+    res = tcc_add_include_path(s1, itp->include_paths[a]);
     // printf("include_path:%s\n", itp->include_paths[a]);
     if (res) {
       puts("ERR[6259]"); // TODO
@@ -969,24 +1096,35 @@ static int _tcci_pre_compile(TCCInterpState *itp)
 
   // Interpreter-scope defines
   for (int a = 0; a < itp->nb_cmdline_def_pairs; a += 2) {
-    tcc_define_symbol(itp->s1, itp->cmdline_defs[a], itp->cmdline_defs[a + 1]);
+    tcc_define_symbol(s1, itp->cmdline_defs[a], itp->cmdline_defs[a + 1]);
   }
 
   // Interpreter-scope libraries
-  for (int a = 0; a < itp->nb_library_paths; ++a) {
-    tcc_add_library_path(itp->s1, itp->library_paths[a]);
-  }
-  for (int a = 0; a < itp->nb_libraries; ++a) {
-    tcc_add_library(itp->s1, itp->libraries[a]);
+  if (with_libraries) {
+    for (int a = 0; a < itp->nb_library_paths; ++a) {
+      tcc_add_library_path(s1, itp->library_paths[a]);
+    }
+    for (int a = 0; a < itp->nb_libraries; ++a) {
+      tcc_add_library(s1, itp->libraries[a]);
+    }
   }
 
-  tcc_set_error_func(itp->s1, stderr, tcci_handle_error);
+  tcc_set_error_func(s1, stderr, tcci_handle_error);
 
   return 0;
 }
 
+static int _tcci_pre_compile(TCCInterpState *itp)
+{
+  tcci_state = itp;
+  itp->s1 = tcc_new();
+  itp->s1->include_cache = itp->include_cache;
+  return _tcci_init_state(itp, itp->s1, &itp->redir.sym_index_to_filename, 1);
+}
+
 static void _tcci_post_compile(TCCInterpState *itp)
 {
+  tcc_add_stats(&itp->stats, &itp->s1->stats);
   tcc_delete(itp->s1);
   tcci_state = NULL;
 
@@ -1004,13 +1142,279 @@ static void _tcci_post_compile(TCCInterpState *itp)
   hash_table_clear(&itp->redir.sym_index_to_filename);
 }
 
+/* ------------------------------------------------------------------------- */
+/* header snapshots: the system headers a source starts with are parsed once
+   and their state is reused by later compilations which start with the same
+   include lines (see tcci_set_header_snapshot()) */
+
+/* compiling against another include set must not see the macros and
+   declarations of headers it does not include, so each set gets its own */
+#define TCCI_MAX_HEADER_SNAPSHOTS 8
+
+static void _tcci_delete_header_snapshot(TCCIHeaderSnapshot *hs)
+{
+  tccpp_snapshot_free(hs);
+  dynarray_reset(&hs->includes, &hs->nb_includes);
+  tcc_free(hs);
+}
+
+static void _tcci_free_header_snapshot(TCCInterpState *itp)
+{
+  int i;
+
+  for (i = 0; i < itp->nb_header_snapshots; ++i)
+    _tcci_delete_header_snapshot(itp->header_snapshots[i]);
+  tcc_free(itp->header_snapshots);
+  itp->header_snapshots = NULL;
+  itp->nb_header_snapshots = 0;
+}
+
+/* makes @i the most recently used snapshot */
+static TCCIHeaderSnapshot *_tcci_touch_header_snapshot(TCCInterpState *itp, int i)
+{
+  TCCIHeaderSnapshot *hs = itp->header_snapshots[i];
+
+  memmove(itp->header_snapshots + i, itp->header_snapshots + i + 1,
+          (itp->nb_header_snapshots - i - 1) * sizeof(TCCIHeaderSnapshot *));
+  itp->header_snapshots[itp->nb_header_snapshots - 1] = hs;
+  return hs;
+}
+
+/* drops the least recently used snapshots which are not pinned */
+static void _tcci_evict_header_snapshots(TCCInterpState *itp, int keep)
+{
+  int i = 0;
+
+  while (itp->nb_header_snapshots > keep && i < itp->nb_header_snapshots) {
+    if (itp->header_snapshots[i]->pinned) {
+      ++i;
+      continue;
+    }
+    _tcci_delete_header_snapshot(itp->header_snapshots[i]);
+    memmove(itp->header_snapshots + i, itp->header_snapshots + i + 1,
+            (--itp->nb_header_snapshots - i) * sizeof(TCCIHeaderSnapshot *));
+  }
+}
+
+/* Returns the length of the leading part of @str which consists only of
+   #include <...> lines, blank lines and comments, adding the include
+   directives found there to @includes */
+static int _tcci_scan_header_prelude(const char *str, char ***includes, int *nb_includes)
+{
+  const char *p = str, *q, *e;
+  int end = 0;
+
+  for (;;) {
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+      ++p;
+    if (*p == '\n') {
+      end = ++p - str;
+      continue;
+    }
+    if (p[0] == '/' && p[1] == '/') {
+      while (*p && *p != '\n')
+        ++p;
+      continue;
+    }
+    if (p[0] == '/' && p[1] == '*') {
+      q = strstr(p + 2, "*/");
+      if (!q)
+        break;
+      p = q + 2;
+      continue;
+    }
+    if (*p != '#')
+      break;
+
+    /* only <...> includes, "..." ones are searched relative to the file */
+    q = p + 1;
+    while (*q == ' ' || *q == '\t')
+      ++q;
+    if (strncmp(q, "include", 7))
+      break;
+    q += 7;
+    while (*q == ' ' || *q == '\t')
+      ++q;
+    if (*q != '<' || !(e = strchr(q, '>')) || memchr(q, '\n', e - q))
+      break;
+    dynarray_add(includes, nb_includes, pstrncpy(tcc_malloc(e + 2 - q), q, e + 1 - q));
+    p = e + 1;
+  }
+  return end;
+}
+
+/* the headers of a snapshot are parsed in order, so only the same list of
+   includes reproduces its state */
+static int _tcci_same_includes(TCCIHeaderSnapshot *hs, char **includes, int nb_includes)
+{
+  int i;
+
+  if (hs->nb_includes != nb_includes)
+    return 0;
+  for (i = 0; i < nb_includes; ++i)
+    if (strcmp(hs->includes[i], includes[i]))
+      return 0;
+  return 1;
+}
+
+/* parse the given headers into a new snapshot */
+static TCCIHeaderSnapshot *_tcci_build_header_snapshot(TCCInterpState *itp, char **includes, int nb_includes)
+{
+  TCCIHeaderSnapshot *hs;
+  CString text;
+  Section *sec;
+  int i, res;
+
+  hs = tcc_mallocz(sizeof(TCCIHeaderSnapshot));
+  cstr_new(&text);
+  for (i = 0; i < nb_includes; ++i) {
+    dynarray_add(&hs->includes, &hs->nb_includes, tcc_strdup(includes[i]));
+    cstr_printf(&text, "#include %s\n", includes[i]);
+  }
+  cstr_ccat(&text, '\0');
+
+  res = _tcci_pre_compile(itp);
+  if (!res) {
+    itp->s1->header_snapshot = hs;
+    itp->s1->string_filename = "<header snapshot>";
+    res = tcc_compile(itp->s1, itp->s1->filetype, text.data, -1);
+
+    /* the headers may only declare, anything emitted belongs to one state */
+    for (i = 1; !res && i < itp->s1->nb_sections; ++i) {
+      sec = itp->s1->sections[i];
+      if ((sec->sh_flags & SHF_ALLOC) && (sec->sh_type == SHT_PROGBITS || sec->sh_type == SHT_NOBITS) &&
+          sec->data_offset)
+        res = -1;
+    }
+    _tcci_post_compile(itp);
+  }
+  cstr_free(&text);
+
+  if (res || !hs->valid) {
+    dba(printf("header snapshot of %i includes could not be built\n", nb_includes));
+    _tcci_delete_header_snapshot(hs);
+    return NULL;
+  }
+  _tcci_evict_header_snapshots(itp, TCCI_MAX_HEADER_SNAPSHOTS - 1);
+  dynarray_add(&itp->header_snapshots, &itp->nb_header_snapshots, hs);
+  return hs;
+}
+
+/* Returns the snapshot @str can be compiled against (or NULL) and sets
+   @prelude to the length of the leading include lines it covers */
+static TCCIHeaderSnapshot *_tcci_header_snapshot_for(TCCInterpState *itp, const char *str, int *prelude)
+{
+  TCCIHeaderSnapshot *hs = NULL;
+  char **includes = NULL;
+  int i, nb_includes = 0;
+
+  *prelude = 0;
+  if (!itp->use_header_snapshot)
+    return NULL;
+
+  *prelude = _tcci_scan_header_prelude(str, &includes, &nb_includes);
+  if (!nb_includes) {
+    *prelude = 0;
+    return NULL;
+  }
+
+  for (i = itp->nb_header_snapshots; i-- > 0;)
+    if (_tcci_same_includes(itp->header_snapshots[i], includes, nb_includes)) {
+      hs = _tcci_touch_header_snapshot(itp, i);
+      break;
+    }
+  if (!hs)
+    hs = _tcci_build_header_snapshot(itp, includes, nb_includes);
+  dynarray_reset(&includes, &nb_includes);
+
+  if (!hs)
+    *prelude = 0;
+  return hs;
+}
+
+/* blank the first @prelude characters of @text, keeping line numbers */
+static void _tcci_blank_prelude(char *text, int prelude)
+{
+  int i;
+
+  for (i = 0; i < prelude; ++i)
+    if (text[i] != '\n')
+      text[i] = ' ';
+}
+
+/* Returns the contents of the C source @filename with its snapshot prelude
+   blanked and sets @hs to its snapshot, or returns NULL if it is not to be
+   compiled against one */
+static char *_tcci_load_for_header_snapshot(TCCInterpState *itp, const char *filename, TCCIHeaderSnapshot **hs)
+{
+  FILE *fp;
+  char *text;
+  long size;
+  int prelude;
+
+  if (!itp->use_header_snapshot || strcmp(tcc_fileextension(filename), ".c"))
+    return NULL;
+
+  fp = fopen(filename, "rb");
+  if (!fp)
+    return NULL;
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  text = tcc_malloc(size + 1);
+  if (size < 0 || fread(text, 1, size, fp) != (size_t)size) {
+    tcc_free(text);
+    fclose(fp);
+    return NULL;
+  }
+  text[size] = '\0';
+  fclose(fp);
+
+  *hs = _tcci_header_snapshot_for(itp, text, &prelude);
+  if (!*hs) {
+    tcc_free(text);
+    return NULL;
+  }
+  _tcci_blank_prelude(text, prelude);
+  return text;
+}
+
+LIBTCCINTERPAPI void tcci_set_header_snapshot(TCCInterpState *itp, unsigned char enabled)
+{
+  itp->use_header_snapshot = enabled;
+  if (!enabled)
+    _tcci_free_header_snapshot(itp);
+}
+
+LIBTCCINTERPAPI void tcci_set_include_cache(TCCInterpState *itp, const char *dir)
+{
+  if (itp->include_cache) {
+    include_cache_save(itp->include_cache);
+    include_cache_free(itp->include_cache);
+    itp->include_cache = NULL;
+  }
+  if (dir)
+    itp->include_cache = include_cache_load(dir);
+}
+
 LIBTCCINTERPAPI int tcci_add_string(TCCInterpState *itp, const char *filename, const char *str)
 {
-  int res;
+  TCCIHeaderSnapshot *hs;
+  char *text = NULL;
+  int res, prelude;
+
+  hs = _tcci_header_snapshot_for(itp, str, &prelude);
+  if (hs) {
+    str = text = tcc_strdup(str);
+    _tcci_blank_prelude(text, prelude);
+  }
 
   res = _tcci_pre_compile(itp);
-  if (res)
+  if (res) {
+    tcc_free(text);
     return res;
+  }
+  itp->s1->header_snapshot = hs;
 
   // if (!res) {
   itp->s1->string_filename = filename;
@@ -1027,34 +1431,234 @@ LIBTCCINTERPAPI int tcci_add_string(TCCInterpState *itp, const char *filename, c
   // }
 
   _tcci_post_compile(itp);
+  tcc_free(text);
+
+  return res;
+}
+
+/* ------------------------------------------------------------- */
+/* parallel tcci_add_files(): every file is compiled into a state of its own by a pool of
+   worker threads, then the states are merged in file order into the state which gets
+   relocated */
+#ifdef _WIN32
+#define TCCI_MUTEX CRITICAL_SECTION
+#define tcci_mutex_init(m) InitializeCriticalSection(m)
+#define tcci_mutex_destroy(m) DeleteCriticalSection(m)
+#define tcci_mutex_lock(m) EnterCriticalSection(m)
+#define tcci_mutex_unlock(m) LeaveCriticalSection(m)
+#define TCCI_THREAD_FUNC(func, param) DWORD WINAPI func(void *param)
+#else
+#include <pthread.h>
+#define TCCI_MUTEX pthread_mutex_t
+#define tcci_mutex_init(m) pthread_mutex_init(m, NULL)
+#define tcci_mutex_destroy(m) pthread_mutex_destroy(m)
+#define tcci_mutex_lock(m) pthread_mutex_lock(m)
+#define tcci_mutex_unlock(m) pthread_mutex_unlock(m)
+#define TCCI_THREAD_FUNC(func, param) void *func(void *param)
+#endif
+
+typedef struct TCCICompileJob {
+  TCCInterpState *itp;
+  const char **files;
+  unsigned nb_files, next;
+  TCCState **states;
+  hash_table_t *sym_filenames; /* per file */
+  int *results;
+} TCCICompileJob;
+
+ST_FUNC void tcci_lock(TCCInterpState *itp)
+{
+  if (itp->compile_lock)
+    tcci_mutex_lock((TCCI_MUTEX *)itp->compile_lock);
+}
+
+ST_FUNC void tcci_unlock(TCCInterpState *itp)
+{
+  if (itp->compile_lock)
+    tcci_mutex_unlock((TCCI_MUTEX *)itp->compile_lock);
+}
+
+static int _tcci_nb_cores(void)
+{
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif
+}
+
+static TCCI_THREAD_FUNC(_tcci_compile_worker, arg)
+{
+  TCCICompileJob *job = arg;
+  TCCInterpState *itp = job->itp;
+  TCCState *s;
+  unsigned a;
+
+  tcci_state = itp;
+  for (;;) {
+    tcci_lock(itp);
+    a = job->next++;
+    tcci_unlock(itp);
+    if (a >= job->nb_files)
+      break;
 
+    s = job->states[a] = tcc_new();
+    init_hash_table(133, &job->sym_filenames[a]);
+    job->results[a] = _tcci_init_state(itp, s, &job->sym_filenames[a], 0);
+    if (!job->results[a])
+      job->results[a] = tcc_add_file(s, job->files[a]);
+  }
+  tcci_state = NULL;
+  return 0;
+}
+
+/* compile files on the worker pool and merge them into itp->s1 */
+static int _tcci_compile_files_parallel(TCCInterpState *itp, const char **files, unsigned nb_files)
+{
+  TCCICompileJob job;
+  TCCI_MUTEX lock;
+  hash_table_entry_t *ent;
+  unsigned a;
+  int n, nb_threads, res = 0;
+#ifdef _WIN32
+  HANDLE *threads;
+#else
+  pthread_t *threads;
+#endif
+
+  nb_threads = itp->nb_compile_threads > 0 ? itp->nb_compile_threads : _tcci_nb_cores();
+  if (nb_threads > (int)nb_files)
+    nb_threads = nb_files;
+
+  memset(&job, 0, sizeof job);
+  job.itp = itp;
+  job.files = files;
+  job.nb_files = nb_files;
+  job.states = tcc_mallocz(nb_files * sizeof(TCCState *));
+  job.sym_filenames = tcc_mallocz(nb_files * sizeof(hash_table_t));
+  job.results = tcc_mallocz(nb_files * sizeof(int));
+  threads = tcc_mallocz(nb_threads * sizeof(*threads));
+
+  tcci_mutex_init(&lock);
+  itp->compile_lock = &lock;
+  for (n = 0; n < nb_threads; ++n) {
+#ifdef _WIN32
+    threads[n] = CreateThread(NULL, 0, _tcci_compile_worker, &job, 0, NULL);
+#else
+    pthread_create(&threads[n], NULL, _tcci_compile_worker, &job);
+#endif
+  }
+#ifdef _WIN32
+  WaitForMultipleObjects(nb_threads, threads, TRUE, INFINITE);
+  for (n = 0; n < nb_threads; ++n)
+    CloseHandle(threads[n]);
+#else
+  for (n = 0; n < nb_threads; ++n)
+    pthread_join(threads[n], NULL);
+#endif
+  itp->compile_lock = NULL;
+  tcci_mutex_destroy(&lock);
+
+  for (a = 0; a < nb_files; ++a) {
+    /* the errors of a file went to the error function of its state */
+    if (!res)
+      res = job.results[a];
+    if (!res)
+      res = tcci_merge_state(itp->s1, job.states[a]);
+
+    /* filenames which did not move over with their symbol */
+    for (ent = hash_table_first(&job.sym_filenames[a]); ent; ent = hash_table_next(&job.sym_filenames[a], ent))
+      tcc_free(ent->value);
+    destroy_hash_table(&job.sym_filenames[a]);
+    job.states[a]->sym_index_to_filename = NULL;
+    tcc_add_stats(&itp->s1->stats, &job.states[a]->stats);
+    tcc_delete(job.states[a]);
+  }
+
+  tcc_free(threads);
+  tcc_free(job.results);
+  tcc_free(job.sym_filenames);
+  tcc_free(job.states);
   return res;
 }
 
+LIBTCCINTERPAPI void tcci_set_optimize(TCCInterpState *itp, int level) { itp->optimize = level; }
+
+LIBTCCINTERPAPI void tcci_set_compile_threads(TCCInterpState *itp, int nb_threads)
+{
+  itp->nb_compile_threads = nb_threads;
+}
+
 LIBTCCINTERPAPI int tcci_add_files(TCCInterpState *itp, const char **files, unsigned nb_files)
 {
+  char **texts = NULL;
+  TCCIHeaderSnapshot **snapshots = NULL;
+  unsigned a;
   int res;
 
-  res = _tcci_pre_compile(itp);
-  if (res)
+  if (itp->nb_compile_threads != 1 && nb_files > 1) {
+    res = _tcci_pre_compile(itp);
+    if (!res)
+      res = _tcci_compile_files_parallel(itp, files, nb_files);
+    if (!res)
+      res = tcci_relocate_into_memory(itp);
+    _tcci_post_compile(itp);
     return res;
+  }
 
-  for (unsigned a = 0; a < nb_files; ++a) {
-    res = tcc_add_file(itp->s1, files[a]);
-    if (res) {
-      puts("ERR[831]: tcc_add_file"); // TODO
-      return res;
+  if (itp->use_header_snapshot) {
+    texts = tcc_mallocz(nb_files * sizeof(char *));
+    snapshots = tcc_mallocz(nb_files * sizeof(TCCIHeaderSnapshot *));
+    /* pinned so that building the snapshot of a later file keeps them */
+    for (a = 0; a < nb_files; ++a)
+      if ((texts[a] = _tcci_load_for_header_snapshot(itp, files[a], &snapshots[a])))
+        ++snapshots[a]->pinned;
+  }
+
+  res = _tcci_pre_compile(itp);
+  if (res)
+    goto done;
+
+  for (a = 0; a < nb_files; ++a) {
+    if (texts && texts[a]) {
+      /* compile against the header snapshot */
+      itp->s1->header_snapshot = snapshots[a];
+      itp->s1->string_filename = files[a];
+      itp->s1->current_filename = files[a];
+      res = tcc_compile(itp->s1, itp->s1->filetype, texts[a], -1);
+      itp->s1->header_snapshot = NULL;
+      itp->s1->current_filename = NULL;
     }
+    else
+      res = tcc_add_file(itp->s1, files[a]);
+    /* reported through the error function already */
+    if (res)
+      break;
 
     // tcc_add_file_internal(itp->s1, files[a], AFF_PRINT_ERROR | AFF_TYPE_C);
     // tcc_compile(itp->s1, AFF_PRINT_ERROR | AFF_TYPE_C, files[a], 0);
   }
 
   // puts("...Relocating...");
-  res = tcci_relocate_into_memory(itp);
+  if (!res)
+    res = tcci_relocate_into_memory(itp);
 
   _tcci_post_compile(itp);
 
+done:
+  if (texts) {
+    for (a = 0; a < nb_files; ++a)
+      if (texts[a]) {
+        --snapshots[a]->pinned;
+        tcc_free(texts[a]);
+      }
+    tcc_free(texts);
+    tcc_free(snapshots);
+    _tcci_evict_header_snapshots(itp, TCCI_MAX_HEADER_SNAPSHOTS);
+  }
   return res;
 }
 
@@ -1067,12 +1671,188 @@ LIBTCCINTERPAPI int tcci_add_files(TCCInterpState *itp, const char **files, unsi
 //   return 0;
 // }
 
+/* ------------------------------------------------------------- */
+/* single-use code cache: the relocated function of single-use code is kept and
+   run again when the same code is executed with the same compile options. The
+   least recently used entry makes room, and an entry is dropped as soon as a
+   function its code uses is redefined */
+
+/* record that the single-use code being compiled uses the function of hash */
+ST_FUNC void tcci_single_use_ref(TCCInterpState *itp, unsigned long hash)
+{
+  int i;
+
+  for (i = 0; i < itp->single_use.nb_refs; ++i)
+    if (itp->single_use.refs[i] == hash)
+      return;
+  if (!(itp->single_use.nb_refs & 15))
+    itp->single_use.refs =
+        tcc_realloc(itp->single_use.refs, (itp->single_use.nb_refs + 16) * sizeof(unsigned long));
+  itp->single_use.refs[itp->single_use.nb_refs++] = hash;
+}
+
+static void _tcci_free_single_use_entry(TCCInterpState *itp, TCCISingleUseEntry *e)
+{
+  tcci_arena_free(itp, e->code_mem, e->code_size);
+  tcci_arena_free(itp, e->data_mem, e->data_size);
+  tcc_free(e->refs);
+  tcc_free(e->key);
+  tcc_free(e);
+}
+
+/* remove an entry from the cache, its code is released once no longer running */
+static void _tcci_drop_single_use_entry(TCCInterpState *itp, int i)
+{
+  TCCISingleUseEntry *e = itp->single_use.cache[i];
+
+  itp->single_use.cache[i] = itp->single_use.cache[--itp->single_use.nb_cache];
+  if (e->running)
+    e->dropped = 1;
+  else
+    _tcci_free_single_use_entry(itp, e);
+}
+
+ST_FUNC void tcci_single_use_invalidate(TCCInterpState *itp, unsigned long hash)
+{
+  TCCISingleUseEntry *e;
+  int i, j;
+
+  for (i = 0; i < itp->single_use.nb_cache;) {
+    e = itp->single_use.cache[i];
+    for (j = 0; j < e->nb_refs; ++j)
+      if (e->refs[j] == hash)
+        break;
+    if (j < e->nb_refs)
+      _tcci_drop_single_use_entry(itp, i);
+    else
+      ++i;
+  }
+}
+
+static void _tcci_key_add(CString *key, const char *str) { cstr_cat(key, str, strlen(str) + 1); }
+
+/* the key of single-use code: everything its compilation depends on, each string ending
+   with its nul. The counts keep the parts apart. Returns its hash */
+static unsigned long _tcci_single_use_key(TCCInterpState *itp, const char *filename, int root_statement_count,
+                                          const char **root_statements, const char *code, CString *key)
+{
+  unsigned long h = 5381;
+  int i;
+
+  cstr_printf(key, "%d %d %d", root_statement_count, itp->nb_cmdline_def_pairs, itp->nb_include_paths);
+  cstr_ccat(key, 0);
+  _tcci_key_add(key, filename);
+  for (i = 0; i < root_statement_count; ++i)
+    _tcci_key_add(key, root_statements[i]);
+  _tcci_key_add(key, code);
+  for (i = 0; i < itp->nb_cmdline_def_pairs; ++i) {
+    /* a NULL value differs from "" */
+    cstr_ccat(key, itp->cmdline_defs[i] ? '=' : 0);
+    if (itp->cmdline_defs[i])
+      _tcci_key_add(key, itp->cmdline_defs[i]);
+  }
+  for (i = 0; i < itp->nb_include_paths; ++i)
+    _tcci_key_add(key, itp->include_paths[i]);
+
+  for (i = 0; i < key->size; ++i)
+    h = h * 33 + ((unsigned char *)key->data)[i];
+  return h;
+}
+
+static TCCISingleUseEntry *_tcci_find_single_use(TCCInterpState *itp, unsigned long hash, CString *key)
+{
+  TCCISingleUseEntry *e;
+  int i;
+
+  for (i = 0; i < itp->single_use.nb_cache; ++i) {
+    e = itp->single_use.cache[i];
+    if (e->hash == hash && e->key_size == key->size && !memcmp(e->key, key->data, key->size))
+      return e;
+  }
+  return NULL;
+}
+
+/* keep the single-use code just relocated */
+static TCCISingleUseEntry *_tcci_cache_single_use(TCCInterpState *itp, unsigned long hash, CString *key)
+{
+  TCCISingleUseEntry *e;
+  int i, lru;
+
+  if (itp->single_use.nb_cache == itp->single_use.cache_size) {
+    lru = 0;
+    for (i = 1; i < itp->single_use.nb_cache; ++i)
+      if (itp->single_use.cache[i]->last_use < itp->single_use.cache[lru]->last_use)
+        lru = i;
+    _tcci_drop_single_use_entry(itp, lru);
+  }
+
+  e = tcc_mallocz(sizeof(TCCISingleUseEntry));
+  e->hash = hash;
+  e->key = tcc_malloc(key->size);
+  memcpy(e->key, key->data, key->size);
+  e->key_size = key->size;
+  e->func_ptr = itp->single_use.func_ptr;
+  e->code_mem = itp->single_use.code_mem;
+  e->code_size = itp->single_use.code_size;
+  e->data_mem = itp->single_use.data_mem;
+  e->data_size = itp->single_use.data_size;
+  e->refs = itp->single_use.refs;
+  e->nb_refs = itp->single_use.nb_refs;
+  itp->single_use.cache[itp->single_use.nb_cache++] = e;
+  itp->single_use.code_mem = itp->single_use.data_mem = NULL;
+  itp->single_use.refs = NULL;
+  itp->single_use.nb_refs = 0;
+  return e;
+}
+
+static void *_tcci_run_single_use(TCCInterpState *itp, TCCISingleUseEntry *e, void *vargs)
+{
+  void *(*single_use_func)(void *) = e->func_ptr;
+  void *result;
+
+  e->last_use = ++itp->single_use.clock;
+  ++e->running;
+  result = single_use_func(vargs);
+  if (!--e->running && e->dropped)
+    _tcci_free_single_use_entry(itp, e);
+  return result;
+}
+
+LIBTCCINTERPAPI void tcci_set_single_use_cache(TCCInterpState *itp, int nb_entries)
+{
+  if (nb_entries < 0)
+    nb_entries = 0;
+  while (itp->single_use.nb_cache > nb_entries)
+    _tcci_drop_single_use_entry(itp, itp->single_use.nb_cache - 1);
+  itp->single_use.cache = tcc_realloc(itp->single_use.cache, nb_entries * sizeof(TCCISingleUseEntry *));
+  itp->single_use.cache_size = nb_entries;
+}
+
 LIBTCCINTERPAPI int tcci_execute_single_use_code(TCCInterpState *itp, const char *filename, int root_statement_count,
                                                  const char **root_statements, const char *code, void *vargs,
                                                  void **result)
 {
+  TCCISingleUseEntry *cached = NULL;
+  unsigned long hash = 0;
+  void *cached_result;
+  CString key;
+
+  cstr_new(&key);
+  if (itp->single_use.cache_size) {
+    hash = _tcci_single_use_key(itp, filename, root_statement_count, root_statements, code, &key);
+    cached = _tcci_find_single_use(itp, hash, &key);
+    if (cached) {
+      cstr_free(&key);
+      cached_result = _tcci_run_single_use(itp, cached, vargs);
+      if (result)
+        *result = cached_result;
+      return 0;
+    }
+  }
+
   int prv_igv = itp->in_single_use_state; // TODO -- shouldn't be anything but false but we'll see
   itp->in_single_use_state = 1;
+  itp->single_use.nb_refs = 0;
 
   // CStr
   CString str;
@@ -1102,7 +1882,13 @@ LIBTCCINTERPAPI int tcci_execute_single_use_code(TCCInterpState *itp, const char
   cstr_ccat(&str, '\0');
   // printf("temp_function:\n%s||\n", (char *)str.data);
   int res = tcci_add_string(itp, filename, str.data);
-  if (!res) {
+  if (!res && itp->single_use.cache_size) {
+    cached = _tcci_cache_single_use(itp, hash, &key);
+    cached_result = _tcci_run_single_use(itp, cached, vargs);
+    if (result)
+      *result = cached_result;
+  }
+  else if (!res) {
     // printf("tcci string added: %p\n", (void *)itp->single_use.func_ptr);
     // Invoke temporary function
     void *(*single_use_func)(void *) = itp->single_use.func_ptr;
@@ -1120,11 +1906,13 @@ LIBTCCINTERPAPI int tcci_execute_single_use_code(TCCInterpState *itp, const char
 
   // Cleanup ...
   cstr_free(&str);
+  cstr_free(&key);
   // puts("cleaning!");
 
-  if (itp->single_use.runtime_mem) {
-    free(itp->single_use.runtime_mem);
-    itp->single_use.runtime_mem = NULL;
+  if (itp->single_use.code_mem) {
+    tcci_arena_free(itp, itp->single_use.code_mem, itp->single_use.code_size);
+    tcci_arena_free(itp, itp->single_use.data_mem, itp->single_use.data_size);
+    itp->single_use.code_mem = itp->single_use.data_mem = NULL;
   }
   itp->single_use.func_ptr = NULL;
 
@@ -1141,6 +1929,20 @@ LIBTCCINTERPAPI void *tcci_get_symbol(TCCInterpState *itp, const char *symbol_na
   return NULL;
 }
 
+LIBTCCINTERPAPI int tcci_get_symbol_bytes(TCCInterpState *itp, const char *symbol_name, unsigned long *live,
+                                          unsigned long *dead)
+{
+  TCCISymbol *sym = hash_table_get(symbol_name, &itp->symbols);
+  if (!sym)
+    return -1;
+
+  if (live)
+    *live = sym->size;
+  if (dead)
+    *dead = sym->dead_size;
+  return 0;
+}
+
 LIBTCCINTERPAPI void tcci_define_symbol(TCCInterpState *itp, const char *sym, const char *value)
 {
   // TODO -- because im subtracting from this array, its silly/redundant to send to a method that
@@ -1154,6 +1956,8 @@ LIBTCCINTERPAPI void tcci_define_symbol(TCCInterpState *itp, const char *sym, co
   else
     str = NULL;
   dynarray_add(&itp->cmdline_defs, &itp->nb_cmdline_def_pairs, str);
+
+  _tcci_free_header_snapshot(itp);
 }
 
 /* undefine a preprocessor symbol */
@@ -1168,13 +1972,15 @@ LIBTCCINTERPAPI void tcci_undefine_symbol(TCCInterpState *itp, const char *sym)
       itp->nb_cmdline_def_pairs -= 2;
     }
   }
+
+  _tcci_free_header_snapshot(itp);
 }
 
 LIBTCCINTERPAPI void tcci_set_global_symbol(TCCInterpState *itp, const char *symbol_name, void *addr)
 {
   // tcc_load_object_file
   // TODO -- this method just redirects...
-  tcci_set_interp_symbol(itp, "doesn't-matter-while-binding-is-STB_GLOBAL", symbol_name, STB_GLOBAL, STT_FUNC, addr);
+  tcci_set_interp_symbol(itp, "doesn't-matter-while-binding-is-STB_GLOBAL", symbol_name, STB_GLOBAL, STT_FUNC, addr, 0);
   // TCCISymbol *sym = NULL;
   // for (int i = 0; i < itp->nb_symbols; ++i) {
   //   if (!strcmp(symbol_name, itp->symbols[i]->name)) {
@@ -2576,6 +3382,41 @@ LIBTCCAPI void tcc_set_options(TCCState *s, const char *r)
   dynarray_reset(&argv, &argc);
 }
 
+/* monotonic clock for the timings of tcc_get_stats() */
+ST_FUNC uint64_t tcc_clock_ns(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (uint64_t)count.QuadPart / freq.QuadPart * 1000000000 +
+         (uint64_t)count.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+ST_FUNC void tcc_add_stats(TCCStats *to, const TCCStats *from)
+{
+  to->pp_ns += from->pp_ns;
+  to->gen_ns += from->gen_ns;
+  to->got_ns += from->got_ns;
+  to->relocate_syms_ns += from->relocate_syms_ns;
+  to->relocate_sections_ns += from->relocate_sections_ns;
+  to->dlsym_ns += from->dlsym_ns;
+  to->set_pages_ns += from->set_pages_ns;
+  to->code_bytes += from->code_bytes;
+  to->data_bytes += from->data_bytes;
+  to->nb_compiles += from->nb_compiles;
+  to->nb_dlsym += from->nb_dlsym;
+  to->nb_set_pages += from->nb_set_pages;
+  to->nb_redirected_calls += from->nb_redirected_calls;
+}
+
+LIBTCCAPI void tcc_get_stats(TCCState *s1, TCCStats *stats) { *stats = s1->stats; }
+
 PUB_FUNC void tcc_print_stats(TCCState *s1, unsigned total_time)
 {
   if (total_time < 1)
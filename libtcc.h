@@ -106,6 +106,10 @@ LIBTCCAPI void *tcc_get_symbol(TCCState *s, const char *name);
 LIBTCCAPI void tcc_list_symbols(TCCState *s, void *ctx,
                                 void (*symbol_cb)(void *ctx, const char *name, const void *val));
 
+/* copy the compilation statistics of the context into *stats. The preprocessing time (pp_ns)
+   is only measured with option -bench */
+LIBTCCAPI void tcc_get_stats(TCCState *s, TCCStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
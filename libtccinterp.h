@@ -6,6 +6,24 @@
 struct TCCInterpState;
 typedef struct TCCInterpState TCCInterpState;
 
+/* compilation statistics, see tcci_get_stats() and tcc_get_stats(). Times are nanoseconds
+   of the monotonic clock; for files compiled in parallel they are summed over the threads */
+typedef struct TCCStats {
+  unsigned long long pp_ns;                /* preprocessing & lexing, only measured while enabled */
+  unsigned long long gen_ns;               /* parsing & code generation (compile time less pp_ns) */
+  unsigned long long got_ns;               /* build_got_entries() */
+  unsigned long long relocate_syms_ns;     /* symbol relocation, dlsym_ns included */
+  unsigned long long relocate_sections_ns; /* relocate_section() of all sections */
+  unsigned long long dlsym_ns;             /* resolving symbols from the loaded libraries */
+  unsigned long long set_pages_ns;         /* making memory executable */
+  unsigned long long code_bytes;           /* text emitted */
+  unsigned long long data_bytes;           /* data & bss emitted */
+  unsigned long nb_compiles;               /* files & strings compiled */
+  unsigned long nb_dlsym;
+  unsigned long nb_set_pages;
+  unsigned long nb_redirected_calls; /* call sites compiled to reach an interpreted function */
+} TCCStats;
+
 /* create a new TCC interpretation context */
 LIBTCCINTERPAPI TCCInterpState *tcci_new(void);
 
@@ -14,12 +32,79 @@ LIBTCCINTERPAPI void tcci_delete(TCCInterpState *ds);
 
 LIBTCCINTERPAPI void tcci_set_Werror(TCCInterpState *ds, unsigned char value);
 
+/* how calls to interpreted functions reach the latest definition of the callee */
+#define TCCI_REDIRECT_HASH_LOOKUP 0 /* look the callee up by name hash on every call (default) */
+#define TCCI_REDIRECT_CELLS 1       /* call through a patchable jump cell per function */
+
+/* set the redirection mode for code compiled from now on. Returns -1 if the mode is
+   not supported on this target */
+LIBTCCINTERPAPI int tcci_set_redirect_mode(TCCInterpState *ds, int mode);
+
+/* set the optimization level (as with -O) for code compiled from now on. From 1 on, scalar
+   locals whose address is never taken are kept in callee-saved registers where the target
+   supports it (x86_64), calls to inline functions whose body is a single return statement (or
+   expression statement) are expanded in place unless incremental compilation is enabled, and
+   __OPTIMIZE__ is defined. From 2 on, the code of each function
+   also gets a peephole pass (x86_64) which turns reloads of just stored locals into register
+   moves and removes jumps to the next instruction */
+LIBTCCINTERPAPI void tcci_set_optimize(TCCInterpState *ds, int level);
+
 LIBTCCINTERPAPI int tcci_add_include_path(TCCInterpState *ds, const char *pathname);
 
+/* add a library for the code compiled from now on. The external symbols of compiled code are
+   resolved with dlsym() once per interpretation context and the results (found or not) are
+   reused by later compilations; adding a library discards them */
 LIBTCCINTERPAPI int tcci_add_library(TCCInterpState *ds, const char *libname);
 
 LIBTCCINTERPAPI int tcci_add_library_path(TCCInterpState *ds, const char *libpath);
 
+/* enable/disable compiling against a header snapshot: the #include <...> lines a source
+   starts with are parsed once and the resulting macros and declarations are reused by
+   later compilations which start with the same include lines. Changing include paths
+   or defines discards the snapshots */
+LIBTCCINTERPAPI void tcci_set_header_snapshot(TCCInterpState *ds, unsigned char enabled);
+
+/* keep the outcome of include file lookups in a file under @dir (NULL, the default, disables
+   it) shared by the processes using the same directory: which candidate paths of an #include
+   don't exist and which headers have an include guard. Later compilations, in this or another
+   process, then skip trying the missing paths and opening the headers whose guard is already
+   defined. An entry is dropped when the mtime of the directory of a missing path, or the mtime
+   or size of a header, changed. Not used by the tcci_add_files() worker threads */
+LIBTCCINTERPAPI void tcci_set_include_cache(TCCInterpState *ds, const char *dir);
+
+/* enable/disable incremental compilation: each function and file scope variable definition
+   is fingerprinted by its tokens and by the declarations of the identifiers it uses. When a
+   file is compiled again only the definitions whose fingerprint changed get compiled, the
+   others are bound to their existing code, and variables to their existing storage (keeping
+   their values). Disabling forgets the fingerprints */
+LIBTCCINTERPAPI void tcci_set_incremental(TCCInterpState *ds, unsigned char enabled);
+
+/* copy the statistics of all compilations since the interpretation context was created or
+   tcci_reset_stats() was called into *stats */
+LIBTCCINTERPAPI void tcci_get_stats(TCCInterpState *ds, TCCStats *stats);
+
+LIBTCCINTERPAPI void tcci_reset_stats(TCCInterpState *ds);
+
+/* symbols for profilers of the functions relocated from now on, flags is 0 (the default)
+   or any of: */
+#define TCCI_PERF_MAP 1     /* append "address size name" lines to /tmp/perf-<pid>.map */
+#define TCCI_PERF_JITDUMP 2 /* write the code of each function to /tmp/jit-<pid>.dump, for perf inject --jit */
+/* Each body, including those of redefinitions, gets its own entry; static functions are
+   named "name [filename]". Single use code is not listed. The files are shared by the
+   contexts of the process. Returns -1, leaving the setting unchanged, if a file can't be
+   opened or the host is not Linux */
+LIBTCCINTERPAPI int tcci_set_perf_map(TCCInterpState *ds, int flags);
+
+/* enable/disable describing the units relocated from now on to debuggers (GDB JIT interface):
+   an in-memory ELF object with the symbols and the unwind info of the functions of each unit
+   is registered through __jit_debug_register_code() until the unit is released. Returns -1
+   if not supported on this target */
+LIBTCCINTERPAPI int tcci_set_debugger_info(TCCInterpState *ds, unsigned char enabled);
+
+/* enable/disable measuring pp_ns, which costs two clock reads per token. While disabled the
+   preprocessing time is part of gen_ns */
+LIBTCCINTERPAPI void tcci_set_pp_timing(TCCInterpState *ds, unsigned char enabled);
+
 /* compile & link a c-code file-like declaration */
 LIBTCCINTERPAPI int tcci_add_string(TCCInterpState *ds, const char *filename, const char *str);
 
@@ -36,13 +121,48 @@ LIBTCCINTERPAPI int tcci_add_string(TCCInterpState *ds, const char *filename, co
 LIBTCCINTERPAPI int tcci_execute_single_use_code(TCCInterpState *ds, const char *filename, int root_statement_count,
                                                  const char **root_statements, const char *code, void *vargs,
                                                  void **result);
+
+/* keep the compiled code of up to nb_entries (0, the default, disables it) distinct
+   tcci_execute_single_use_code() calls and run it again when called with the same filename,
+   root statements and code while the defines and include paths are the same, instead of
+   compiling again. The least recently used code is released to make room, and code is
+   released as soon as a function it uses is redefined. Static variables of cached code keep
+   their values between runs */
+LIBTCCINTERPAPI void tcci_set_single_use_cache(TCCInterpState *ds, int nb_entries);
+
 /* compile a group of C-files then link */
 LIBTCCINTERPAPI int tcci_add_files(TCCInterpState *ds, const char **files, unsigned nb_files);
 
+/* number of threads tcci_add_files() compiles the files on, each into an object state
+   of its own which are then merged before relocation. 1 (the default) compiles them one
+   after another in the calling thread, 0 uses one thread per core. The header snapshot
+   is not used by the worker threads */
+LIBTCCINTERPAPI void tcci_set_compile_threads(TCCInterpState *ds, int nb_threads);
+
 LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *ds);
 
 LIBTCCINTERPAPI void *tcci_get_symbol(TCCInterpState *ds, const char *symbol_name);
 
+/* get the name of the interpreted function whose code contains @pc, or NULL. Superseded
+   bodies are found until tcci_collect() releases them; single use code is not. *filename and
+   *offset, the distance of @pc from the start of the body, are set unless NULL. The lookup is
+   a binary search which takes no lock and allocates nothing, so it may be called from a
+   signal handler, but not during tcci_collect() or tcci_delete(). It returns NULL when it
+   interrupts a compilation of the same thread in the middle of updating the index */
+LIBTCCINTERPAPI const char *tcci_find_symbol_by_addr(TCCInterpState *ds, const void *pc, const char **filename,
+                                                     unsigned long *offset);
+
+/* get the bytes of the current body of a function (live) and of its superseded bodies which
+   have not been released yet (dead). Returns -1 if there is no such symbol */
+LIBTCCINTERPAPI int tcci_get_symbol_bytes(TCCInterpState *ds, const char *symbol_name, unsigned long *live,
+                                          unsigned long *dead);
+
+/* release the memory of compilations whose functions have all been redefined since, returns
+   the number of bytes released. Call it only at a quiescent point: no superseded function may
+   be running (on any thread's stack) and no pointer to a superseded function or to the
+   data of its compilation may be used afterwards */
+LIBTCCINTERPAPI unsigned long tcci_collect(TCCInterpState *ds);
+
 /* Sets a symbols address (append or update)
    NOTE: NOT YET PROPERLY IMPLEMENTED. It will also redirect internal interpreter calls if those calls
      were from seperate compilation units (ie. different calls to add_files,execute_single_use_code,add_string).
@@ -380,17 +380,26 @@ extern long double strtold(const char *__nptr, char **__endptr);
 #define ONE_SOURCE 1
 #endif
 
-/* support using libtcc from threads */
+/* support using libtcc from threads: the compiler globals are thread-local so
+   that states on different threads compile in parallel. Where the compiler
+   has no thread-local storage one semaphore serializes all states instead */
+#if defined __TINYC__
+#define TCC_TLS
 #define CONFIG_TCC_SEMLOCK
+#elif defined _MSC_VER
+#define TCC_TLS __declspec(thread)
+#else
+#define TCC_TLS __thread
+#endif
 
 #if ONE_SOURCE
 #define ST_INLN static inline
 #define ST_FUNC static
-#define ST_DATA static
+#define ST_DATA static TCC_TLS
 #else
 #define ST_INLN
 #define ST_FUNC
-#define ST_DATA extern
+#define ST_DATA extern TCC_TLS
 #endif
 
 #ifdef TCC_PROFILE /* profile all functions */
@@ -598,6 +607,7 @@ typedef struct Section {
   addr_t sh_addr;          /* address at which the section is relocated */
   unsigned long sh_offset; /* file offset */
   int nb_hashed_syms;      /* used to resize the hash table */
+  int sym_index;           /* STT_SECTION symbol in the current file, see put_section_sym() */
   struct Section *link;    /* link to another section */
   struct Section *reloc;   /* corresponding section for relocation, if any */
   struct Section *hash;    /* hash table for symbols */
@@ -647,6 +657,7 @@ typedef struct DLLReference {
 #define TYPE_DIRECT 2   /* type with variable */
 
 #define IO_BUF_SIZE 8192
+#define IO_BUF_PAD 32 /* readable bytes from buf_end on, for the vector scans of the lexer */
 
 typedef struct BufferedFile {
   uint8_t *buf_ptr;
@@ -661,6 +672,9 @@ typedef struct BufferedFile {
   int include_next_index; /* next search path */
   char filename[1024];    /* filename */
   char *true_filename;    /* filename not modified by # line directive */
+  uint8_t *map;           /* the whole file when it is mapped instead of read into buffer */
+  size_t map_size;        /* size of the mapping, which starts a page before map */
+  uint64_t stamp, size;   /* of the file when it was opened, with an include cache only */
   unsigned char unget[4];
   unsigned char buffer[1]; /* extra size for CH_EOB char */
 } BufferedFile;
@@ -697,6 +711,8 @@ typedef struct AttributeDef {
 typedef struct InlineFunc {
   TokenString *func_str;
   Sym *sym;
+  unsigned char from_snapshot; /* func_str->str is owned by a header snapshot */
+  signed char expand;          /* calls are expanded (1) or not (-1), 0 if not known yet */
   char filename[1];
 } InlineFunc;
 
@@ -705,11 +721,59 @@ typedef struct InlineFunc {
 typedef struct CachedInclude {
   int ifndef_macro;
   int once;
-  int hash_next;    /* -1 if none */
-  char filename[1]; /* path specified in #include */
+  int hash_next;         /* -1 if none */
+  unsigned char missing; /* there is no such file */
+  uint64_t stamp, size;  /* see IncludeCache */
+  char filename[1];      /* path specified in #include */
 } CachedInclude;
 
-#define CACHED_INCLUDES_HASH_SIZE 32
+#define CACHED_INCLUDES_HASH_SIZE 256
+
+/* include file cache kept on disk between processes, see tcci_set_include_cache().
+   It remembers which files are missing and the include guards of the files which
+   exist. An entry is used only while the mtime and size of its file (the mtime of
+   the directory for a missing file) are the same as when it was recorded */
+typedef struct IncludeCache {
+  char *path;              /* of the cache file */
+  CachedInclude **entries; /* the name of the guard macro follows the filename */
+  int nb_entries;
+  int hash[CACHED_INCLUDES_HASH_SIZE];
+  int dirty; /* entries changed since the file was read */
+} IncludeCache;
+
+/* parsed header state (tokens, macros, global symbols) which is kept alive
+   between interpreter compilations, see tcci_set_header_snapshot() */
+typedef struct TCCIHeaderSnapshot {
+  int valid;          /* 0 while being captured, 1 once it can be reused */
+  char **includes;    /* '#include' lines the snapshot was built from */
+  int nb_includes;
+  int pinned;         /* in use by a pending tcci_add_files(), not evicted */
+
+  /* preprocessor state (tccpp.c) */
+  TokenSym **table_ident;
+  TokenSym **hash_ident;
+  int tok_ident;
+  struct TinyAlloc *toksym_alloc, *tokstr_alloc;
+  int pp_once;
+  Sym *define_stack;
+  Sym **active_defines; /* macros visible at the end of the snapshot */
+  int nb_active_defines;
+  CachedInclude **cached_includes;
+  int nb_cached_includes;
+  int cached_includes_hash[CACHED_INCLUDES_HASH_SIZE];
+
+  /* code generator state (tccgen.c) */
+  Sym *global_stack;
+  Sym **syms;      /* global syms of the snapshot and their pristine copies, */
+  Sym *sym_copies; /* restored after each compilation that may patch them */
+  int nb_syms;
+  void **sym_pools;
+  int nb_sym_pools;
+  Sym *sym_free_first;
+  int anon_sym;
+  struct InlineFunc **inline_fns;
+  int nb_inline_fns;
+} TCCIHeaderSnapshot;
 
 #ifdef CONFIG_TCC_ASM
 typedef struct ExprValue {
@@ -887,6 +951,16 @@ struct TCCState {
   struct InlineFunc **inline_fns;
   int nb_inline_fns;
 
+  /* header snapshot to capture (when not yet valid) or to compile against */
+  TCCIHeaderSnapshot *header_snapshot;
+  /* on-disk include cache of the interpreter, NULL if not used */
+  IncludeCache *include_cache;
+  /* interpreter: symtab index to the source filename of the symbol */
+  hash_table_t *sym_index_to_filename;
+  /* interpreter: definitions compiled in incremental mode, recorded once relocated */
+  struct TCCIPendingDef *pending_defs;
+  int nb_pending_defs;
+
   /* sections */
   Section **sections;
   int nb_sections; /* number of sections, including first dummy section */
@@ -968,6 +1042,7 @@ struct TCCState {
   int total_lines;
   int total_bytes;
   int total_output[3];
+  TCCStats stats; /* see tcc_get_stats() */
 
   /* option -dnum (for general development purposes) */
   int g_debug;
@@ -988,26 +1063,131 @@ struct TCCState {
   char **argv;
 };
 
+/* targets with jump stubs for TCCI_REDIRECT_CELLS */
+#if defined TCC_TARGET_X86_64
+#define TCCI_HAVE_REDIRECT_CELLS
+#endif
+
+/* one half (code or data) of an interpreter arena */
+typedef struct TCCIArenaHeap {
+  addr_t start, end;   /* address range */
+  addr_t top;          /* bump pointer */
+  addr_t committed;    /* pages below are accessible */
+  addr_t *free_ranges; /* [begin, end) pairs of freed memory below top */
+  int nb_free_ranges;  /* number of addresses in free_ranges */
+  int exec;            /* pages are committed executable */
+  int fd;              /* file of the pages when mapped twice, else -1 */
+  addr_t alias;        /* the writable view of the pages is at their address + alias, 0 if none */
+} TCCIArenaHeap;
+
+/* address range which the code and data of compiled units are allocated from */
+typedef struct TCCIArena {
+  void *base;
+  addr_t size;
+  void *alias; /* reserved for the writable view of the code */
+  TCCIArenaHeap code, data;
+} TCCIArena;
+
 typedef struct TCCISymbol {
   char *name, *filename;
   u_char binding;
   u_char type;
   void *addr;
+  struct TCCIUnit *unit; /* holding the body at addr, NULL for host functions */
+  addr_t size;           /* bytes of the body at addr */
+  addr_t dead_size;      /* bytes of superseded bodies not reclaimed yet */
 
-  unsigned nb_got_users;
+  /* GOT entries of compiled units holding addr, an open addressed set of
+     got_users_size (0 or a power of 2) slots of which nb_got_users are not NULL */
+  unsigned nb_got_users, got_users_size;
   void **got_users;
 } TCCISymbol;
 
+/* a name looked up with dlsym(), addr is NULL if there was no such symbol */
+typedef struct TCCIResolvedSym {
+  void *addr;
+  char name[1];
+} TCCIResolvedSym;
+
+/* a function body placed by a unit */
+typedef struct TCCIBody {
+  TCCISymbol *sym;
+  void *addr;
+  addr_t size;
+} TCCIBody;
+
+/* arena memory of one relocated compilation and the bodies it holds */
+typedef struct TCCIUnit {
+  void *code, *data;
+  addr_t code_size, data_size;
+  TCCIBody *bodies;
+  int nb_bodies;
+  int nb_live; /* bodies which are not superseded */
+  struct TCCIJitEntry *jit_entry; /* registered with debuggers, see tcci_set_debugger_info() */
+} TCCIUnit;
+
+/* the code range of a function body, see tcci_find_symbol_by_addr() */
+typedef struct TCCIAddrRange {
+  addr_t start, end;
+  TCCISymbol *sym;
+} TCCIAddrRange;
+
+/* the ranges of the bodies of all units sorted by address. Replaced by a copy twice as
+   large when full, so that it is never moved while being read */
+typedef struct TCCIAddrIndex {
+  int nb, size;
+  TCCIAddrRange ranges[1];
+} TCCIAddrIndex;
+
+/* units can be described to debuggers through the GDB JIT interface */
+#if defined TCC_TARGET_X86_64 && !defined TCC_TARGET_PE
+#define TCCI_DEBUGGER_INFO
+#endif
+
+/* what incremental mode knows of the last compilation of a top level definition */
+typedef struct TCCIDefinition {
+  unsigned long fingerprint; /* of its tokens and of the declarations they use */
+  void *addr;                /* storage of a variable (functions are found in symbols) */
+  addr_t size;
+  struct TCCIUnit *unit; /* holding the variable */
+} TCCIDefinition;
+
+/* a definition compiled in incremental mode */
+typedef struct TCCIPendingDef {
+  unsigned long key; /* hash of its name (* filename for static definitions) */
+  unsigned long fingerprint;
+  int sym_index; /* in symtab_section */
+} TCCIPendingDef;
+
+/* relocated single-use code kept for reuse */
+typedef struct TCCISingleUseEntry {
+  unsigned long hash; /* of the key */
+  char *key;          /* the source, its filename and the compile options, compared on a hit */
+  int key_size;
+  void *func_ptr;
+  void *code_mem, *data_mem;
+  addr_t code_size, data_size;
+  unsigned long *refs; /* its code is dropped when one of these is redefined */
+  int nb_refs;
+  unsigned last_use;
+  int running;   /* calls of func_ptr in progress */
+  int dropped;   /* released when the last call returns */
+} TCCISingleUseEntry;
+
 struct TCCInterpState {
   TCCState *s1;
 
   unsigned char warn_error;
   int debug_verbose;
 
-  void **runtime_mem_blocks; /* pointer to execution text blocks */
-  int nb_runtime_mem_blocks; /* number thereof */
+  TCCIArena **arenas; /* memory of compiled units */
+  int nb_arenas;       /* number thereof */
+  TCCIUnit **units;    /* relocated units, reclaimed by tcci_collect() */
+  int nb_units;        /* number thereof */
+  TCCIUnit *unit;      /* unit whose symbols are being set */
   uint64_t runtime_mem_size;
   hash_table_t symbols; /* hashed by function-name (* filename for static functions) */
+  hash_table_t resolved_syms; /* TCCIResolvedSym by name hash, emptied by tcci_add_library() */
 
   int nb_cmdline_def_pairs;
   char **cmdline_defs;
@@ -1019,11 +1199,35 @@ struct TCCInterpState {
   char **include_paths;
   int nb_include_paths;
 
+  unsigned char use_header_snapshot;
+  TCCIHeaderSnapshot **header_snapshots; /* one per include set, least recently used first */
+  int nb_header_snapshots;
+  IncludeCache *include_cache; /* see tcci_set_include_cache() */
+
+  int nb_compile_threads; /* tcci_add_files() workers, 1 compiles in the calling thread */
+  unsigned char optimize; /* -O level of the compilations, see tcci_set_optimize() */
+
+  TCCStats stats;         /* of the compilations done, see tcci_get_stats() */
+  unsigned char pp_timing; /* measure stats.pp_ns, see tcci_set_pp_timing() */
+  unsigned char perf_flags; /* profiler symbol files written, see tcci_set_perf_map() */
+  unsigned char debugger_info; /* register units with debuggers, see tcci_set_debugger_info() */
+
+  unsigned char incremental; /* recompile changed definitions only, see tcci_set_incremental() */
+  hash_table_t definitions;  /* TCCIDefinition by the key of TCCIPendingDef */
+  void *compile_lock;     /* held around shared state while workers compile */
+
   int in_single_use_state;
   struct {
     unsigned uid_counter;
     void *func_ptr;
-    void *runtime_mem;
+    void *code_mem, *data_mem; /* released after execution (unless cached) */
+    addr_t code_size, data_size;
+    unsigned long *refs; /* hashes of the interpreted functions the code uses */
+    int nb_refs;
+
+    TCCISingleUseEntry **cache; /* see tcci_set_single_use_cache() */
+    int nb_cache, cache_size;
+    unsigned clock; /* for the least recently used entry */
   } single_use;
 
   struct {
@@ -1037,10 +1241,23 @@ struct TCCInterpState {
 
   struct {
     hash_table_t sym_index_to_filename;
-    hash_table_t hash_to_addr, addr_to_addr;
+    hash_table_t hash_to_addr;
+    hash_table_t addr_to_sym; /* superseded function addresses to their TCCISymbol */
     TCCISymbol *get_by_hash_sym, *get_by_addr_sym;
     int do_subst;
+
+    unsigned char mode;          /* TCCI_REDIRECT_HASH_LOOKUP or TCCI_REDIRECT_CELLS */
+    hash_table_t hash_to_cell;   /* function hash to its redirect cell */
+    unsigned char **cell_blocks; /* executable blocks the cells are taken from */
+    int nb_cell_blocks, nb_block_cells;
   } redir;
+
+  struct {
+    TCCIAddrIndex *volatile index; /* see tcci_find_symbol_by_addr() */
+    volatile unsigned seq;         /* odd while the index changes */
+    TCCIAddrIndex **retired;       /* outgrown indexes, freed by tcci_collect() */
+    int nb_retired;
+  } addr_index;
 };
 
 struct filespec {
@@ -1161,6 +1378,7 @@ struct filespec {
 #define TOK_SHL '<'    /* shift left */
 #define TOK_SAR '>'    /* signed shift right */
 #define TOK_SHR 0x8b   /* unsigned shift right */
+#define TOK_PACK 0x8c  /* #pragma pack state change, followed by the state as TOK_CINT */
 
 #define TOK_ARROW 0xa0     /* -> */
 #define TOK_DOTS 0xa1      /* three dots */
@@ -1374,6 +1592,7 @@ ST_FUNC Sym *global_identifier_push(int v, int t, int c);
 ST_FUNC void tcc_open_bf(TCCState *s1, const char *filename, int initlen);
 ST_FUNC int tcc_open(TCCState *s1, const char *filename);
 ST_FUNC void tcc_close(void);
+ST_FUNC uint64_t tcc_file_stamp(const char *filename, int fd, uint64_t *size);
 
 ST_FUNC int tcc_add_file_internal(TCCState *s1, const char *filename, int flags);
 /* flags: */
@@ -1409,6 +1628,8 @@ ST_FUNC void tcc_add_btstub(TCCState *s1);
 ST_FUNC void tcc_add_pragma_libs(TCCState *s1);
 PUB_FUNC int tcc_add_library_err(TCCState *s, const char *f);
 PUB_FUNC void tcc_print_stats(TCCState *s, unsigned total_time);
+ST_FUNC uint64_t tcc_clock_ns(void);
+ST_FUNC void tcc_add_stats(TCCStats *to, const TCCStats *from);
 PUB_FUNC int tcc_parse_args(TCCState *s, int *argc, char ***argv, int optind);
 #ifdef _WIN32
 ST_FUNC char *normalize_slashes(char *path);
@@ -1433,6 +1654,7 @@ ST_DATA const int *macro_ptr;
 ST_DATA int parse_flags;
 ST_DATA int tok_flags;
 ST_DATA CString tokcstr; /* current parsed string, if any */
+ST_DATA TokenString *pack_record_str; /* token string #pragma pack changes are recorded into */
 
 /* display benchmark infos */
 ST_DATA int tok_ident;
@@ -1470,6 +1692,8 @@ ST_FUNC void tok_str_free(TokenString *s);
 ST_FUNC void tok_str_free_str(int *str);
 ST_FUNC void tok_str_add(TokenString *s, int t);
 ST_FUNC void tok_str_add_tok(TokenString *s);
+ST_FUNC unsigned long tok_str_hash(const int *str, unsigned long (*ident_hash)(void *opaque, int v), void *opaque);
+ST_FUNC int tok_str_next(const int **pp);
 ST_INLN void define_push(int v, int macro_type, int *str, Sym *first_arg);
 ST_FUNC void define_undef(Sym *s);
 ST_INLN Sym *define_find(int v);
@@ -1485,6 +1709,10 @@ ST_FUNC void preprocess_start(TCCState *s1, int filetype);
 ST_FUNC void preprocess_end(TCCState *s1);
 ST_FUNC void tccpp_new(TCCState *s);
 ST_FUNC void tccpp_delete(TCCState *s);
+ST_FUNC void tccpp_snapshot_free(TCCIHeaderSnapshot *hs);
+ST_FUNC IncludeCache *include_cache_load(const char *dir);
+ST_FUNC void include_cache_save(IncludeCache *ic);
+ST_FUNC void include_cache_free(IncludeCache *ic);
 ST_FUNC int tcc_preprocess(TCCState *s1);
 ST_FUNC void skip(int c);
 ST_FUNC NORETURN void expect(const char *msg);
@@ -1514,6 +1742,8 @@ ST_DATA int nocode_wanted; /* true if no code generation wanted for an expressio
 ST_DATA int global_expr;   /* true if compound literals must be allocated globally (used during initializers parsing */
 ST_DATA CType func_vt;     /* current function return type (used by return instruction) */
 ST_DATA int func_var;      /* true if current function is variadic */
+ST_DATA int func_regvars;  /* true if locals of the current function may be in registers (-O) */
+ST_DATA int func_code_fixed; /* the code of the current function may not be moved (asm, label addresses) */
 ST_DATA int func_vc;
 ST_DATA const char *funcname;
 
@@ -1529,6 +1759,7 @@ ST_FUNC void tcc_debug_line(TCCState *s1);
 ST_FUNC void tccgen_init(TCCState *s1);
 ST_FUNC int tccgen_compile(TCCState *s1);
 ST_FUNC void tccgen_finish(TCCState *s1);
+ST_FUNC void tccgen_snapshot_free(TCCIHeaderSnapshot *hs);
 ST_FUNC void check_vstack(void);
 
 ST_INLN int is_float(int t);
@@ -1625,6 +1856,7 @@ ST_FUNC void greloca(Section *s, Sym *sym, unsigned long offset, int type, addr_
 ST_FUNC int put_elf_str(Section *s, const char *sym);
 ST_FUNC int put_elf_sym(Section *s, addr_t value, unsigned long size, int info, int other, int shndx, const char *name);
 ST_FUNC int set_elf_sym(Section *s, addr_t value, unsigned long size, int info, int other, int shndx, const char *name);
+ST_FUNC int put_section_sym(Section *symtab, Section *s);
 ST_FUNC int find_elf_sym(Section *s, const char *name);
 ST_FUNC void put_elf_reloc(Section *symtab, Section *s, unsigned long offset, int type, int symbol);
 ST_FUNC void put_elf_reloca(Section *symtab, Section *s, unsigned long offset, int type, int symbol, addr_t addend);
@@ -1642,6 +1874,8 @@ ST_FUNC ssize_t full_read(int fd, void *buf, size_t count);
 ST_FUNC void *load_data(int fd, unsigned long file_offset, unsigned long size);
 ST_FUNC int tcc_object_type(int fd, ElfW(Ehdr) * h);
 ST_FUNC int tcc_load_object_file(TCCState *s1, int fd, unsigned long file_offset);
+ST_FUNC int tcci_merge_state(TCCState *s1, TCCState *s);
+ST_FUNC void tcci_add_pending_def(TCCState *s1, unsigned long key, unsigned long fingerprint, int sym_index);
 ST_FUNC int tcc_load_archive(TCCState *s1, int fd, int alacarte);
 ST_FUNC void add_array(TCCState *s1, const char *sec, int c);
 
@@ -1757,6 +1991,19 @@ ST_FUNC void gen_vla_result(int addr);
 #endif
 ST_FUNC void gen_cvt_sxtw(void);
 ST_FUNC void gen_cvt_csti(int t);
+#ifdef TCC_REGVAR_BASE
+ST_FUNC int gen_regvar_alloc(void);
+ST_FUNC void gen_regvar_free(int c);
+#endif
+#ifdef TCC_PEEPHOLE
+ST_FUNC void gen_peephole_free(void);
+#endif
+#ifdef TCC_JUMP_TABLES
+ST_FUNC void gjmp_table(int *targets, int nb);
+#endif
+#ifdef TCC_STRUCT_COPY_MAX
+ST_FUNC void gen_struct_copy(int size);
+#endif
 #endif
 
 /* ------------ arm-gen.c ------------ */
@@ -1861,6 +2108,17 @@ ST_FUNC void *dlsym(void *handle, const char *symbol);
 #endif
 ST_FUNC void tcc_run_free(TCCState *s1);
 #endif
+ST_FUNC void *tcci_get_redirect_cell(TCCInterpState *itp, unsigned long hash);
+ST_FUNC void tcci_set_interp_symbol(TCCInterpState *itp, const char *filename, const char *symbol_name,
+                                    u_char binding, u_char type, void *addr, addr_t size);
+ST_FUNC void tcci_add_got_user(TCCISymbol *sym, void *got_entry);
+ST_FUNC void tcci_arena_free(TCCInterpState *itp, void *ptr, addr_t size);
+ST_FUNC int tcci_arena_in_reach(TCCInterpState *itp, void *ptr);
+ST_FUNC void tcci_single_use_ref(TCCInterpState *itp, unsigned long hash);
+ST_FUNC void tcci_single_use_invalidate(TCCInterpState *itp, unsigned long hash);
+ST_FUNC void tcci_lock(TCCInterpState *itp);
+ST_FUNC void tcci_unlock(TCCInterpState *itp);
+ST_FUNC void tcci_arenas_delete(TCCInterpState *itp);
 
 /* ------------ tcctools.c ----------------- */
 #if 0 /* included in tcc.c */
@@ -1875,9 +2133,9 @@ ST_FUNC void gen_makedeps(TCCState *s, const char *target, const char *filename)
 /********************************************************/
 #undef ST_DATA
 #if ONE_SOURCE
-#define ST_DATA static
+#define ST_DATA static TCC_TLS
 #else
-#define ST_DATA
+#define ST_DATA TCC_TLS
 #endif
 /********************************************************/
 
@@ -139,6 +139,7 @@ ST_FUNC void tccelf_delete(TCCState *s1)
   /* free loaded dlls array */
   dynarray_reset(&s1->loaded_dlls, &s1->nb_loaded_dlls);
   tcc_free(s1->sym_attrs);
+  tcc_free(s1->pending_defs);
 
   symtab_section = NULL; /* for tccrun.c:rt_printline() */
 }
@@ -151,6 +152,8 @@ ST_FUNC void tccelf_begin_file(TCCState *s1)
   for (i = 1; i < s1->nb_sections; i++) {
     s = s1->sections[i];
     s->sh_offset = s->data_offset;
+    /* the relocations of a file only refer to its own symbols */
+    s->sym_index = 0;
   }
   /* disable symbol hashing during compilation */
   s = s1->symtab, s->reloc = s->hash, s->hash = NULL;
@@ -183,21 +186,25 @@ ST_FUNC void tccelf_end_file(TCCState *s1)
     tr[i] = set_elf_sym(s, sym->st_value, sym->st_size, sym->st_info, sym->st_other, sym->st_shndx,
                         (char *)s->link->data + sym->st_name);
 
-    if (first_sym + i != tr[i] && tcci_state && tcci_state->redir.do_subst) {
+    if (first_sym + i != tr[i] && tcci_state && tcci_state->redir.do_subst && s1->sym_index_to_filename) {
       // TCCI sym index to filename adjustment
-      fn = hash_table_get_by_hash((unsigned long)(first_sym + i), &tcci_state->redir.sym_index_to_filename);
+      fn = hash_table_get_by_hash((unsigned long)(first_sym + i), s1->sym_index_to_filename);
 
       // printf("> elf-end-file : %i:'%s' >> %i", first_sym + i, (const char *)fn, tr[i]);
 
       if (fn) {
-        hash_table_remove((unsigned long)(first_sym + i), &tcci_state->redir.sym_index_to_filename);
-        hash_table_set_by_hash((unsigned long)tr[i], fn, &tcci_state->redir.sym_index_to_filename);
+        hash_table_remove((unsigned long)(first_sym + i), s1->sym_index_to_filename);
+        hash_table_set_by_hash((unsigned long)tr[i], fn, s1->sym_index_to_filename);
       }
     }
     // printf("\n");
     // usleep(1000);
   }
 
+  for (i = 0; i < s1->nb_pending_defs; ++i)
+    if (s1->pending_defs[i].sym_index >= first_sym)
+      s1->pending_defs[i].sym_index = tr[s1->pending_defs[i].sym_index - first_sym];
+
   /* now update relocations */
   for (i = 1; i < s1->nb_sections; i++) {
     Section *sr = s1->sections[i];
@@ -218,6 +225,9 @@ ST_FUNC void tccelf_end_file(TCCState *s1)
     s = s1->sections[i + 1];
     s1->total_output[i] += s->data_offset - s->sh_offset;
   }
+  s1->stats.code_bytes += s1->sections[1]->data_offset - s1->sections[1]->sh_offset;
+  s1->stats.data_bytes += s1->sections[2]->data_offset - s1->sections[2]->sh_offset + s1->sections[3]->data_offset -
+                          s1->sections[3]->sh_offset;
 }
 
 ST_FUNC Section *new_section(TCCState *s1, const char *name, int sh_type, int sh_flags)
@@ -746,6 +756,15 @@ ST_FUNC int set_elf_sym(Section *s, addr_t value, unsigned long size, int info,
   return sym_index;
 }
 
+/* return the STT_SECTION symbol of section s, created on first use in the current
+   file and shared by all relocations against the section */
+ST_FUNC int put_section_sym(Section *symtab, Section *s)
+{
+  if (!s->sym_index)
+    s->sym_index = put_elf_sym(symtab, 0, 0, ELFW(ST_INFO)(STB_LOCAL, STT_SECTION), 0, s->sh_num, NULL);
+  return s->sym_index;
+}
+
 /* put relocation */
 ST_FUNC void put_elf_reloca(Section *symtab, Section *s, unsigned long offset, int type, int symbol, addr_t addend)
 {
@@ -902,6 +921,40 @@ ST_FUNC struct sym_attr *get_sym_attr(TCCState *s1, int index, int alloc)
 //     tcc_free(old_to_new_syms);
 // }
 
+#if defined TCC_IS_NATIVE && !defined TCC_TARGET_PE
+/* dlsym(RTLD_DEFAULT, name), counted and timed for tcc_get_stats() */
+static void *tcc_dlsym_default(TCCState *s1, const char *name)
+{
+  uint64_t start = tcc_clock_ns();
+  void *addr = dlsym(RTLD_DEFAULT, name);
+
+  s1->stats.dlsym_ns += tcc_clock_ns() - start;
+  ++s1->stats.nb_dlsym;
+  return addr;
+}
+
+/* tcc_dlsym_default() through the cache of the interpreter, which also keeps the
+   names that were not found (the functions of interpreted units are looked up
+   here first). A name whose hash is taken by another one is not cached */
+static void *tcci_dlsym(TCCInterpState *itp, TCCState *s1, const char *name)
+{
+  unsigned long hash = hash_djb2((const unsigned char *)name);
+  TCCIResolvedSym *r = hash_table_get_by_hash(hash, &itp->resolved_syms);
+  void *addr;
+
+  if (r && !strcmp(r->name, name))
+    return r->addr;
+  addr = tcc_dlsym_default(s1, name);
+  if (!r) {
+    r = tcc_malloc(sizeof(TCCIResolvedSym) + strlen(name));
+    r->addr = addr;
+    strcpy(r->name, name);
+    hash_table_set_by_hash(hash, r, &itp->resolved_syms);
+  }
+  return addr;
+}
+#endif
+
 /* relocate symbol table, resolve undefined symbols if do_resolve is
    true and output error if undefined symbol. */
 ST_FUNC void relocate_syms(TCCState *s1, Section *symtab, int do_resolve)
@@ -934,9 +987,9 @@ ST_FUNC void relocate_syms(TCCState *s1, Section *symtab, int do_resolve)
 #ifdef TCC_TARGET_MACHO
         /* The symbols in the symtables have a prepended '_'
            but dlsym() needs the undecorated name.  */
-        void *addr = dlsym(RTLD_DEFAULT, name + 1);
+        void *addr = tcc_dlsym_default(s1, name + 1);
 #else
-        void *addr = dlsym(RTLD_DEFAULT, name);
+        void *addr = tcc_dlsym_default(s1, name);
 #endif
         if (addr) {
           sym->st_value = (addr_t)addr;
@@ -984,6 +1037,30 @@ ST_FUNC void relocate_syms(TCCState *s1, Section *symtab, int do_resolve)
   }
 }
 
+/* index the GOT relocations by the symbol of symtab they are against: the result holds
+   for each symbol 1 + the index of its first GOT relocation (0 if none), *pnext for each
+   relocation 1 + the index of the next one against the same symbol */
+#if defined TCC_IS_NATIVE && !defined TCC_TARGET_PE
+static int *tcci_index_got_relocs(TCCState *s1, Section *symtab, int **pnext)
+{
+  int nb_syms = symtab->data_offset / sizeof(ElfW(Sym));
+  int nb_rels = s1->got->reloc ? s1->got->reloc->data_offset / sizeof(ElfW_Rel) : 0;
+  int *first = tcc_mallocz(nb_syms * sizeof(int));
+  int *next = tcc_malloc((nb_rels + 1) * sizeof(int));
+  int i, sym_index;
+
+  for (i = nb_rels; i-- > 0;) {
+    sym_index = ELFW(R_SYM)(((ElfW_Rel *)s1->got->reloc->data)[i].r_info);
+    if (sym_index < nb_syms) {
+      next[i] = first[sym_index];
+      first[sym_index] = i + 1;
+    }
+  }
+  *pnext = next;
+  return first;
+}
+#endif
+
 /* relocate symbol table, resolve undefined symbols if do_resolve is
    true and output error if undefined symbol. */
 ST_FUNC void tcci_relocate_syms(TCCInterpState *ds, Section *symtab, int do_resolve, int set_resolve)
@@ -1000,7 +1077,8 @@ ST_FUNC void tcci_relocate_syms(TCCInterpState *ds, Section *symtab, int do_reso
   //     sym->st_shndx, sym->st_value);
   //     }}
   ElfW(Sym) * sym;
-  int sym_bind, sh_num;
+  int sym_bind, sh_num, sym_index, i;
+  int *got_first = NULL, *got_next = NULL;
   const char *name;
 
   for_each_elem(symtab, 1, sym, ElfW(Sym))
@@ -1019,9 +1097,9 @@ ST_FUNC void tcci_relocate_syms(TCCInterpState *ds, Section *symtab, int do_reso
 #ifdef TCC_TARGET_MACHO
         /* The symbols in the symtables have a prepended '_'
            but dlsym() needs the undecorated name.  */
-        void *addr = dlsym(RTLD_DEFAULT, name + 1);
+        void *addr = tcci_dlsym(ds, s1, name + 1);
 #else
-        void *addr = dlsym(RTLD_DEFAULT, name);
+        void *addr = tcci_dlsym(ds, s1, name);
 #endif
         if (addr) {
           sym->st_value = (addr_t)addr;
@@ -1043,37 +1121,26 @@ ST_FUNC void tcci_relocate_syms(TCCInterpState *ds, Section *symtab, int do_reso
             sym->st_value = (Elf64_Addr)itp_sym->addr;
             // printf("interp_symbol_resolved: '%s' -> 0x%lx\n", name, sym->st_value);
 
-            // Find the GOT global addr
-            // s1->got->reloc
-            // TODO performance improvements
-
-            if (ds->in_single_use_state)
+            if (ds->in_single_use_state) {
+              tcci_single_use_ref(ds, hash);
               continue;
+            }
 
             // Register usage of the global symbol (to allow for redirection for the case of redefinition)
-            ElfW_Rel *rel;
-            for_each_elem(s1->got->reloc, 0, rel, ElfW_Rel)
-            {
-              int rel_sym_index = ELFW(R_SYM)(rel->r_info);
-              ElfW(Sym) * rel_sym;
-              rel_sym = &((ElfW(Sym) *)symtab_section->data)[rel_sym_index];
-
-              if (!strcmp(name, (char *)symtab_section->link->data + rel_sym->st_name)) {
-                void *tgt = (void *)((u_char *)s1->got->sh_addr + rel->r_offset);
-                // printf("GOT: sec:%s sym:%s shndx:%u index:%i addr:%p rel_offset:%p\n", s1->got->reloc->name,
-                //        (char *)symtab_section->link->data + rel_sym->st_name, rel_sym->st_shndx, got_reloc_index,
-                //        tgt, rel->r_offset);
-
-                // TODO -- Do not allow redefinition of a function (IF it redefines the parameter signature) without
-                // delivering a warning NO further checking will be done or ensured - It will be assumed the user
-                // knows of all function calls and has fixed them prior
-
-                // printf("added user to symbol '%s'\n", itp_sym->name);
-
-                // TODO -- make this collection a hash-set
-                dynarray_add(&itp_sym->got_users, &itp_sym->nb_got_users, tgt);
-                goto found;
+            if (!got_first)
+              got_first = tcci_index_got_relocs(s1, symtab, &got_next);
+            sym_index = sym - (ElfW(Sym) *)symtab->data;
+            if (got_first[sym_index]) {
+              // TODO -- Do not allow redefinition of a function (IF it redefines the parameter signature) without
+              // delivering a warning NO further checking will be done or ensured - It will be assumed the user
+              // knows of all function calls and has fixed them prior
+
+              /* both the GOT and the PLT entry of a function called and having its address taken */
+              for (i = got_first[sym_index]; i; i = got_next[i - 1]) {
+                ElfW_Rel *rel = (ElfW_Rel *)s1->got->reloc->data + i - 1;
+                tcci_add_got_user(itp_sym, (u_char *)s1->got->sh_addr + rel->r_offset);
               }
+              goto found;
             }
             tcc_error_noabort("could not find got-entry for usage of symbol '%s'", name);
           }
@@ -1118,6 +1185,8 @@ ST_FUNC void tcci_relocate_syms(TCCInterpState *ds, Section *symtab, int do_reso
     }
   found:;
   }
+  tcc_free(got_first);
+  tcc_free(got_next);
 }
 
 /* relocate a given section (CPU dependent) by applying the relocations
@@ -3097,6 +3166,184 @@ the_end:
   return ret;
 }
 
+/* record a definition compiled in incremental mode */
+ST_FUNC void tcci_add_pending_def(TCCState *s1, unsigned long key, unsigned long fingerprint, int sym_index)
+{
+  TCCIPendingDef *pd;
+
+  if (!(s1->nb_pending_defs & 15))
+    s1->pending_defs = tcc_realloc(s1->pending_defs, (s1->nb_pending_defs + 16) * sizeof(TCCIPendingDef));
+  pd = s1->pending_defs + s1->nb_pending_defs++;
+  pd->key = key;
+  pd->fingerprint = fingerprint;
+  pd->sym_index = sym_index;
+}
+
+/* merge the sections and symbols of a state which compiled a file on its own into s1,
+   the way tcc_load_object_file() merges an object file. The filenames of the symbols of
+   s (see put_extern_sym2) move over to s1 */
+ST_FUNC int tcci_merge_state(TCCState *s1, TCCState *s)
+{
+  SectionMergeInfo *sm_table, *sm;
+  Section *sec, *ss;
+  ElfW(Sym) * sym;
+  ElfW_Rel *rel;
+  int i, j, nb_syms, sym_index, ret, stab_index, stabstr_index;
+  int *old_to_new_syms;
+  unsigned long offseti;
+  const char *name;
+  void *fn;
+
+  sm_table = tcc_mallocz(sizeof(SectionMergeInfo) * s->nb_sections);
+  old_to_new_syms = NULL;
+  stab_index = stabstr_index = 0;
+
+  for (i = 1; i < s->nb_sections; i++) {
+    ss = s->sections[i];
+    /* .common has no data of its own */
+    if (ss->sh_num != i)
+      continue;
+    sec = ss->sh_type == SHT_RELX ? s->sections[ss->sh_info] : ss;
+    /* same section types as tcc_load_object_file() */
+    if (sec->sh_type != SHT_PROGBITS && sec->sh_type != SHT_NOBITS && sec->sh_type != SHT_PREINIT_ARRAY &&
+        sec->sh_type != SHT_INIT_ARRAY && sec->sh_type != SHT_FINI_ARRAY && strcmp(sec->name, ".stabstr"))
+      continue;
+
+    for (j = 1; j < s1->nb_sections; j++) {
+      sec = s1->sections[j];
+      if (!strcmp(sec->name, ss->name)) {
+        if (stab_section) {
+          if (sec == stab_section)
+            stab_index = i;
+          if (sec == stab_section->link)
+            stabstr_index = i;
+        }
+        goto found;
+      }
+    }
+    sec = new_section(s1, ss->name, ss->sh_type, ss->sh_flags);
+    sec->sh_addralign = ss->sh_addralign;
+    sec->sh_entsize = ss->sh_entsize;
+    sm_table[i].new_section = 1;
+  found:
+    if (sec->sh_type != ss->sh_type) {
+      tcc_error_noabort("invalid section type");
+      goto fail;
+    }
+    /* align start of section */
+    sec->data_offset += -sec->data_offset & (ss->sh_addralign - 1);
+    if (ss->sh_addralign > sec->sh_addralign)
+      sec->sh_addralign = ss->sh_addralign;
+    sm_table[i].offset = sec->data_offset;
+    sm_table[i].s = sec;
+    /* concatenate sections */
+    if (ss->sh_type != SHT_NOBITS)
+      memcpy(section_ptr_add(sec, ss->data_offset), ss->data, ss->data_offset);
+    else
+      sec->data_offset += ss->data_offset;
+  }
+
+  /* relocate stab strings */
+  if (stab_index && stabstr_index) {
+    Stab_Sym *a, *b;
+    unsigned o;
+    sec = sm_table[stab_index].s;
+    a = (Stab_Sym *)(sec->data + sm_table[stab_index].offset);
+    b = (Stab_Sym *)(sec->data + sec->data_offset);
+    o = sm_table[stabstr_index].offset;
+    while (a < b) {
+      if (a->n_strx)
+        a->n_strx += o;
+      a++;
+    }
+  }
+
+  /* update sh_link and sh_info fields of new sections */
+  for (i = 1; i < s->nb_sections; i++) {
+    sec = sm_table[i].s;
+    if (!sec || !sm_table[i].new_section)
+      continue;
+    ss = s->sections[i];
+    if (ss->link)
+      sec->link = ss->link == s->symtab ? s1->symtab : sm_table[ss->link->sh_num].s;
+    if (ss->sh_type == SHT_RELX) {
+      sec->sh_info = sm_table[ss->sh_info].s->sh_num;
+      /* update backward link */
+      s1->sections[sec->sh_info]->reloc = sec;
+    }
+  }
+
+  /* resolve symbols */
+  nb_syms = s->symtab->data_offset / sizeof(ElfW(Sym));
+  old_to_new_syms = tcc_mallocz(nb_syms * sizeof(int));
+
+  for (i = 1; i < nb_syms; i++) {
+    sym = (ElfW(Sym) *)s->symtab->data + i;
+    if (sym->st_shndx != SHN_UNDEF && sym->st_shndx < SHN_LORESERVE) {
+      sm = &sm_table[sym->st_shndx];
+      /* if no corresponding section added, no need to add symbol */
+      if (!sm->s)
+        continue;
+      /* convert section number */
+      sym->st_shndx = sm->s->sh_num;
+      /* offset value */
+      sym->st_value += sm->offset;
+    }
+    /* add symbol */
+    name = (char *)s->symtab->link->data + sym->st_name;
+    sym_index = set_elf_sym(s1->symtab, sym->st_value, sym->st_size, sym->st_info, sym->st_other, sym->st_shndx, name);
+    old_to_new_syms[i] = sym_index;
+
+    /* the filename of the symbol moves over */
+    if (s->sym_index_to_filename && s1->sym_index_to_filename) {
+      fn = hash_table_get_by_hash((unsigned long)i, s->sym_index_to_filename);
+      if (fn) {
+        hash_table_set_by_hash((unsigned long)i, NULL, s->sym_index_to_filename);
+        hash_table_set_by_hash((unsigned long)sym_index, fn, s1->sym_index_to_filename);
+      }
+    }
+  }
+
+  /* as do its incremental definitions */
+  for (i = 0; i < s->nb_pending_defs; i++)
+    tcci_add_pending_def(s1, s->pending_defs[i].key, s->pending_defs[i].fingerprint,
+                         old_to_new_syms[s->pending_defs[i].sym_index]);
+
+  /* patch relocation entries */
+  for (i = 1; i < s->nb_sections; i++) {
+    sec = sm_table[i].s;
+    ss = s->sections[i];
+    if (!sec || ss->sh_type != SHT_RELX)
+      continue;
+    /* take relocation offset information */
+    offseti = sm_table[ss->sh_info].offset;
+    for_each_elem(sec, (sm_table[i].offset / sizeof(*rel)), rel, ElfW_Rel)
+    {
+      int type;
+      unsigned sym_index;
+      /* convert symbol index */
+      type = ELFW(R_TYPE)(rel->r_info);
+      sym_index = ELFW(R_SYM)(rel->r_info);
+      if (sym_index >= nb_syms || !old_to_new_syms[sym_index]) {
+        tcc_error_noabort("Invalid relocation entry [%2d] '%s' @ %.8x", i, ss->name, (int)rel->r_offset);
+        goto fail;
+      }
+      rel->r_info = ELFW(R_INFO)(old_to_new_syms[sym_index], type);
+      /* offset the relocation offset */
+      rel->r_offset += offseti;
+    }
+  }
+
+  ret = 0;
+the_end:
+  tcc_free(old_to_new_syms);
+  tcc_free(sm_table);
+  return ret;
+fail:
+  ret = -1;
+  goto the_end;
+}
+
 typedef struct ArchiveHeader {
   char ar_name[16]; /* name of this member */
   char ar_date[12]; /* file mtime */
@@ -3133,13 +3380,24 @@ static int read_ar_header(int fd, int offset, ArchiveHeader *hdr)
   return len;
 }
 
-/* load only the objects which resolve undefined symbols */
+static unsigned ar_name_hash(const char *p)
+{
+  unsigned h = 2166136261u;
+  while (*p)
+    h = (h ^ (unsigned char)*p++) * 16777619u;
+  return h;
+}
+
+/* load only the objects which resolve undefined symbols. The archive index is
+   hashed by name once, then the undefined symbols of symtab_section are looked
+   up in it in order, including those added by the objects loaded meanwhile */
 static int tcc_load_alacarte(TCCState *s1, int fd, int size, int entrysize)
 {
-  int i, bound, nsyms, sym_index, len, ret = -1;
+  int i, nsyms, sym_index, len, hsize, h, ret = -1;
+  int *hash = NULL;
   unsigned long long off;
   uint8_t *data;
-  const char *ar_names, *p;
+  const char *ar_names, *p, *name, **names = NULL;
   const uint8_t *ar_index;
   ElfW(Sym) * sym;
   ArchiveHeader hdr;
@@ -3151,32 +3409,49 @@ static int tcc_load_alacarte(TCCState *s1, int fd, int size, int entrysize)
   ar_index = data + entrysize;
   ar_names = (char *)ar_index + nsyms * entrysize;
 
-  do {
-    bound = 0;
-    for (p = ar_names, i = 0; i < nsyms; i++, p += strlen(p) + 1) {
-      Section *s = symtab_section;
-      sym_index = find_elf_sym(s, p);
-      if (!sym_index)
-        continue;
-      sym = &((ElfW(Sym) *)s->data)[sym_index];
-      if (sym->st_shndx != SHN_UNDEF)
-        continue;
-      off = get_be(ar_index + i * entrysize, entrysize);
-      len = read_ar_header(fd, off, &hdr);
-      if (len <= 0 || memcmp(hdr.ar_fmag, ARFMAG, 2)) {
-        tcc_error_noabort("invalid archive");
-        goto the_end;
-      }
-      off += len;
-      if (s1->verbose == 2)
-        printf("   -> %s\n", hdr.ar_name);
-      if (tcc_load_object_file(s1, fd, off) < 0)
-        goto the_end;
-      ++bound;
+  /* archive symbol name -> 1 + its first index entry */
+  for (hsize = 16; hsize < 2 * nsyms; hsize *= 2)
+    ;
+  hash = tcc_mallocz(hsize * sizeof(int));
+  names = tcc_malloc((nsyms + 1) * sizeof(char *));
+  for (p = ar_names, i = 0; i < nsyms; i++, p += strlen(p) + 1) {
+    names[i] = p;
+    for (h = ar_name_hash(p) & (hsize - 1); hash[h]; h = (h + 1) & (hsize - 1))
+      if (!strcmp(names[hash[h] - 1], p))
+        break;
+    if (!hash[h])
+      hash[h] = i + 1;
+  }
+
+  for (sym_index = 1; sym_index < (int)(symtab_section->data_offset / sizeof(ElfW(Sym))); sym_index++) {
+    sym = &((ElfW(Sym) *)symtab_section->data)[sym_index];
+    if (sym->st_shndx != SHN_UNDEF || ELFW(ST_BIND)(sym->st_info) == STB_LOCAL || !sym->st_name)
+      continue;
+    name = (char *)symtab_section->link->data + sym->st_name;
+    for (h = ar_name_hash(name) & (hsize - 1); hash[h]; h = (h + 1) & (hsize - 1))
+      if (!strcmp(names[hash[h] - 1], name))
+        break;
+    if (!hash[h])
+      continue;
+    i = hash[h] - 1;
+    /* the object might not define it after all, don't load it again for it */
+    names[i] = "";
+    off = get_be(ar_index + i * entrysize, entrysize);
+    len = read_ar_header(fd, off, &hdr);
+    if (len <= 0 || memcmp(hdr.ar_fmag, ARFMAG, 2)) {
+      tcc_error_noabort("invalid archive");
+      goto the_end;
     }
-  } while (bound);
+    off += len;
+    if (s1->verbose == 2)
+      printf("   -> %s\n", hdr.ar_name);
+    if (tcc_load_object_file(s1, fd, off) < 0)
+      goto the_end;
+  }
   ret = 0;
 the_end:
+  tcc_free(names);
+  tcc_free(hash);
   tcc_free(data);
   return ret;
 }
@@ -37,18 +37,19 @@ ST_DATA Sym *define_stack;
 ST_DATA Sym *global_label_stack;
 ST_DATA Sym *local_label_stack;
 
-static Sym *sym_free_first;
-static void **sym_pools;
-static int nb_sym_pools;
+static TCC_TLS Sym *sym_free_first;
+static TCC_TLS void **sym_pools;
+static TCC_TLS int nb_sym_pools;
 
-static Sym *all_cleanups, *pending_gotos;
-static int local_scope;
-static int in_sizeof;
-static int in_generic;
-static int section_sym;
+static TCC_TLS Sym *all_cleanups, *pending_gotos;
+static TCC_TLS int local_scope;
+static TCC_TLS int in_sizeof;
+static TCC_TLS int in_generic;
+static TCC_TLS int section_sym;
+static TCC_TLS int inline_depth; /* nested expansions of inline function calls */
 
 ST_DATA SValue *vtop;
-static SValue _vstack[1 + VSTACK_SIZE];
+static TCC_TLS SValue _vstack[1 + VSTACK_SIZE];
 #define vstack (_vstack + 1)
 
 ST_DATA int const_wanted;                               /* true if constant wanted */
@@ -97,10 +98,15 @@ ST_DATA int global_expr; /* true if compound literals must be allocated globally
 ST_DATA CType func_vt;   /* current function return type (used by return instruction) */
 ST_DATA int func_var;    /* true if current function is variadic (used by return instruction) */
 ST_DATA int func_vc;
-static int last_line_num, new_file, func_ind; /* debug info control */
+ST_DATA int func_regvars;
+ST_DATA int func_code_fixed;
+#ifdef TCC_REGVAR_BASE
+static TCC_TLS int *regvar_addressed, nb_regvar_addressed; /* identifiers which follow a '&' */
+#endif
+static TCC_TLS int last_line_num, new_file, func_ind; /* debug info control */
 ST_DATA const char *funcname;
 ST_DATA CType int_type, func_old_type, char_type, char_pointer_type;
-static CString initstr;
+static TCC_TLS CString initstr;
 
 #if PTR_SIZE == 4
 #define VT_SIZE_T (VT_INT | VT_UNSIGNED)
@@ -133,9 +139,9 @@ ST_DATA struct temp_local_variable {
   short size;
   short align;
 } arr_temp_local_vars[MAX_TEMP_LOCAL_VARIABLE_NUMBER];
-short nb_temp_local_vars;
+static TCC_TLS short nb_temp_local_vars;
 
-static struct scope {
+static TCC_TLS struct scope {
   struct scope *prev;
   struct {
     int loc, num;
@@ -201,16 +207,16 @@ static const struct {
     {VT_VOID, "void:t27=27"},
 };
 
-static int debug_next_type;
+static TCC_TLS int debug_next_type;
 
-static struct debug_hash {
+static TCC_TLS struct debug_hash {
   int debug_type;
   Sym *type;
 } * debug_hash;
 
-static int n_debug_hash;
+static TCC_TLS int n_debug_hash;
 
-static struct debug_info {
+static TCC_TLS struct debug_info {
   int start;
   int end;
   int n_sym;
@@ -258,7 +264,13 @@ static void vpush(CType *type);
 static int gvtst(int inv, int t);
 static void gen_inline_functions(TCCState *s);
 static void free_inline_functions(TCCState *s);
+static int gen_inline_call(void);
+static void tccgen_snapshot_begin(TCCState *s1, TCCIHeaderSnapshot *hs);
+static void tccgen_snapshot_end(TCCState *s1, TCCIHeaderSnapshot *hs);
 static void skip_or_save_block(TokenString **str);
+#ifdef TCC_REGVAR_BASE
+static int regvar_alloc(CType *type, AttributeDef *ad, int v);
+#endif
 static void gv_dup(void);
 static int get_temp_local_var(int size, int align);
 static void clear_temp_local_var_list();
@@ -755,6 +767,9 @@ ST_FUNC void tcc_debug_eincl(TCCState *s1)
 /* initialize vstack and types.  This must be done also for tcc -E */
 ST_FUNC void tccgen_init(TCCState *s1)
 {
+  if (s1->header_snapshot && s1->header_snapshot->valid)
+    tccgen_snapshot_begin(s1, s1->header_snapshot);
+
   vtop = vstack - 1;
   memset(vtop, 0, sizeof *vtop);
 
@@ -782,10 +797,13 @@ ST_FUNC int tccgen_compile(TCCState *s1)
   cur_text_section = NULL;
   funcname = "";
   anon_sym = SYM_FIRST_ANOM;
+  if (s1->header_snapshot && s1->header_snapshot->valid)
+    anon_sym = s1->header_snapshot->anon_sym;
   section_sym = 0;
   const_wanted = 0;
   nocode_wanted = 0x80000000;
   local_scope = 0;
+  inline_depth = 0;
 
   tcc_debug_start(s1);
 #ifdef TCC_TARGET_ARM
@@ -807,6 +825,18 @@ ST_FUNC int tccgen_compile(TCCState *s1)
 ST_FUNC void tccgen_finish(TCCState *s1)
 {
   cstr_free(&initstr);
+#ifdef TCC_REGVAR_BASE
+  tcc_free(regvar_addressed);
+  regvar_addressed = NULL;
+  nb_regvar_addressed = 0;
+#endif
+#ifdef TCC_PEEPHOLE
+  gen_peephole_free();
+#endif
+  if (s1->header_snapshot) {
+    tccgen_snapshot_end(s1, s1->header_snapshot);
+    return;
+  }
   free_inline_functions(s1);
   sym_pop(&global_stack, NULL, 0);
   sym_pop(&local_stack, NULL, 0);
@@ -817,6 +847,128 @@ ST_FUNC void tccgen_finish(TCCState *s1)
   sym_free_first = NULL;
 }
 
+/* ------------------------------------------------------------------------- */
+/* interpreter header snapshots (see also tccpp_snapshot_end()) */
+
+static void tccgen_snapshot_begin(TCCState *s1, TCCIHeaderSnapshot *hs)
+{
+  struct InlineFunc *fn, *hfn;
+  int i, size;
+
+  global_stack = hs->global_stack;
+  sym_pools = hs->sym_pools;
+  nb_sym_pools = hs->nb_sym_pools;
+  sym_free_first = hs->sym_free_first;
+
+  /* inline functions of the headers share their saved tokens */
+  for (i = 0; i < hs->nb_inline_fns; ++i) {
+    hfn = hs->inline_fns[i];
+    size = sizeof *fn + strlen(hfn->filename);
+    fn = tcc_malloc(size);
+    memcpy(fn, hfn, size);
+    fn->func_str = tok_str_alloc();
+    fn->func_str->str = hfn->func_str->str;
+    fn->func_str->len = hfn->func_str->len;
+    fn->from_snapshot = 1;
+    dynarray_add(&s1->inline_fns, &s1->nb_inline_fns, fn);
+  }
+}
+
+static void tccgen_snapshot_end(TCCState *s1, TCCIHeaderSnapshot *hs)
+{
+  Sym *s;
+  int i;
+
+  sym_pop(&local_stack, NULL, 0);
+  if (!hs->valid) {
+    /* first compilation: keep everything the headers declared */
+    hs->inline_fns = s1->inline_fns;
+    hs->nb_inline_fns = s1->nb_inline_fns;
+    s1->inline_fns = NULL;
+    s1->nb_inline_fns = 0;
+
+    hs->global_stack = global_stack;
+    hs->define_stack = define_stack;
+    hs->nb_syms = 0;
+    for (s = global_stack; s; s = s->prev) {
+      /* elf symbol indices are only valid in this state */
+      if (s->r & VT_SYM)
+        s->c = 0;
+      ++hs->nb_syms;
+    }
+    for (s = define_stack; s; s = s->prev) {
+      if (define_find(s->v) == s)
+        dynarray_add(&hs->active_defines, &hs->nb_active_defines, s);
+      ++hs->nb_syms;
+    }
+    hs->syms = tcc_malloc(hs->nb_syms * sizeof(Sym *));
+    hs->sym_copies = tcc_malloc(hs->nb_syms * sizeof(Sym));
+    i = 0;
+    for (s = global_stack; s; s = s->prev)
+      hs->syms[i++] = s;
+    for (s = define_stack; s; s = s->prev)
+      hs->syms[i++] = s;
+    hs->anon_sym = anon_sym;
+  }
+  else {
+    free_inline_functions(s1);
+    sym_pop(&global_stack, hs->global_stack, 0);
+    free_defines(hs->define_stack);
+    /* undo #undef and #pragma pop_macro of snapshot macros */
+    for (s = hs->define_stack; s; s = s->prev)
+      if (!(s->v & SYM_FIELD))
+        table_ident[s->v - TOK_IDENT]->sym_define = NULL;
+    for (i = 0; i < hs->nb_active_defines; ++i) {
+      s = hs->active_defines[i];
+      table_ident[s->v - TOK_IDENT]->sym_define = s;
+    }
+  }
+  /* undo redeclarations, elf symbol assignments and macro push boundaries
+     of header symbols */
+  for (i = 0; i < hs->nb_syms; ++i) {
+    if (!hs->valid)
+      hs->sym_copies[i] = *hs->syms[i];
+    else
+      *hs->syms[i] = hs->sym_copies[i];
+  }
+  global_stack = define_stack = NULL;
+
+  hs->sym_pools = sym_pools;
+  hs->nb_sym_pools = nb_sym_pools;
+  hs->sym_free_first = sym_free_first;
+  sym_pools = NULL;
+  nb_sym_pools = 0;
+  sym_free_first = NULL;
+}
+
+ST_FUNC void tccgen_snapshot_free(TCCIHeaderSnapshot *hs)
+{
+  int i;
+
+  for (i = 0; i < hs->nb_inline_fns; ++i)
+    tok_str_free(hs->inline_fns[i]->func_str);
+  dynarray_reset(&hs->inline_fns, &hs->nb_inline_fns);
+
+  sym_pools = hs->sym_pools;
+  nb_sym_pools = hs->nb_sym_pools;
+  sym_free_first = hs->sym_free_first;
+  global_stack = hs->global_stack;
+  sym_pop(&global_stack, NULL, 0);
+  define_stack = hs->define_stack;
+  free_defines(NULL);
+  dynarray_reset(&sym_pools, &nb_sym_pools);
+  sym_free_first = NULL;
+
+  tcc_free(hs->active_defines);
+  hs->active_defines = NULL;
+  hs->nb_active_defines = 0;
+  tcc_free(hs->syms);
+  tcc_free(hs->sym_copies);
+  hs->syms = NULL;
+  hs->sym_copies = NULL;
+  hs->nb_syms = 0;
+}
+
 /* ------------------------------------------------------------------------- */
 ST_FUNC ElfSym *elfsym(Sym *s)
 {
@@ -928,7 +1080,7 @@ ST_FUNC void put_extern_sym2(Sym *sym, int sh_num, addr_t value, unsigned long s
 
     info = ELFW(ST_INFO)(sym_bind, sym_type);
     sym->c = put_elf_sym(symtab_section, value, size, info, other, sh_num, name);
-    if (tcci_state) {
+    if (tcci_state && tcc_state->sym_index_to_filename) {
       // const char *fn = tcc_strdup("this big word ookay dokaey");
       if (tcc_state->current_filename) {
         // printf("put_extern_sym2 sym->name:'%s' %i '%s' %p sym:%i\n", name, t, tcc_state->current_filename,
@@ -938,7 +1090,7 @@ ST_FUNC void put_extern_sym2(Sym *sym, int sh_num, addr_t value, unsigned long s
         // printf("tcci_state->redir.sym_index_to_filename:%i\n", tcci_state->redir.sym_index_to_filename.capacity);
         // TODO How many times are you copying this string per file ??? LOTS TOO MANY WAY TOO MUCH
         hash_table_set_by_hash((unsigned long)sym->c, tcc_strdup(tcc_state->current_filename),
-                               &tcci_state->redir.sym_index_to_filename);
+                               tcc_state->sym_index_to_filename);
 
         // if (sym->c == 69) {
         //   printf(">twas 69: '%s'\n", (const char *)hash_table_get_by_hash(69LU,
@@ -2013,6 +2165,14 @@ static void pop_local_syms(Sym **ptop, Sym *b, int keep, int ellipsis)
 #endif
   if (tcc_state->do_debug)
     tcc_add_debug_info(tcc_state, !local_scope, *ptop, b);
+#ifdef TCC_REGVAR_BASE
+  if (!keep) {
+    Sym *s;
+    for (s = *ptop; s != b; s = s->prev)
+      if ((s->r & (VT_VALMASK | VT_LVAL)) == (VT_LOCAL | VT_LVAL) && IS_REGVAR(s->c))
+        gen_regvar_free(s->c);
+  }
+#endif
   sym_pop(ptop, b, keep);
 }
 
@@ -3926,9 +4086,23 @@ ST_FUNC void vstore(void)
   if (sbt == VT_STRUCT) {
     /* if structure, only generate pointer */
     /* structure assignment : generate memcpy */
-    /* XXX: optimize if small size */
     size = type_size(&vtop->type, &align);
 
+#ifdef TCC_STRUCT_COPY_MAX
+    /* small ones are copied inline */
+    if (size <= TCC_STRUCT_COPY_MAX && !tcc_state->do_bounds_check) {
+      vswap();
+      vtop->type.t = VT_PTR;
+      gaddrof();
+      vpushv(vtop - 1);
+      vtop->type.t = VT_PTR;
+      gaddrof();
+      gen_struct_copy(size);
+      /* leave source on stack */
+      return;
+    }
+#endif
+
     /* destination */
     vswap();
 #ifdef CONFIG_TCC_BCHECK
@@ -5518,6 +5692,7 @@ static void parse_builtin_params(int nc, const char *args)
 ST_FUNC void subst_itp_by_faddr()
 {
   dba({ puts("=========subst_itp_by_faddr========"); });
+  ++tcc_state->stats.nb_redirected_calls;
 
   // Replace the previous
   CType was_type = vtop->type;
@@ -5671,6 +5846,7 @@ ST_FUNC void subst_itp_by_faddr()
       size = type_size(&s->type, &align);
       /* We're writing whole regs often, make sure there's enough
          space.  Assume register size is power of 2.  */
+      size = (size + regsize - 1) & -regsize;
       if (regsize > align)
         align = regsize;
       loc = (loc - size) & -align;
@@ -5728,36 +5904,48 @@ ST_FUNC void subst_itp_by_fname(int tok_ident)
     dba(printf("static method '%s' multiplying hash by '%s'\n", ident_name, tcc_state->current_filename));
     fh *= hash_djb2(tcc_state->current_filename);
   }
+  if (tcci_state->in_single_use_state)
+    tcci_single_use_ref(tcci_state, fh);
+  ++tcc_state->stats.nb_redirected_calls;
 
   int ft = vtop->type.t;
   Sym *was = vtop->type.ref;
   vpop();
 
-  // Push the function address of get_ptr_by_function_name
-  sym.f.func_type = FUNC_NEW;
-  sym.c = 0;
-  type.ref = &sym;
-  type.t = VT_LLONG;
-  v.i = (uint64_t)tcci_state->redir.get_by_hash_sym->addr;
-  vsetc(&type, VT_CONST, &v);
-  vtop->r &= ~VT_LVAL; /* no lvalue */
-
-  // Push the function hash argument
-  ptype.ref = NULL;
-  ptype.t = TOK_CLLONG;
-  v.i = fh;
-  vsetc(&ptype, VT_CONST, &v);
-
-  // Call it
-  gfunc_call(1);
+  if (tcci_state->redir.mode == TCCI_REDIRECT_CELLS) {
+    // Call through the redirect cell of the function
+    type.t = VT_PTR;
+    type.ref = fsym;
+    v.i = (uint64_t)tcci_get_redirect_cell(tcci_state, fh);
+    vsetc(&type, VT_CONST, &v);
+  }
+  else {
+    // Push the function address of get_ptr_by_function_name
+    sym.f.func_type = FUNC_NEW;
+    sym.c = 0;
+    type.ref = &sym;
+    type.t = VT_LLONG;
+    v.i = (uint64_t)tcci_state->redir.get_by_hash_sym->addr;
+    vsetc(&type, VT_CONST, &v);
+    vtop->r &= ~VT_LVAL; /* no lvalue */
+
+    // Push the function hash argument
+    ptype.ref = NULL;
+    ptype.t = TOK_CLLONG;
+    v.i = fh;
+    vsetc(&ptype, VT_CONST, &v);
+
+    // Call it
+    gfunc_call(1);
 
-  // Set fptr to top of stack
-  if (tcci_state && tcci_state->debug_verbose)
-    printf("ft:%i vtop=[%li] %i\n", ft, vtop - vstack, fsym->r);
-  type.t = VT_PTR;
-  type.ref = fsym;
-  v.i = 0;
-  vsetc(&type, 0, &v);
+    // Set fptr to top of stack
+    if (tcci_state && tcci_state->debug_verbose)
+      printf("ft:%i vtop=[%li] %i\n", ft, vtop - vstack, fsym->r);
+    type.t = VT_PTR;
+    type.ref = fsym;
+    v.i = 0;
+    vsetc(&type, 0, &v);
+  }
 
   /* function call */
   // printf("t:%s\n", get_tok_str(t, NULL));
@@ -5881,6 +6069,7 @@ ST_FUNC void subst_itp_by_fname(int tok_ident)
       size = type_size(&was->type, &align);
       /* We're writing whole regs often, make sure there's enough
          space.  Assume register size is power of 2.  */
+      size = (size + regsize - 1) & -regsize;
       if (regsize > align)
         align = regsize;
       loc = (loc - size) & -align;
@@ -6327,6 +6516,7 @@ tok_next:
     /* allow to take the address of a label */
     if (tok < TOK_UIDENT)
       expect("label identifier");
+    func_code_fixed = 1;
     s = label_find(tok);
     if (!s) {
       s = label_push(&global_label_stack, tok, LABEL_FORWARD);
@@ -6539,6 +6729,9 @@ tok_next:
       Sym *sa;
       int nb_args, ret_nregs, ret_align, regsize, variadic;
 
+      if (gen_inline_call())
+        continue;
+
       /* function call */
       // printf("tcci_state:%p\n", tcci_state);
       if (tcci_state && tcci_state->redir.do_subst) {
@@ -6875,7 +7068,7 @@ static int precedence(int tok)
     return 0;
   }
 }
-static unsigned char prec[256];
+static TCC_TLS unsigned char prec[256];
 static void init_prec(void)
 {
   int i;
@@ -7266,12 +7459,74 @@ static int case_cmpu(const void *pa, const void *pb)
 
 static void gtst_addr(int t, int a) { gsym_addr(gvtst(0, t), a); }
 
+#ifdef TCC_JUMP_TABLES
+static void gcase(struct case_t **base, int len, int *bsym);
+
+/* the number of values from the first case to the last one, less one */
+#define CASE_SPAN(base, i, j) ((uint64_t)(base)[(j)-1]->v2 - (uint64_t)(base)[i]->v1)
+
+/* jump through a table for the cases base[0..len-1] when all but at most 8 of them, the
+   farthest from the others, cover at least a quarter of the values from their first to
+   their last, and those are more than 8. The others are compared when the value is out of
+   the range of the table. Returns 0 if the cases are too sparse */
+static int gcase_table(struct case_t **base, int len, int *bsym)
+{
+  struct case_t *rest[8];
+  uint64_t lo, n, v;
+  int *targets, i = 0, j = len, e;
+  int ll = (vtop->type.t & VT_BTYPE) == VT_LLONG;
+
+  if (nocode_wanted)
+    return 0;
+  while (CASE_SPAN(base, i, j) >= (uint64_t)(j - i) * 4) {
+    e = len - (j - i);
+    if (j - i <= 9 || e == 8)
+      return 0;
+    if ((uint64_t)base[i + 1]->v1 - base[i]->v2 > (uint64_t)base[j - 1]->v1 - base[j - 2]->v2)
+      rest[e] = base[i++];
+    else
+      rest[e] = base[--j];
+  }
+  lo = base[i]->v1, n = CASE_SPAN(base, i, j);
+  targets = tcc_malloc((n + 1) * sizeof(int));
+  memset(targets, -1, (n + 1) * sizeof(int));
+  for (e = i; e < j; ++e)
+    for (v = base[e]->v1 - lo; v <= base[e]->v2 - lo; ++v)
+      targets[v] = base[e]->sym;
+
+  /* x - lo, compared unsigned with the last index */
+  gv_dup();
+  if (ll)
+    vpushll(lo);
+  else
+    vpushi(lo);
+  gen_op('-');
+  vdup();
+  if (ll)
+    vpushll(n);
+  else
+    vpushi(n);
+  gen_op(TOK_UGT);
+  e = gvtst(0, 0);
+  gjmp_table(targets, n + 1);
+  tcc_free(targets);
+  gsym(e);
+  /* the holes of the table lead here too */
+  gcase(rest, len - (j - i), bsym);
+  return 1;
+}
+#endif
+
 static void gcase(struct case_t **base, int len, int *bsym)
 {
   struct case_t *p;
   int e;
   int ll = (vtop->type.t & VT_BTYPE) == VT_LLONG;
   while (len > 8) {
+#ifdef TCC_JUMP_TABLES
+    if (gcase_table(base, len, bsym))
+      return;
+#endif
     /* binary search */
     p = base[len / 2];
     vdup();
@@ -7767,6 +8022,7 @@ again:
     skip(';');
   }
   else if (t == TOK_ASM1 || t == TOK_ASM2 || t == TOK_ASM3) {
+    func_code_fixed = 1;
     asm_instr();
   }
   else {
@@ -7828,10 +8084,11 @@ again:
    i.e. "({)}" is accepted.  */
 static void skip_or_save_block(TokenString **str)
 {
+  TokenString *saved_pack_record_str = pack_record_str;
   int braces = tok == '{';
   int level = 0;
   if (str)
-    *str = tok_str_alloc();
+    pack_record_str = *str = tok_str_alloc();
 
   while ((level > 0 || (tok != '}' && tok != ',' && tok != ';' && tok != ')'))) {
     int t;
@@ -7857,9 +8114,33 @@ static void skip_or_save_block(TokenString **str)
   if (str) {
     tok_str_add(*str, -1);
     tok_str_add(*str, 0);
+    pack_record_str = saved_pack_record_str;
   }
 }
 
+/* save the block at tok to be parsed right away from the saved tokens: the #pragma pack
+   changes in it happened while saving and are replayed with the tokens, so the pack state
+   is set back to what it was at the start of the block */
+static void save_block_for_replay(TokenString **str, int *pack_state)
+{
+  TCCState *s1 = tcc_state;
+
+  memcpy(pack_state, s1->pack_stack, sizeof s1->pack_stack);
+  pack_state[PACK_STACK_SIZE] = s1->pack_stack_ptr - s1->pack_stack;
+  skip_or_save_block(str);
+}
+
+static void begin_block_replay(TokenString *str, const int *pack_state)
+{
+  TCCState *s1 = tcc_state;
+
+  memcpy(s1->pack_stack, pack_state, sizeof s1->pack_stack);
+  s1->pack_stack_ptr = s1->pack_stack + pack_state[PACK_STACK_SIZE];
+  unget_tok(0);
+  begin_macro(str, 1);
+  next();
+}
+
 #define EXPR_CONST 1
 #define EXPR_ANY 2
 
@@ -8592,21 +8873,28 @@ static void decl_initializer_alloc(CType *type, AttributeDef *ad, int r, int has
 
   if ((r & VT_VALMASK) == VT_LOCAL) {
     sec = NULL;
+    addr = 0;
+#ifdef TCC_REGVAR_BASE
+    if (v)
+      addr = regvar_alloc(type, ad, v);
+#endif
+    if (!addr) {
 #ifdef CONFIG_TCC_BCHECK
-    if (bcheck && v) {
-      /* add padding between stack variables for bound checking */
-      loc--;
-    }
+      if (bcheck && v) {
+        /* add padding between stack variables for bound checking */
+        loc--;
+      }
 #endif
-    loc = (loc - size) & -align;
-    addr = loc;
-    p.local_offset = addr + size;
+      loc = (loc - size) & -align;
+      addr = loc;
 #ifdef CONFIG_TCC_BCHECK
-    if (bcheck && v) {
-      /* add padding between stack variables for bound checking */
-      loc--;
-    }
+      if (bcheck && v) {
+        /* add padding between stack variables for bound checking */
+        loc--;
+      }
 #endif
+    }
+    p.local_offset = addr + size;
     if (v) {
       /* local variable */
 #ifdef CONFIG_TCC_ASM
@@ -8741,10 +9029,69 @@ no_alloc:
   nocode_wanted = saved_nocode_wanted;
 }
 
+#ifdef TCC_REGVAR_BASE
+/* return a register "frame offset" for the local v if it is a scalar whose address is
+   never taken, 0 to allocate it on the stack */
+static int regvar_alloc(CType *type, AttributeDef *ad, int v)
+{
+  int bt = type->t & VT_BTYPE, i;
+
+  if (!func_regvars || (type->t & (VT_VOLATILE | VT_ARRAY | VT_VLA | VT_BITFIELD)) || ad->cleanup_func || ad->asm_label)
+    return 0;
+  if (bt != VT_BOOL && bt != VT_BYTE && bt != VT_SHORT && bt != VT_INT && bt != VT_LLONG && bt != VT_PTR)
+    return 0;
+  for (i = 0; i < nb_regvar_addressed; ++i)
+    if (regvar_addressed[i] == v)
+      return 0;
+  return gen_regvar_alloc();
+}
+
+/* save the function body starting at '{' and set up its replay, after scanning it for
+   the identifiers which may have their address taken. Functions with inline asm or
+   which return twice (setjmp) keep all their locals in memory */
+static TokenString *regvar_scan_body(void)
+{
+  TokenString *str;
+  const int *p;
+  const char *name;
+  int t, prev = 0, pack_state[PACK_STACK_SIZE + 1];
+
+  save_block_for_replay(&str, pack_state);
+  func_regvars = 1;
+  nb_regvar_addressed = 0;
+  for (p = str->str; (t = tok_str_next(&p));) {
+    if (t == TOK_LINENUM)
+      continue;
+    if (t == TOK_ASM1 || t == TOK_ASM2 || t == TOK_ASM3) {
+      func_regvars = 0;
+    }
+    else if (t >= TOK_IDENT) {
+      name = table_ident[t - TOK_IDENT]->str;
+      if (strstr(name, "setjmp") || !strcmp(name, "vfork") || !strcmp(name, "getcontext"))
+        func_regvars = 0;
+      if (prev == '&') {
+        if (!(nb_regvar_addressed & 15))
+          regvar_addressed = tcc_realloc(regvar_addressed, (nb_regvar_addressed + 16) * sizeof(int));
+        regvar_addressed[nb_regvar_addressed++] = t;
+      }
+    }
+    /* &(x) */
+    if (t == '(' && prev == '&')
+      continue;
+    prev = t;
+  }
+
+  begin_block_replay(str, pack_state);
+  return str;
+}
+#endif
+
 /* parse a function defined by symbol 'sym' and generate its code in
    'cur_text_section' */
 static void gen_function(Sym *sym)
 {
+  TokenString *body = NULL;
+
   if (tcci_state && tcci_state->debug_verbose)
     printf("[BEG]gen_function: '%s'\n", get_tok_str(sym->v, NULL));
   struct scope f = {0};
@@ -8771,6 +9118,11 @@ static void gen_function(Sym *sym)
   tcc_debug_funcstart(tcc_state, sym);
   /* push a dummy symbol to enable local sym storage */
   sym_push2(&local_stack, SYM_FIELD, 0, 0);
+  func_regvars = func_code_fixed = 0;
+#ifdef TCC_REGVAR_BASE
+  if (tcc_state->optimize && !func_var && !tcc_state->do_debug && !tcc_state->do_bounds_check)
+    body = regvar_scan_body();
+#endif
   local_scope = 1; /* for function parameters */
   gfunc_prolog(sym);
   local_scope = 0;
@@ -8801,9 +9153,14 @@ static void gen_function(Sym *sym)
   func_var = 0;        /* for safety */
   ind = 0;             /* for safety */
   nocode_wanted = 0x80000000;
+  func_regvars = 0;
   check_vstack();
   /* do this after funcend debug info */
   next();
+  if (body) {
+    end_macro();
+    next();
+  }
 }
 
 static void gen_inline_functions(TCCState *s)
@@ -8824,7 +9181,7 @@ static void gen_inline_functions(TCCState *s)
            generate its code and convert it to a normal function */
         fn->sym = NULL;
         tcc_debug_putfile(s, fn->filename);
-        begin_macro(fn->func_str, 1);
+        begin_macro(fn->func_str, fn->from_snapshot ? 2 : 1);
         next();
         cur_text_section = text_section;
         gen_function(sym);
@@ -8843,12 +9200,404 @@ static void free_inline_functions(TCCState *s)
   /* free tokens of unused inline functions */
   for (i = 0; i < s->nb_inline_fns; ++i) {
     struct InlineFunc *fn = s->inline_fns[i];
-    if (fn->sym)
+    if (fn->sym) {
+      if (fn->from_snapshot)
+        fn->func_str->str = NULL; /* don't free */
       tok_str_free(fn->func_str);
+    }
   }
   dynarray_reset(&s->inline_fns, &s->nb_inline_fns);
 }
 
+/* ------------------------------------------------------------------------- */
+/* expansion of calls to inline functions (-O1): a function whose body is
+   '{ return <expr>; }', or '{ <expr>; }' for a void one, is not called but its
+   expression is parsed again from the saved tokens of the body, with the
+   parameter names bound to new locals holding the arguments */
+#define INLINE_MAX_TOKENS 64
+#define INLINE_MAX_PARAMS 8
+#define INLINE_MAX_DEPTH 4
+
+static int inline_tok_next(const int **pp)
+{
+  int t;
+
+  while ((t = tok_str_next(pp)) == TOK_LINENUM)
+    ;
+  return t;
+}
+
+/* check the shape of the body of fn, of function type f */
+static int inline_body_simple(InlineFunc *fn, Sym *f)
+{
+  const int *p = fn->func_str->str;
+  int t, n, first, second, is_return, is_void;
+  Sym *sa;
+
+  if (fn->expand)
+    return fn->expand > 0;
+  fn->expand = -1;
+  if (f->f.func_type != FUNC_NEW || (f->type.t & VT_BTYPE) == VT_STRUCT)
+    return 0;
+  for (sa = f->next, n = 0; sa; sa = sa->next)
+    if (++n > INLINE_MAX_PARAMS || (sa->type.t & VT_VLA))
+      return 0;
+  is_void = (f->type.t & VT_BTYPE) == VT_VOID;
+  if (inline_tok_next(&p) != '{')
+    return 0;
+  t = inline_tok_next(&p);
+  is_return = t == TOK_RETURN;
+  if (is_return)
+    t = inline_tok_next(&p);
+  else if (!is_void)
+    return 0;
+  first = t, second = 0;
+  for (n = 0; t != ';'; t = inline_tok_next(&p), ++n) {
+    if (t == '}' && !n && is_void && !is_return)
+      goto body_end; /* '{ }' */
+    if (n == 1)
+      second = t;
+    if (n == INLINE_MAX_TOKENS || !t || t == '{' || t == '}' || t == TOK_PACK || t == TOK_ASM1 || t == TOK_ASM2 ||
+        t == TOK_ASM3 || t == TOK___FUNCTION__ || t == TOK___FUNC__ || t == TOK_alloca ||
+        t == TOK_builtin_frame_address || t == TOK_builtin_return_address)
+      return 0;
+  }
+  if (!n && !is_void)
+    return 0;
+  /* an expression statement rather than a declaration, label or other statement */
+  if (n && !is_return && ((first < TOK_UIDENT && first != '(' && first != '*' && first != TOK_INC && first != TOK_DEC) ||
+                          second == ':'))
+    return 0;
+  t = inline_tok_next(&p);
+body_end:
+  if (t != '}' || ((t = inline_tok_next(&p)) == TOK_EOF ? inline_tok_next(&p) : t))
+    return 0;
+  fn->expand = 1;
+  return 1;
+}
+
+/* check that the identifiers of the body of fn, other than the parameters of f,
+   still mean at the call site what they meant at its definition: that none is
+   a local of the calling function */
+static int inline_idents_global(InlineFunc *fn, Sym *f)
+{
+  const int *p = fn->func_str->str;
+  int t, prev = 0, is_void = (f->type.t & VT_BTYPE) == VT_VOID;
+  Sym *s, *sa;
+
+  while ((t = inline_tok_next(&p))) {
+    if (t >= TOK_UIDENT && prev != '.' && prev != TOK_ARROW) {
+      for (sa = f->next; sa; sa = sa->next)
+        if ((sa->v & ~SYM_FIELD) == t)
+          break;
+      if (!sa) {
+        s = (prev == TOK_STRUCT || prev == TOK_UNION || prev == TOK_ENUM) ? struct_find(t) : sym_find(t);
+        if (s && sym_scope(s))
+          return 0;
+        /* '{ type_name ... ; }' declares something */
+        if (s && is_void && prev == '{' && (s->type.t & VT_TYPEDEF))
+          return 0;
+      }
+    }
+    prev = t;
+  }
+  return 1;
+}
+
+/* expand the call of the function on vtop, the current token being its '('.
+   Return 0 if it is to be called instead */
+static int gen_inline_call(void)
+{
+  InlineFunc *fn = NULL;
+  TokenString *str;
+  Sym *f, *sa, *params;
+  CType type;
+  int i, size, align, addr[INLINE_MAX_PARAMS];
+
+  if (!tcc_state->optimize || nocode_wanted || const_wanted || inline_depth >= INLINE_MAX_DEPTH || !local_stack ||
+      tcc_state->do_debug || tcc_state->do_bounds_check)
+    return 0;
+  /* incremental compilation fingerprints the callers without the inline bodies */
+  if (tcci_state && tcci_state->incremental)
+    return 0;
+  if ((vtop->type.t & (VT_BTYPE | VT_INLINE)) != (VT_FUNC | VT_INLINE) ||
+      (vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != (VT_CONST | VT_SYM) || vtop->c.i)
+    return 0;
+  for (i = tcc_state->nb_inline_fns; i-- > 0;)
+    if (tcc_state->inline_fns[i]->sym == vtop->sym) {
+      fn = tcc_state->inline_fns[i];
+      break;
+    }
+  f = vtop->type.ref;
+  if (!fn || !inline_body_simple(fn, f) || !inline_idents_global(fn, f))
+    return 0;
+
+  vpop();
+  next();
+  for (sa = f->next, i = 0; sa; sa = sa->next, ++i) {
+    if (tok == ')')
+      tcc_error("too few arguments to function");
+    if (i)
+      skip(',');
+    expr_eq();
+    size = type_size(&sa->type, &align);
+    loc = (loc - size) & -align;
+    addr[i] = loc;
+    type = sa->type;
+    type.t &= ~VT_CONSTANT;
+    vset(&type, VT_LOCAL | VT_LVAL, loc);
+    vswap();
+    vstore();
+    vpop();
+  }
+  if (tok == ',')
+    tcc_error("too many arguments to function");
+  if (tok != ')')
+    skip(')');
+
+  ++inline_depth;
+  ++local_scope;
+  params = local_stack;
+  for (sa = f->next, i = 0; sa; sa = sa->next, ++i)
+    sym_push(sa->v & ~SYM_FIELD, &sa->type, VT_LOCAL | VT_LVAL, addr[i]);
+  /* a token string of its own, the body may be expanded in itself */
+  str = tok_str_alloc();
+  str->str = fn->func_str->str;
+  str->len = fn->func_str->len;
+  begin_macro(str, 2);
+  next();
+  skip('{');
+  if (tok == TOK_RETURN)
+    next();
+  if ((f->type.t & VT_BTYPE) == VT_VOID) {
+    if (tok != ';' && tok != '}') {
+      gexpr();
+      vpop();
+    }
+    vpush(&f->type);
+  }
+  else {
+    gexpr();
+    gen_assign_cast(&f->type);
+    /* a value, not the parameter or object it was read from */
+    if (vtop->r & VT_LVAL)
+      gv(RC_TYPE(vtop->type.t));
+  }
+  if (tok == ';')
+    next();
+  /* the '}' was the last token */
+  end_macro();
+  sym_pop(&local_stack, params, 0);
+  --local_scope;
+  --inline_depth;
+  /* continue after the ')' of the call */
+  tok = ')';
+  next();
+  return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+/* incremental interpreter compilation (see tcci_set_incremental()): a top level
+   definition is fingerprinted by its tokens and by the declarations of the
+   identifiers they use. When the fingerprint is the one of its last compilation
+   the definition is bound to the code or storage it got then, as an absolute
+   symbol, instead of being compiled again */
+
+typedef struct TCCIFingerprint {
+  void **structs; /* hashed already */
+  int nb_structs;
+} TCCIFingerprint;
+
+#define TCCI_MIX(h, v) ((h) * 33 + (unsigned long)(v))
+
+/* token ids and anonymous symbols are numbered per compilation */
+static unsigned long tcci_name_hash(int v)
+{
+  v &= ~(SYM_FIELD | SYM_STRUCT);
+  return v < SYM_FIRST_ANOM ? hash_djb2((const unsigned char *)get_tok_str(v, NULL)) : 0;
+}
+
+static unsigned long tcci_type_hash(TCCIFingerprint *fp, CType *type)
+{
+  unsigned long h = type->t;
+  Sym *s = type->ref;
+  int i;
+
+  switch (type->t & VT_BTYPE) {
+  case VT_PTR:
+    h = TCCI_MIX(h, s->c);
+    h = TCCI_MIX(h, tcci_type_hash(fp, &s->type));
+    break;
+  case VT_FUNC:
+    h = TCCI_MIX(h, s->f.func_type | s->f.func_call << 8);
+    h = TCCI_MIX(h, tcci_type_hash(fp, &s->type));
+    while ((s = s->next))
+      h = TCCI_MIX(h, tcci_type_hash(fp, &s->type));
+    break;
+  case VT_STRUCT:
+    h = TCCI_MIX(h, tcci_name_hash(s->v));
+    for (i = 0; i < fp->nb_structs; ++i)
+      if (fp->structs[i] == s)
+        return h;
+    dynarray_add(&fp->structs, &fp->nb_structs, s);
+    h = TCCI_MIX(TCCI_MIX(h, s->c), s->r);
+    while ((s = s->next))
+      h = TCCI_MIX(TCCI_MIX(TCCI_MIX(h, tcci_name_hash(s->v)), s->c), tcci_type_hash(fp, &s->type));
+    break;
+  }
+  return h;
+}
+
+static unsigned long tcci_definition_key(int v, CType *type)
+{
+  unsigned long key = tcci_name_hash(v);
+
+  if (type->t & VT_STATIC)
+    key *= hash_djb2((const unsigned char *)tcc_state->current_filename);
+  return key;
+}
+
+/* hash of the file scope declarations named v */
+static unsigned long tcci_ident_hash(void *opaque, int v)
+{
+  TCCIFingerprint *fp = opaque;
+  TCCIDefinition *def;
+  unsigned long h = 0;
+  CType type;
+  Sym *s;
+
+  s = sym_find(v);
+  if (s) {
+    h = TCCI_MIX(tcci_type_hash(fp, &s->type), s->r);
+    if (IS_ENUM_VAL(s->type.t))
+      h = TCCI_MIX(h, s->enum_val);
+    /* a variable which is not bound to its storage (yet) depends on where
+       that is */
+    if ((s->r & VT_SYM) && (s->type.t & VT_BTYPE) != VT_FUNC && (!s->c || elfsym(s)->st_shndx != SHN_ABS)) {
+      def = hash_table_get_by_hash(tcci_definition_key(v, &s->type), &tcci_state->definitions);
+      if (def)
+        h = TCCI_MIX(h, (addr_t)def->addr);
+    }
+  }
+  s = struct_find(v);
+  if (s) {
+    type.t = s->type.t;
+    type.ref = s;
+    h = TCCI_MIX(h, tcci_type_hash(fp, &type));
+  }
+  return h;
+}
+
+static unsigned long tcci_fingerprint(CType *type, TokenString *str)
+{
+  TCCIFingerprint fp = {0};
+  unsigned long h;
+
+  h = tcci_type_hash(&fp, type);
+  if (str)
+    h = TCCI_MIX(h, tok_str_hash(str->str, tcci_ident_hash, &fp));
+  tcc_free(fp.structs);
+  return h;
+}
+
+static int tcci_incremental_wanted(AttributeDef *ad, int v)
+{
+  Sym *sym;
+
+  if (!tcci_state || !tcci_state->incremental || tcci_state->in_single_use_state)
+    return 0;
+  if (!tcc_state->current_filename || (tcc_state->header_snapshot && !tcc_state->header_snapshot->valid))
+    return 0;
+  if (ad->section || ad->asm_label || ad->alias_target)
+    return 0;
+  /* defined before in this compilation */
+  sym = sym_find(v);
+  return !sym || !sym->c || elfsym(sym)->st_shndx == SHN_UNDEF;
+}
+
+/* static definitions are referenced pc-relative. Arrays sized by their
+   initializer get new storage every time */
+static int tcci_can_bind(CType *type, void *addr)
+{
+  if ((type->t & VT_ARRAY) && type->ref->c < 0)
+    return 0;
+  return addr && (!(type->t & VT_STATIC) || tcci_arena_in_reach(tcci_state, addr));
+}
+
+/* generate the function sym whose body starts at the current '{' unless
+   it did not change */
+static void tcci_incremental_function(Sym *sym)
+{
+  TokenString *str;
+  TCCIDefinition *def;
+  TCCISymbol *isym;
+  unsigned long key, fingerprint;
+  int pack_state[PACK_STACK_SIZE + 1];
+
+  save_block_for_replay(&str, pack_state);
+  fingerprint = tcci_fingerprint(&sym->type, str);
+  key = tcci_definition_key(sym->v, &sym->type);
+  def = hash_table_get_by_hash(key, &tcci_state->definitions);
+  isym = hash_table_get_by_hash(key, &tcci_state->symbols);
+  if (def && def->fingerprint == fingerprint && isym && isym->unit && tcci_can_bind(&sym->type, isym->addr)) {
+    dba(printf("incremental: '%s' is unchanged\n", get_tok_str(sym->v, NULL)));
+    put_extern_sym2(sym, SHN_ABS, (addr_t)isym->addr, isym->size, 1);
+    tok_str_free(str);
+    cur_text_section = NULL;
+    return;
+  }
+
+  begin_block_replay(str, pack_state);
+  gen_function(sym);
+  end_macro();
+  next();
+  tcci_add_pending_def(tcc_state, key, fingerprint, sym->c);
+}
+
+/* allocate and initialize the file scope variable v unless its type and its
+   initializer did not change, in which case it keeps the storage (and the
+   value) it has */
+static void tcci_incremental_variable(CType *type, AttributeDef *ad, int r, int has_init, int v)
+{
+  TokenString *init_str = NULL;
+  TCCIDefinition *def;
+  unsigned long key, fingerprint;
+  int pack_state[PACK_STACK_SIZE + 1];
+  Sym *sym;
+
+  if (has_init)
+    save_block_for_replay(&init_str, pack_state);
+  fingerprint = tcci_fingerprint(type, init_str);
+  key = tcci_definition_key(v, type);
+  def = hash_table_get_by_hash(key, &tcci_state->definitions);
+  if (def && def->fingerprint == fingerprint && tcci_can_bind(type, def->addr)) {
+    dba(printf("incremental: '%s' is unchanged\n", get_tok_str(v, NULL)));
+    if (init_str)
+      tok_str_free(init_str);
+    sym = sym_find(v);
+    if (sym) {
+      patch_storage(sym, ad, type);
+    }
+    else {
+      sym = sym_push(v, type, r | VT_SYM, 0);
+      patch_storage(sym, ad, NULL);
+    }
+    put_extern_sym2(sym, SHN_ABS, (addr_t)def->addr, def->size, 1);
+    return;
+  }
+
+  if (init_str)
+    begin_block_replay(init_str, pack_state);
+  decl_initializer_alloc(type, ad, r, has_init, v, VT_CONST);
+  if (init_str) {
+    end_macro();
+    next();
+  }
+  sym = sym_find(v);
+  if (sym && sym->c)
+    tcci_add_pending_def(tcc_state, key, fingerprint, sym->c);
+}
+
 /* 'l' is VT_LOCAL or VT_CONST to define default storage type, or VT_CMP
    if parsing old style parameter decl list (and FUNC_SYM is set then) */
 static int decl0(int l, int is_for_loop_init, Sym *func_sym)
@@ -9016,6 +9765,8 @@ static int decl0(int l, int is_for_loop_init, Sym *func_sym)
           fn = tcc_malloc(sizeof *fn + strlen(file->filename));
           strcpy(fn->filename, file->filename);
           fn->sym = sym;
+          fn->from_snapshot = 0;
+          fn->expand = 0;
           skip_or_save_block(&fn->func_str);
           dynarray_add(&tcc_state->inline_fns, &tcc_state->nb_inline_fns, fn);
         }
@@ -9024,7 +9775,10 @@ static int decl0(int l, int is_for_loop_init, Sym *func_sym)
           cur_text_section = ad.section;
           if (!cur_text_section)
             cur_text_section = text_section;
-          gen_function(sym);
+          if (tcci_incremental_wanted(&ad, v))
+            tcci_incremental_function(sym);
+          else
+            gen_function(sym);
         }
         break;
       }
@@ -9109,7 +9863,10 @@ static int decl0(int l, int is_for_loop_init, Sym *func_sym)
             else if (l == VT_CONST)
               /* uninitialized global variables may be overridden */
               type.t |= VT_EXTERN;
-            decl_initializer_alloc(&type, &ad, r, has_init, v, l);
+            if (l == VT_CONST && tcci_incremental_wanted(&ad, v))
+              tcci_incremental_variable(&type, &ad, r, has_init, v);
+            else
+              decl_initializer_alloc(&type, &ad, r, has_init, v, l);
           }
         }
         if (tok != ',') {
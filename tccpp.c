@@ -32,6 +32,7 @@ ST_DATA int ch, tok;
 ST_DATA CValue tokc;
 ST_DATA const int *macro_ptr;
 ST_DATA CString tokcstr; /* current parsed string, if any */
+ST_DATA TokenString *pack_record_str;
 
 /* display benchmark infos */
 ST_DATA int tok_ident;
@@ -39,22 +40,23 @@ ST_DATA TokenSym **table_ident;
 
 /* ------------------------------------------------------------------------- */
 
-static TokenSym *hash_ident[TOK_HASH_SIZE];
-static char token_buf[STRING_MAX_SIZE + 1];
-static CString cstr_buf;
-static CString macro_equal_buf;
-static TokenString tokstr_buf;
-static unsigned char isidnum_table[256 - CH_EOF];
-static int pp_debug_tok, pp_debug_symv;
-static int pp_once;
-static int pp_expr;
-static int pp_counter;
+static TCC_TLS TokenSym *hash_ident[TOK_HASH_SIZE];
+static TCC_TLS int pp_timing; /* inside a timed next() */
+static TCC_TLS char token_buf[STRING_MAX_SIZE + 1];
+static TCC_TLS CString cstr_buf;
+static TCC_TLS CString macro_equal_buf;
+static TCC_TLS TokenString tokstr_buf;
+static TCC_TLS unsigned char isidnum_table[256 - CH_EOF];
+static TCC_TLS int pp_debug_tok, pp_debug_symv;
+static TCC_TLS int pp_once;
+static TCC_TLS int pp_expr;
+static TCC_TLS int pp_counter;
 static void tok_print(const char *msg, const int *str);
 
-static struct TinyAlloc *toksym_alloc;
-static struct TinyAlloc *tokstr_alloc;
+static TCC_TLS struct TinyAlloc *toksym_alloc;
+static TCC_TLS struct TinyAlloc *tokstr_alloc;
 
-static TokenString *macro_stack;
+static TCC_TLS TokenString *macro_stack;
 
 static const char tcc_keywords[] =
 #define DEF(id, str) str "\0"
@@ -594,7 +596,7 @@ static int handle_eob(void)
 
   /* only tries to read if really end of buffer */
   if (bf->buf_ptr >= bf->buf_end) {
-    if (bf->fd >= 0) {
+    if (bf->fd >= 0 && !bf->map) {
 #if defined(PARSE_DEBUG)
       len = 1;
 #else
@@ -717,6 +719,131 @@ static void minp(void)
     handle_stray();
 }
 
+/* ------------------------------------------------------------------------- */
+/* vector scans for the long runs of the lexer: identifiers, blanks, comments
+   and strings. They load 16 (SSE2) or 32 (AVX2, when the cpu has it) bytes at
+   a time and may look up to IO_BUF_PAD bytes past buf_end, but they never
+   return a pointer past its CH_EOB sentinel. The callers finish the run with
+   their scalar loops, which also handle '\\' and the end of the buffer */
+#if defined __x86_64__ && defined __GNUC__ && !defined __TINYC__
+#include <immintrin.h>
+
+/* x in [lo, lo + span] */
+static inline __m128i lex_in16(__m128i v, char lo, char span)
+{
+  __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(span)), t);
+}
+
+__attribute__((target("avx2"))) static inline __m256i lex_in32(__m256i v, char lo, char span)
+{
+  __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(span)), t);
+}
+
+/* [A-Za-z0-9_] */
+static uint8_t *lex_skip_ident_sse2(uint8_t *p)
+{
+  __m128i v, m;
+  unsigned bits;
+
+  for (;; p += 16) {
+    v = _mm_loadu_si128((const __m128i *)p);
+    m = _mm_or_si128(lex_in16(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z' - 'a'), lex_in16(v, '0', 9));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    bits = _mm_movemask_epi8(m) ^ 0xffff;
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+}
+
+__attribute__((target("avx2"))) static uint8_t *lex_skip_ident_avx2(uint8_t *p)
+{
+  __m256i v, m;
+  unsigned bits;
+
+  for (;; p += 32) {
+    v = _mm256_loadu_si256((const __m256i *)p);
+    m = _mm256_or_si256(lex_in32(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z' - 'a'), lex_in32(v, '0', 9));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    bits = ~(unsigned)_mm256_movemask_epi8(m);
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+}
+
+/* ' ' and '\t' */
+static uint8_t *lex_skip_blank_sse2(uint8_t *p)
+{
+  __m128i v;
+  unsigned bits;
+
+  for (;; p += 16) {
+    v = _mm_loadu_si128((const __m128i *)p);
+    v = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    bits = _mm_movemask_epi8(v) ^ 0xffff;
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+}
+
+__attribute__((target("avx2"))) static uint8_t *lex_skip_blank_avx2(uint8_t *p)
+{
+  __m256i v;
+  unsigned bits;
+
+  for (;; p += 32) {
+    v = _mm256_loadu_si256((const __m256i *)p);
+    v = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    bits = ~(unsigned)_mm256_movemask_epi8(v);
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+}
+
+/* first of c1..c4, which must include CH_EOB */
+static uint8_t *lex_find_sse2(uint8_t *p, int c1, int c2, int c3, int c4)
+{
+  __m128i v, m;
+  unsigned bits;
+
+  for (;; p += 16) {
+    v = _mm_loadu_si128((const __m128i *)p);
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(c1)), _mm_cmpeq_epi8(v, _mm_set1_epi8(c2)));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(c3)), _mm_cmpeq_epi8(v, _mm_set1_epi8(c4))));
+    bits = _mm_movemask_epi8(m);
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+}
+
+__attribute__((target("avx2"))) static uint8_t *lex_find_avx2(uint8_t *p, int c1, int c2, int c3, int c4)
+{
+  __m256i v, m;
+  unsigned bits;
+
+  for (;; p += 32) {
+    v = _mm256_loadu_si256((const __m256i *)p);
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c1)), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c2)));
+    m = _mm256_or_si256(
+        m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c3)), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c4))));
+    bits = _mm256_movemask_epi8(m);
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+}
+
+/* __cpu_model is set up by a constructor of libgcc, so this is one load */
+#define lex_skip_ident(p) (__builtin_cpu_supports("avx2") ? lex_skip_ident_avx2(p) : lex_skip_ident_sse2(p))
+#define lex_skip_blank(p) (__builtin_cpu_supports("avx2") ? lex_skip_blank_avx2(p) : lex_skip_blank_sse2(p))
+#define lex_find(p, c1, c2, c3, c4) \
+  (__builtin_cpu_supports("avx2") ? lex_find_avx2(p, c1, c2, c3, c4) : lex_find_sse2(p, c1, c2, c3, c4))
+#else
+#define lex_skip_ident(p) (p)
+#define lex_skip_blank(p) (p)
+#define lex_find(p, c1, c2, c3, c4) (p)
+#endif
+
 /* single line C++ comments */
 static uint8_t *parse_line_comment(uint8_t *p)
 {
@@ -724,6 +851,7 @@ static uint8_t *parse_line_comment(uint8_t *p)
 
   p++;
   for (;;) {
+    p = lex_find(p, '\n', '\\', '\n', '\\');
     c = *p;
   redo:
     if (c == '\n' || c == CH_EOF) {
@@ -766,6 +894,7 @@ static uint8_t *parse_comment(uint8_t *p)
   p++;
   for (;;) {
     /* fast skip loop */
+    p = lex_find(p, '\n', '*', '\\', '\n');
     for (;;) {
       c = *p;
       if (c == '\n' || c == '*' || c == '\\')
@@ -872,9 +1001,16 @@ static inline int check_space(int t, int *spc)
 /* parse a string without interpreting escapes */
 static uint8_t *parse_pp_string(uint8_t *p, int sep, CString *str)
 {
+  uint8_t *p1;
   int c;
   p++;
   for (;;) {
+    p1 = lex_find(p, sep, '\\', '\n', '\r');
+    if (p1 != p) {
+      if (str)
+        cstr_cat(str, (char *)p, p1 - p);
+      p = p1;
+    }
     c = *p;
     if (c == sep) {
       break;
@@ -1314,6 +1450,52 @@ static inline void tok_get(int *t, const int **pp, CValue *cv)
   } while (0)
 #endif
 
+/* hash a token string the same for the same tokens, whatever lines they are
+   on and whatever ids the identifiers got. The hashes ident_hash() returns for
+   the identifiers are mixed in as well */
+ST_FUNC unsigned long tok_str_hash(const int *str, unsigned long (*ident_hash)(void *opaque, int v), void *opaque)
+{
+  unsigned long h = 5381;
+  const unsigned char *b, *e;
+  const int *p = str;
+  CValue cv;
+  int t;
+
+  while (*p) {
+    b = (const unsigned char *)p;
+    tok_get(&t, &p, &cv);
+    e = (const unsigned char *)p;
+    if (t == TOK_LINENUM)
+      continue;
+    if (t >= TOK_IDENT) {
+      b = (const unsigned char *)table_ident[t - TOK_IDENT]->str;
+      e = b + table_ident[t - TOK_IDENT]->len;
+      if (ident_hash)
+        h = h * 33 + ident_hash(opaque, t);
+    }
+    else if (t == TOK_STR || t == TOK_LSTR || t == TOK_PPNUM || t == TOK_PPSTR) {
+      h = h * 33 + t;
+      b = cv.str.data;
+      e = b + cv.str.size;
+    }
+    while (b < e)
+      h = h * 33 + *b++;
+  }
+  return h;
+}
+
+/* return the token at *pp of a token string and move *pp past it, 0 at its end */
+ST_FUNC int tok_str_next(const int **pp)
+{
+  CValue cv;
+  int t;
+
+  if (!**pp)
+    return 0;
+  tok_get(&t, pp, &cv);
+  return t;
+}
+
 static int macro_is_equal(const int *a, const int *b)
 {
   CValue cv;
@@ -1608,12 +1790,10 @@ ST_FUNC void parse_define(void)
   define_push(v, t, tok_str_dup(&tokstr_buf), first);
 }
 
-static CachedInclude *search_cached_include(TCCState *s1, const char *filename, int add)
+static unsigned int cached_include_hash(const char *filename)
 {
   const unsigned char *s;
   unsigned int h;
-  CachedInclude *e;
-  int i;
 
   h = TOK_HASH_INIT;
   s = (unsigned char *)filename;
@@ -1625,13 +1805,24 @@ static CachedInclude *search_cached_include(TCCState *s1, const char *filename,
 #endif
     s++;
   }
-  h &= (CACHED_INCLUDES_HASH_SIZE - 1);
+  return h & (CACHED_INCLUDES_HASH_SIZE - 1);
+}
 
-  i = s1->cached_includes_hash[h];
+/* find @filename in @entries, adding it (with room for @extra chars after the
+   filename) if not found and @add is set */
+static CachedInclude *cached_include_find(CachedInclude ***entries, int *nb_entries, int *hash, const char *filename,
+                                          int add, int extra)
+{
+  unsigned int h;
+  CachedInclude *e;
+  int i;
+
+  h = cached_include_hash(filename);
+  i = hash[h];
   for (;;) {
     if (i == 0)
       break;
-    e = s1->cached_includes[i - 1];
+    e = (*entries)[i - 1];
     if (0 == PATHCMP(e->filename, filename))
       return e;
     i = e->hash_next;
@@ -1639,19 +1830,217 @@ static CachedInclude *search_cached_include(TCCState *s1, const char *filename,
   if (!add)
     return NULL;
 
-  e = tcc_malloc(sizeof(CachedInclude) + strlen(filename));
+  e = tcc_mallocz(sizeof(CachedInclude) + strlen(filename) + extra);
   strcpy(e->filename, filename);
-  e->ifndef_macro = e->once = 0;
-  dynarray_add(&s1->cached_includes, &s1->nb_cached_includes, e);
+  dynarray_add(entries, nb_entries, e);
   /* add in hash table */
-  e->hash_next = s1->cached_includes_hash[h];
-  s1->cached_includes_hash[h] = s1->nb_cached_includes;
+  e->hash_next = hash[h];
+  hash[h] = *nb_entries;
 #ifdef INC_DEBUG
   printf("adding cached '%s'\n", filename);
 #endif
   return e;
 }
 
+static CachedInclude *search_cached_include(TCCState *s1, const char *filename, int add)
+{
+  return cached_include_find(&s1->cached_includes, &s1->nb_cached_includes, s1->cached_includes_hash, filename, add,
+                             0);
+}
+
+/* ------------------------------------------------------------------------- */
+/* on-disk include cache (see IncludeCache). The file has a line per entry:
+   "M <directory mtime> <path>" for a missing file and
+   "F <mtime> <size> <guard macro> <path>" for a file with an include guard */
+
+#define INCLUDE_CACHE_VERSION "tcc include cache 1"
+
+/* the entry of @filename with the include guard @guard ("" for none) */
+static CachedInclude *include_cache_add(IncludeCache *ic, const char *filename, const char *guard)
+{
+  CachedInclude *e;
+  int i, len = strlen(filename);
+
+  e = cached_include_find(&ic->entries, &ic->nb_entries, ic->hash, filename, 0, 0);
+  if (!e) {
+    e = cached_include_find(&ic->entries, &ic->nb_entries, ic->hash, filename, 1, strlen(guard) + 1);
+  }
+  else if (strcmp(e->filename + len + 1, guard)) {
+    for (i = 0; ic->entries[i] != e; ++i)
+      ;
+    e = ic->entries[i] = tcc_realloc(e, sizeof(CachedInclude) + len + strlen(guard) + 1);
+  }
+  strcpy(e->filename + len + 1, guard);
+  return e;
+}
+
+ST_FUNC IncludeCache *include_cache_load(const char *dir)
+{
+  IncludeCache *ic = tcc_mallocz(sizeof(IncludeCache));
+  char buf[2048], guard[256];
+  unsigned long long stamp, size;
+  CachedInclude *e;
+  unsigned int h;
+  const char *p;
+  FILE *f;
+  int n;
+
+  /* relative paths are kept as they are, so there is a file per working directory */
+  h = TOK_HASH_INIT;
+  if (getcwd(buf, sizeof buf))
+    for (p = buf; *p; ++p)
+      h = TOK_HASH_FUNC(h, *p);
+  snprintf(buf, sizeof buf, "%s/includes-%08x", dir, h);
+  ic->path = tcc_strdup(buf);
+
+  f = fopen(ic->path, "r");
+  if (!f)
+    return ic;
+  if (fgets(buf, sizeof buf, f) && !strcmp(buf, INCLUDE_CACHE_VERSION "\n")) {
+    while (fgets(buf, sizeof buf, f)) {
+      n = strlen(buf);
+      if (n && buf[n - 1] == '\n')
+        buf[n - 1] = 0;
+      n = 0;
+      if (buf[0] == 'M' && sscanf(buf, "M %llu %n", &stamp, &n) == 1 && n && buf[n]) {
+        e = include_cache_add(ic, buf + n, "");
+        e->missing = 1;
+        e->stamp = stamp;
+      }
+      else if (buf[0] == 'F' && sscanf(buf, "F %llu %llu %255s %n", &stamp, &size, guard, &n) == 3 && n && buf[n]) {
+        e = include_cache_add(ic, buf + n, guard);
+        e->stamp = stamp;
+        e->size = size;
+      }
+    }
+  }
+  fclose(f);
+  return ic;
+}
+
+/* write the cache file if it changed, through a temporary file so that other
+   processes read either the old or the new one */
+ST_FUNC void include_cache_save(IncludeCache *ic)
+{
+  char tmp[1024];
+  CachedInclude *e;
+  FILE *f;
+  int i;
+
+  if (!ic->dirty)
+    return;
+  ic->dirty = 0;
+#ifdef _WIN32
+  snprintf(tmp, sizeof tmp, "%s.%lu", ic->path, (unsigned long)GetCurrentProcessId());
+#else
+  snprintf(tmp, sizeof tmp, "%s.%lu", ic->path, (unsigned long)getpid());
+#endif
+  f = fopen(tmp, "w");
+  if (!f)
+    return;
+  fprintf(f, "%s\n", INCLUDE_CACHE_VERSION);
+  for (i = 0; i < ic->nb_entries; ++i) {
+    e = ic->entries[i];
+    if (e->missing)
+      fprintf(f, "M %llu %s\n", (unsigned long long)e->stamp, e->filename);
+    else
+      fprintf(f, "F %llu %llu %s %s\n", (unsigned long long)e->stamp, (unsigned long long)e->size,
+              e->filename + strlen(e->filename) + 1, e->filename);
+  }
+  if (fclose(f) || rename(tmp, ic->path))
+    remove(tmp);
+}
+
+ST_FUNC void include_cache_free(IncludeCache *ic)
+{
+  dynarray_reset(&ic->entries, &ic->nb_entries);
+  tcc_free(ic->path);
+  tcc_free(ic);
+}
+
+/* mtime of the directory of @filename, read once per compilation into an
+   entry of its own whose name ends with the separator */
+static uint64_t include_dir_stamp(TCCState *s1, const char *filename)
+{
+  char dir[sizeof file->filename];
+  CachedInclude *e;
+
+  pstrncpy(dir, filename, tcc_basename(filename) - filename);
+  if (!dir[0])
+    strcpy(dir, "./");
+  e = search_cached_include(s1, dir, 0);
+  if (!e) {
+    e = search_cached_include(s1, dir, 1);
+    e->missing = 1;
+    e->stamp = tcc_file_stamp(dir, -1, NULL);
+  }
+  return e->stamp;
+}
+
+/* the entry of the on-disk cache for @filename, if it still holds. A file which
+   exists only needs to be checked when its include guard is defined */
+static CachedInclude *include_cache_import(TCCState *s1, const char *filename)
+{
+  IncludeCache *ic = s1->include_cache;
+  CachedInclude *r, *e;
+  uint64_t size = 0;
+  const char *guard;
+  int v = 0;
+
+  r = cached_include_find(&ic->entries, &ic->nb_entries, ic->hash, filename, 0, 0);
+  if (!r)
+    return NULL;
+  if (r->missing) {
+    if (include_dir_stamp(s1, filename) != r->stamp)
+      return NULL;
+  }
+  else {
+    guard = r->filename + strlen(r->filename) + 1;
+    v = tok_alloc(guard, strlen(guard))->tok;
+    if (!define_find(v) || tcc_file_stamp(filename, -1, &size) != r->stamp || size != r->size)
+      return NULL;
+  }
+#ifdef INC_DEBUG
+  printf("include cache: %s %s\n", r->missing ? "missing" : "guarded", filename);
+#endif
+  e = search_cached_include(s1, filename, 1);
+  e->ifndef_macro = v;
+  e->missing = r->missing;
+  e->stamp = r->stamp;
+  e->size = r->size;
+  return e;
+}
+
+/* add what the compilation found out about include files to the on-disk cache */
+static void include_cache_merge(TCCState *s1)
+{
+  IncludeCache *ic = s1->include_cache;
+  CachedInclude *e, *r;
+  const char *guard;
+  int i, len;
+
+  for (i = 0; i < s1->nb_cached_includes; ++i) {
+    e = s1->cached_includes[i];
+    len = strlen(e->filename);
+    if (e->missing && !IS_DIRSEP(e->filename[len - 1]))
+      guard = "";
+    else if (!e->missing && e->ifndef_macro && e->stamp)
+      guard = get_tok_str(e->ifndef_macro, NULL);
+    else
+      continue;
+    r = cached_include_find(&ic->entries, &ic->nb_entries, ic->hash, e->filename, 0, 0);
+    if (r && r->missing == e->missing && r->stamp == e->stamp && r->size == e->size &&
+        !strcmp(r->filename + len + 1, guard))
+      continue;
+    r = include_cache_add(ic, e->filename, guard);
+    r->missing = e->missing;
+    r->stamp = e->stamp;
+    r->size = e->size;
+    ic->dirty = 1;
+  }
+  include_cache_save(ic);
+}
+
 static void pragma_parse(TCCState *s1)
 {
   next_nomacro();
@@ -1731,6 +2120,13 @@ static void pragma_parse(TCCState *s1)
     }
     if (tok != ')')
       goto pragma_err;
+    if (pack_record_str) {
+      /* saved for a replay: the pack change must take effect there again */
+      CValue cval;
+      cval.i = (s1->pack_stack_ptr - s1->pack_stack) << 8 | *s1->pack_stack_ptr;
+      tok_str_add(pack_record_str, TOK_PACK);
+      tok_str_add2(pack_record_str, TOK_CINT, &cval);
+    }
   }
   else if (tok == TOK_comment) {
     char *p;
@@ -1859,6 +2255,7 @@ redo:
       char buf1[sizeof file->filename];
       CachedInclude *e;
       const char *path;
+      uint64_t stamp;
 
       if (i == 0) {
         /* check absolute include path */
@@ -1884,6 +2281,10 @@ redo:
 
       pstrcat(buf1, sizeof(buf1), buf);
       e = search_cached_include(s1, buf1, 0);
+      if (!e && s1->include_cache)
+        e = include_cache_import(s1, buf1);
+      if (e && e->missing)
+        continue;
       if (e && (define_find(e->ifndef_macro) || e->once == pp_once)) {
         /* no need to parse the include because the 'ifndef macro'
            is defined (or had #pragma once) */
@@ -1900,8 +2301,16 @@ redo:
       //     //   goto include_done;
       //   }
 
-      if (tcc_open(s1, buf1) < 0)
+      /* the mtime of the directory is taken first: a file created after the
+         failed open changes it */
+      stamp = s1->include_cache ? include_dir_stamp(s1, buf1) : 0;
+      if (tcc_open(s1, buf1) < 0) {
+        /* don't look for it again in this compilation */
+        e = search_cached_include(s1, buf1, 1);
+        e->missing = 1;
+        e->stamp = stamp;
         continue;
+      }
       //   printf("tcc_open(%s)\n", buf1);
 
       file->include_next_index = i;
@@ -2685,6 +3094,8 @@ redo_no_start:
   maybe_space:
     if (parse_flags & PARSE_FLAG_SPACES)
       goto keep_tok_flags;
+    if (*p == ' ' || *p == '\t')
+      p = lex_skip_blank(p);
     while (isidnum_table[*p - CH_EOF] & IS_SPC)
       ++p;
     goto redo_no_start;
@@ -2728,7 +3139,12 @@ redo_no_start:
 #ifdef INC_DEBUG
           printf("#endif %s\n", get_tok_str(file->ifndef_macro_saved, NULL));
 #endif
-          search_cached_include(s1, file->filename, 1)->ifndef_macro = file->ifndef_macro_saved;
+          {
+            CachedInclude *e = search_cached_include(s1, file->filename, 1);
+            e->ifndef_macro = file->ifndef_macro_saved;
+            e->stamp = file->stamp;
+            e->size = file->size;
+          }
           tok_flags &= ~TOK_FLAG_ENDIF;
         }
 
@@ -2738,7 +3154,7 @@ redo_no_start:
         tcc_close();
         s1->include_stack_ptr--;
         p = file->buf_ptr;
-        if (p == file->buffer)
+        if (p == file->buffer || p == file->map)
           tok_flags = TOK_FLAG_BOF | TOK_FLAG_BOL;
         goto redo_no_start;
       }
@@ -2840,16 +3256,17 @@ redo_no_start:
   case '_':
   parse_ident_fast:
     p1 = p;
-    h = TOK_HASH_INIT;
-    h = TOK_HASH_FUNC(h, c);
-    while (c = *++p, isidnum_table[c - CH_EOF] & (IS_ID | IS_NUM))
-      h = TOK_HASH_FUNC(h, c);
+    p = lex_skip_ident(p + 1);
+    while (c = *p, isidnum_table[c - CH_EOF] & (IS_ID | IS_NUM))
+      ++p;
     len = p - p1;
     if (c != '\\') {
       TokenSym **pts;
 
-      /* fast case : no stray found, so we have the full token
-         and we have already hashed it */
+      /* fast case : no stray found, so we have the full token */
+      h = TOK_HASH_INIT;
+      for (t = 0; t < len; ++t)
+        h = TOK_HASH_FUNC(h, p1[t]);
       h &= (TOK_HASH_SIZE - 1);
       pts = &hash_ident[h];
       for (;;) {
@@ -3682,6 +4099,12 @@ static void next_nomacro(void)
     }
     else {
       macro_ptr++;
+      if (t == TOK_PACK) {
+        tok_get(&tok, &macro_ptr, &tokc);
+        tcc_state->pack_stack_ptr = tcc_state->pack_stack + (tokc.i >> 8);
+        *tcc_state->pack_stack_ptr = tokc.i & 0xff;
+        goto redo;
+      }
       if (t < TOK_IDENT) {
         if (!(parse_flags & PARSE_FLAG_SPACES) && (isidnum_table[t - CH_EOF] & IS_SPC))
           goto redo;
@@ -3695,7 +4118,7 @@ static void next_nomacro(void)
 }
 
 /* return next token with macro substitution */
-ST_FUNC void next(void)
+static void next_expand(void)
 {
   int t;
 redo:
@@ -3743,6 +4166,24 @@ redo:
   }
 }
 
+/* next_expand(), timed into stats.pp_ns with -bench. Preprocessing recurses (#if
+   expressions, macro arguments) so only the outermost call reads the clock */
+ST_FUNC void next(void)
+{
+  TCCState *s1 = tcc_state;
+  uint64_t start;
+
+  if (!s1->do_bench || pp_timing) {
+    next_expand();
+    return;
+  }
+  pp_timing = 1;
+  start = tcc_clock_ns();
+  next_expand();
+  s1->stats.pp_ns += tcc_clock_ns() - start;
+  pp_timing = 0;
+}
+
 /* push back current token and set current token to 'last_tok'. Only
    identifier case handled for labels. */
 ST_INLN void unget_tok(int last_tok)
@@ -3880,21 +4321,31 @@ ST_FUNC void preprocess_start(TCCState *s1, int filetype)
 
   tccpp_new(s1);
 
+  pp_timing = 0;
   s1->include_stack_ptr = s1->include_stack;
   s1->ifdef_stack_ptr = s1->ifdef_stack;
   file->ifdef_stack_ptr = s1->ifdef_stack_ptr;
   pp_expr = 0;
   pp_counter = 0;
   pp_debug_tok = pp_debug_symv = 0;
-  pp_once++;
+  if (s1->header_snapshot && s1->header_snapshot->valid)
+    pp_once = s1->header_snapshot->pp_once;
+  else
+    pp_once++;
   s1->pack_stack[0] = 0;
   s1->pack_stack_ptr = s1->pack_stack;
+  pack_record_str = NULL;
 
   set_idnum('$', !is_asm && s1->dollars_in_identifiers ? IS_ID : 0);
   set_idnum('.', is_asm ? IS_ID : 0);
 
   if (!(filetype & AFF_TYPE_ASM)) {
     cstr_new(&cstr);
+    if (s1->header_snapshot && s1->header_snapshot->valid) {
+      /* predefined and command line macros are part of the snapshot */
+      cstr_printf(&cstr, "#undef __BASE_FILE__\n#define __BASE_FILE__ \"%s\"\n", file->filename);
+      goto cmdline_done;
+    }
     if (s1->cmdline_defs.size)
       cstr_cat(&cstr, s1->cmdline_defs.data, s1->cmdline_defs.size);
     cstr_printf(&cstr, "#define __BASE_FILE__ \"%s\"\n", file->filename);
@@ -3906,6 +4357,7 @@ ST_FUNC void preprocess_start(TCCState *s1, int filetype)
       tcc_predefs(&cstr);
     if (s1->cmdline_incl.size)
       cstr_cat(&cstr, s1->cmdline_incl.data, s1->cmdline_incl.size);
+  cmdline_done:
     // printf("%s\n", (char*)cstr.data);
     *s1->include_stack_ptr++ = file;
     tcc_open_bf(s1, "<command line>", cstr.size);
@@ -3925,9 +4377,14 @@ ST_FUNC void preprocess_end(TCCState *s1)
   macro_ptr = NULL;
   while (file)
     tcc_close();
+  if (s1->include_cache)
+    include_cache_merge(s1);
   tccpp_delete(s1);
 }
 
+static void tccpp_snapshot_begin(TCCState *s1, TCCIHeaderSnapshot *hs);
+static void tccpp_snapshot_end(TCCState *s1, TCCIHeaderSnapshot *hs);
+
 ST_FUNC void tccpp_new(TCCState *s)
 {
   int i, c;
@@ -3944,14 +4401,19 @@ ST_FUNC void tccpp_new(TCCState *s)
   tal_new(&toksym_alloc, TOKSYM_TAL_LIMIT, TOKSYM_TAL_SIZE);
   tal_new(&tokstr_alloc, TOKSTR_TAL_LIMIT, TOKSTR_TAL_SIZE);
 
-  memset(hash_ident, 0, TOK_HASH_SIZE * sizeof(TokenSym *));
-  memset(s->cached_includes_hash, 0, sizeof s->cached_includes_hash);
-
   cstr_new(&cstr_buf);
   cstr_realloc(&cstr_buf, STRING_MAX_SIZE);
   tok_str_new(&tokstr_buf);
   tok_str_realloc(&tokstr_buf, TOKSTR_MAX_SIZE);
 
+  if (s->header_snapshot && s->header_snapshot->valid) {
+    tccpp_snapshot_begin(s, s->header_snapshot);
+    return;
+  }
+
+  memset(hash_ident, 0, TOK_HASH_SIZE * sizeof(TokenSym *));
+  memset(s->cached_includes_hash, 0, sizeof s->cached_includes_hash);
+
   tok_ident = TOK_IDENT;
   p = tcc_keywords;
   while (*p) {
@@ -3978,16 +4440,9 @@ ST_FUNC void tccpp_delete(TCCState *s)
 {
   int i, n;
 
-  dynarray_reset(&s->cached_includes, &s->nb_cached_includes);
-
-  /* free tokens */
   n = tok_ident - TOK_IDENT;
   if (n > total_idents)
     total_idents = n;
-  for (i = 0; i < n; i++)
-    tal_free(toksym_alloc, table_ident[i]);
-  tcc_free(table_ident);
-  table_ident = NULL;
 
   /* free static buffers */
   cstr_free(&tokcstr);
@@ -3995,6 +4450,19 @@ ST_FUNC void tccpp_delete(TCCState *s)
   cstr_free(&macro_equal_buf);
   tok_str_free_str(tokstr_buf.str);
 
+  if (s->header_snapshot) {
+    tccpp_snapshot_end(s, s->header_snapshot);
+  }
+  else {
+    dynarray_reset(&s->cached_includes, &s->nb_cached_includes);
+
+    /* free tokens */
+    for (i = 0; i < n; i++)
+      tal_free(toksym_alloc, table_ident[i]);
+    tcc_free(table_ident);
+  }
+  table_ident = NULL;
+
   /* free allocators */
   tal_delete(toksym_alloc);
   toksym_alloc = NULL;
@@ -4002,6 +4470,99 @@ ST_FUNC void tccpp_delete(TCCState *s)
   tokstr_alloc = NULL;
 }
 
+/* ------------------------------------------------------------------------- */
+/* interpreter header snapshots: the tokens, macros and include cache left
+   behind by the snapshot headers are kept between compilations. Each
+   compilation against a snapshot starts from that state and drops whatever
+   it added on top when it finishes (see also tccgen_snapshot_end()). */
+
+static void tccpp_snapshot_begin(TCCState *s1, TCCIHeaderSnapshot *hs)
+{
+  table_ident = hs->table_ident;
+  tok_ident = hs->tok_ident;
+  memcpy(hash_ident, hs->hash_ident, TOK_HASH_SIZE * sizeof(TokenSym *));
+  define_stack = hs->define_stack;
+
+  s1->cached_includes = hs->cached_includes;
+  s1->nb_cached_includes = hs->nb_cached_includes;
+  memcpy(s1->cached_includes_hash, hs->cached_includes_hash, sizeof s1->cached_includes_hash);
+}
+
+static void tccpp_snapshot_end(TCCState *s1, TCCIHeaderSnapshot *hs)
+{
+  TokenSym *ts, **pts;
+  unsigned int h;
+  int i, j;
+
+  if (!hs->valid) {
+    /* first compilation: keep everything */
+    hs->table_ident = table_ident;
+    hs->tok_ident = tok_ident;
+    hs->hash_ident = tcc_malloc(TOK_HASH_SIZE * sizeof(TokenSym *));
+    memcpy(hs->hash_ident, hash_ident, TOK_HASH_SIZE * sizeof(TokenSym *));
+    hs->toksym_alloc = toksym_alloc;
+    hs->tokstr_alloc = tokstr_alloc;
+    toksym_alloc = tokstr_alloc = NULL;
+    hs->pp_once = pp_once;
+    hs->cached_includes = s1->cached_includes;
+    hs->nb_cached_includes = s1->nb_cached_includes;
+    memcpy(hs->cached_includes_hash, s1->cached_includes_hash, sizeof hs->cached_includes_hash);
+    s1->cached_includes = NULL;
+    s1->nb_cached_includes = 0;
+    hs->valid = 1;
+    return;
+  }
+
+  /* unlink and free the tokens created by this compilation */
+  for (i = tok_ident - TOK_IDENT; i-- > hs->tok_ident - TOK_IDENT;) {
+    ts = table_ident[i];
+    h = TOK_HASH_INIT;
+    for (j = 0; j < ts->len; j++)
+      h = TOK_HASH_FUNC(h, ((unsigned char *)ts->str)[j]);
+    pts = &hash_ident[h & (TOK_HASH_SIZE - 1)];
+    while (*pts != ts)
+      pts = &(*pts)->hash_next;
+    *pts = ts->hash_next;
+    tal_free(toksym_alloc, ts);
+  }
+  /* the table may have grown */
+  hs->table_ident = table_ident;
+
+  for (i = hs->nb_cached_includes; i < s1->nb_cached_includes; i++)
+    tcc_free(s1->cached_includes[i]);
+  hs->cached_includes = s1->cached_includes;
+  s1->cached_includes = NULL;
+  s1->nb_cached_includes = 0;
+}
+
+ST_FUNC void tccpp_snapshot_free(TCCIHeaderSnapshot *hs)
+{
+  int i;
+
+  if (!hs->valid)
+    return;
+
+  /* macros and symbols are released with the allocators they came from */
+  table_ident = hs->table_ident;
+  tok_ident = hs->tok_ident;
+  toksym_alloc = hs->toksym_alloc;
+  tokstr_alloc = hs->tokstr_alloc;
+  tccgen_snapshot_free(hs);
+
+  for (i = 0; i < hs->tok_ident - TOK_IDENT; i++)
+    tal_free(toksym_alloc, table_ident[i]);
+  tcc_free(table_ident);
+  table_ident = NULL;
+  tcc_free(hs->hash_ident);
+  dynarray_reset(&hs->cached_includes, &hs->nb_cached_includes);
+
+  tal_delete(toksym_alloc);
+  toksym_alloc = NULL;
+  tal_delete(tokstr_alloc);
+  tokstr_alloc = NULL;
+  hs->valid = 0;
+}
+
 /* ------------------------------------------------------------------------- */
 /* tcc -E [-P[1]] [-dD} support */
 
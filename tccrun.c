@@ -216,6 +216,7 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr, addr_t ptr_diff)
   Section *s;
   unsigned offset, length, align, max_align, i, k, f;
   addr_t mem, addr;
+  uint64_t start;
 
   if (NULL == ptr) {
     s1->nb_errors = 0;
@@ -225,7 +226,9 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr, addr_t ptr_diff)
     tcc_add_runtime(s1);     // TODO -- this gets called multiple times - probably not good, but doesn't break anything
     resolve_common_syms(s1); // TODO -- caused error .. didn't need it .. but should have it, same as line above
 
+    start = tcc_clock_ns();
     build_got_entries(s1);
+    s1->stats.got_ns += tcc_clock_ns() - start;
 #endif
     if (s1->nb_errors)
       return -1;
@@ -265,7 +268,9 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr, addr_t ptr_diff)
   //        (void *)((ElfW(Sym) *)symtab_section->data)[ELFW(R_SYM)(((ElfW_Rel *)text_section->reloc->data)->r_info)]
   //            .st_value);
   /* relocate symbols */
+  start = tcc_clock_ns();
   relocate_syms(s1, s1->symtab, !(s1->nostdlib));
+  s1->stats.relocate_syms_ns += tcc_clock_ns() - start;
   if (s1->nb_errors)
     return -1;
 
@@ -282,6 +287,7 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr, addr_t ptr_diff)
   //            .st_value);
   // puts("xxx");
   /* relocate each section */
+  start = tcc_clock_ns();
   for (i = 1; i < s1->nb_sections; i++) {
     s = s1->sections[i];
     if (s->reloc) {
@@ -290,6 +296,7 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr, addr_t ptr_diff)
       // puts("zzz");
     }
   }
+  s1->stats.relocate_sections_ns += tcc_clock_ns() - start;
   // printf("##'L.0' [before relocate_plt] st_value=%p\n",
   //        (void *)((ElfW(Sym) *)symtab_section->data)[ELFW(R_SYM)(((ElfW_Rel *)text_section->reloc->data)->r_info)]
   //            .st_value);
@@ -455,10 +462,680 @@ typedef struct TCCIFuncRel {
 //   return 0;
 // }
 
+/* ------------------------------------------------------------- */
+/* redirect cells: one jump stub per redirected function, allocated from the arena code, which
+   jumps to the address held in a slot of the arena data. Calls go through the stub,
+   redefinitions only rewrite the slot (a single aligned pointer store). */
+#define TCCI_CELL_SIZE 8
+#define TCCI_CELLS_PER_BLOCK 256
+
+static void tcci_arena_alloc(TCCInterpState *itp, addr_t code_size, addr_t code_align, addr_t data_size,
+                             addr_t data_align, addr_t *code, addr_t *data);
+static unsigned char *tcci_code_rw(TCCInterpState *itp, addr_t ptr);
+
+static void *tcci_unresolved_redirect(void)
+{
+  puts("ERROR -redirect cell- Called a function which was never defined!!!\n");
+  return NULL;
+}
+
+/* the slot is addressed by the jmp *slot(%rip) of the cell */
+static void tcci_set_redirect_cell(unsigned char *cell, void *addr)
+{
+  *(void *volatile *)(cell + 6 + (int32_t)read32le(cell + 2)) = addr;
+}
+
+ST_FUNC void *tcci_get_redirect_cell(TCCInterpState *itp, unsigned long hash)
+{
+  unsigned char *cell, *rw;
+  addr_t code, slots;
+  void *addr;
+  int i;
+
+  tcci_lock(itp);
+  cell = hash_table_get_by_hash(hash, &itp->redir.hash_to_cell);
+  if (cell)
+    goto done;
+
+  if (!itp->redir.nb_cell_blocks || itp->redir.nb_block_cells == TCCI_CELLS_PER_BLOCK) {
+    tcci_arena_alloc(itp, TCCI_CELLS_PER_BLOCK * TCCI_CELL_SIZE, 15, TCCI_CELLS_PER_BLOCK * PTR_SIZE, PTR_SIZE - 1,
+                     &code, &slots);
+    rw = tcci_code_rw(itp, code);
+    for (i = 0; i < TCCI_CELLS_PER_BLOCK; ++i) {
+      cell = rw + i * TCCI_CELL_SIZE;
+      /* jmp *slot(%rip); ud2 */
+      cell[0] = 0xff;
+      cell[1] = 0x25;
+      write32le(cell + 2, slots + i * PTR_SIZE - (code + i * TCCI_CELL_SIZE + 6));
+      cell[6] = 0x0f;
+      cell[7] = 0x0b;
+      ((void **)slots)[i] = (void *)tcci_unresolved_redirect;
+    }
+    dynarray_add(&itp->redir.cell_blocks, &itp->redir.nb_cell_blocks, (void *)code);
+    itp->redir.nb_block_cells = 0;
+  }
+
+  cell = (unsigned char *)itp->redir.cell_blocks[itp->redir.nb_cell_blocks - 1] +
+         itp->redir.nb_block_cells++ * TCCI_CELL_SIZE;
+  addr = hash_table_get_by_hash(hash, &itp->redir.hash_to_addr);
+  if (addr)
+    tcci_set_redirect_cell(cell, addr);
+  hash_table_set_by_hash(hash, cell, &itp->redir.hash_to_cell);
+done:
+  tcci_unlock(itp);
+  return cell;
+}
+
+static unsigned tcci_got_user_slot(TCCISymbol *sym, void *got_entry)
+{
+  unsigned mask = sym->got_users_size - 1;
+  unsigned i = (unsigned)(((addr_t)got_entry / PTR_SIZE) * 2654435761u) & mask;
+
+  while (sym->got_users[i] && sym->got_users[i] != got_entry)
+    i = (i + 1) & mask;
+  return i;
+}
+
+/* put the GOT users of sym into a table of size slots, dropping the NULL ones */
+static void tcci_got_users_rehash(TCCISymbol *sym, unsigned size)
+{
+  void **old = sym->got_users;
+  unsigned old_size = sym->got_users_size, i;
+
+  sym->got_users = tcc_mallocz(size * sizeof(void *));
+  sym->got_users_size = size;
+  for (i = 0; i < old_size; ++i)
+    if (old[i])
+      sym->got_users[tcci_got_user_slot(sym, old[i])] = old[i];
+  tcc_free(old);
+}
+
+/* register the GOT entry got_entry as holding the address of sym, so that it is
+   updated when sym is redefined. Registering an entry again does nothing */
+ST_FUNC void tcci_add_got_user(TCCISymbol *sym, void *got_entry)
+{
+  unsigned i;
+
+  if (2 * (sym->nb_got_users + 1) > sym->got_users_size)
+    tcci_got_users_rehash(sym, sym->got_users_size ? 2 * sym->got_users_size : 4);
+  i = tcci_got_user_slot(sym, got_entry);
+  if (!sym->got_users[i]) {
+    sym->got_users[i] = got_entry;
+    ++sym->nb_got_users;
+  }
+}
+
+/* ------------------------------------------------------------- */
+/* profiler symbols of the relocated functions, see tcci_set_perf_map(). The files are named
+   after the process, so the interpretation contexts share them */
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define TCCI_JITDUMP_MAGIC 0x4A695444
+#define TCCI_JIT_CODE_LOAD 0
+
+static struct {
+  FILE *map, *dump;
+  void *dump_mark;     /* executable mapping of the dump, which tells perf record about it */
+  int nb_map, nb_dump; /* contexts using them */
+  uint64_t code_index;
+} tcci_perf;
+static pthread_mutex_t tcci_perf_lock = PTHREAD_MUTEX_INITIALIZER; /* held around the above */
+
+/* with tcci_perf_lock held, as tcci_perf_release() */
+static int tcci_perf_open_dump(void)
+{
+  char path[64];
+  uint32_t head[6];
+  uint64_t head2[2];
+  int fd;
+
+  snprintf(path, sizeof path, "/tmp/jit-%d.dump", (int)getpid());
+  fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+  if (fd < 0)
+    return -1;
+  tcci_perf.dump_mark = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+  if (tcci_perf.dump_mark == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  tcci_perf.dump = fdopen(fd, "w");
+  if (!tcci_perf.dump) {
+    munmap(tcci_perf.dump_mark, sysconf(_SC_PAGESIZE));
+    close(fd);
+    return -1;
+  }
+  head[0] = TCCI_JITDUMP_MAGIC;
+  head[1] = 1; /* version */
+  head[2] = sizeof head + sizeof head2;
+  head[3] = EM_TCC_TARGET;
+  head[4] = 0;
+  head[5] = getpid();
+  head2[0] = tcc_clock_ns();
+  head2[1] = 0; /* flags */
+  fwrite(head, sizeof head, 1, tcci_perf.dump);
+  fwrite(head2, sizeof head2, 1, tcci_perf.dump);
+  fflush(tcci_perf.dump);
+  return 0;
+}
+
+/* a perf map line and a jitdump code load record for the body of sym, each written at once */
+static void tcci_perf_add(TCCISymbol *sym)
+{
+  CString name, rec;
+  uint32_t head[6];
+  uint64_t load[4];
+
+  cstr_new(&name);
+  if (sym->binding == STB_LOCAL)
+    cstr_printf(&name, "%s [%s]", sym->name, sym->filename);
+  else
+    cstr_printf(&name, "%s", sym->name);
+
+  pthread_mutex_lock(&tcci_perf_lock);
+  if (tcci_perf.map)
+    fprintf(tcci_perf.map, "%lx %lx %s\n", (unsigned long)sym->addr, (unsigned long)sym->size, (char *)name.data);
+  if (tcci_perf.dump) {
+    load[0] = tcc_clock_ns();
+    head[0] = TCCI_JIT_CODE_LOAD;
+    head[1] = sizeof head + sizeof load + name.size + 1 + sym->size;
+    memcpy(head + 2, load, 8); /* timestamp */
+    head[4] = getpid();
+    head[5] = syscall(SYS_gettid);
+    load[0] = load[1] = (addr_t)sym->addr; /* vma, code address */
+    load[2] = sym->size;
+    load[3] = tcci_perf.code_index++;
+    cstr_new(&rec);
+    cstr_cat(&rec, (char *)head, sizeof head);
+    cstr_cat(&rec, (char *)load, sizeof load);
+    cstr_cat(&rec, name.data, name.size + 1);
+    cstr_cat(&rec, sym->addr, sym->size);
+    fwrite(rec.data, rec.size, 1, tcci_perf.dump);
+    cstr_free(&rec);
+  }
+  pthread_mutex_unlock(&tcci_perf_lock);
+  cstr_free(&name);
+}
+
+static void tcci_perf_flush(void)
+{
+  pthread_mutex_lock(&tcci_perf_lock);
+  if (tcci_perf.map)
+    fflush(tcci_perf.map);
+  if (tcci_perf.dump)
+    fflush(tcci_perf.dump);
+  pthread_mutex_unlock(&tcci_perf_lock);
+}
+
+static void tcci_perf_release(int flags)
+{
+  if ((flags & TCCI_PERF_MAP) && !--tcci_perf.nb_map) {
+    fclose(tcci_perf.map);
+    tcci_perf.map = NULL;
+  }
+  if ((flags & TCCI_PERF_JITDUMP) && !--tcci_perf.nb_dump) {
+    fclose(tcci_perf.dump);
+    munmap(tcci_perf.dump_mark, sysconf(_SC_PAGESIZE));
+    tcci_perf.dump = NULL;
+  }
+}
+
+LIBTCCINTERPAPI int tcci_set_perf_map(TCCInterpState *itp, int flags)
+{
+  char path[64];
+  int on = flags & ~itp->perf_flags, ret = -1;
+
+  pthread_mutex_lock(&tcci_perf_lock);
+  if (on & TCCI_PERF_MAP) {
+    if (!tcci_perf.nb_map) {
+      snprintf(path, sizeof path, "/tmp/perf-%d.map", (int)getpid());
+      tcci_perf.map = fopen(path, "a");
+      if (!tcci_perf.map)
+        goto done;
+    }
+    ++tcci_perf.nb_map;
+  }
+  if (on & TCCI_PERF_JITDUMP) {
+    if (!tcci_perf.nb_dump && tcci_perf_open_dump()) {
+      tcci_perf_release(on & TCCI_PERF_MAP);
+      goto done;
+    }
+    ++tcci_perf.nb_dump;
+  }
+  tcci_perf_release(itp->perf_flags & ~flags);
+  itp->perf_flags = flags;
+  ret = 0;
+done:
+  pthread_mutex_unlock(&tcci_perf_lock);
+  return ret;
+}
+#else
+#define tcci_perf_add(sym)
+#define tcci_perf_flush()
+
+LIBTCCINTERPAPI int tcci_set_perf_map(TCCInterpState *itp, int flags) { return flags ? -1 : 0; }
+#endif
+
+/* ------------------------------------------------------------- */
+/* the GDB JIT interface, see tcci_set_debugger_info(): each unit gets an in-memory ELF
+   object with the symbols and the unwind info of its functions, which is linked into
+   __jit_debug_descriptor where debuggers find it */
+#ifdef TCCI_DEBUGGER_INFO
+#include <pthread.h>
+
+enum { TCCI_JIT_NOACTION, TCCI_JIT_REGISTER, TCCI_JIT_UNREGISTER };
+
+typedef struct TCCIJitEntry {
+  struct TCCIJitEntry *next, *prev;
+  const char *image;
+  uint64_t image_size;
+} TCCIJitEntry;
+
+struct jit_descriptor {
+  uint32_t version;
+  uint32_t action_flag;
+  TCCIJitEntry *relevant_entry, *first_entry;
+};
+
+/* weak, so that another JIT of the process may provide them. The debugger sets a
+   breakpoint in __jit_debug_register_code() */
+__attribute__((weak, noinline)) void __jit_debug_register_code(void) { __asm__ __volatile__(""); }
+__attribute__((weak)) struct jit_descriptor __jit_debug_descriptor = {1, 0, 0, 0};
+static pthread_mutex_t tcci_jit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void tcci_jit_notify(TCCIJitEntry *entry, int action)
+{
+  __jit_debug_descriptor.relevant_entry = entry;
+  __jit_debug_descriptor.action_flag = action;
+  __jit_debug_register_code();
+  __jit_debug_descriptor.action_flag = TCCI_JIT_NOACTION;
+}
+
+static void tcci_put(CString *cs, const void *p, int n) { cstr_cat(cs, (const char *)p, n); }
+
+/* pad the entry from start on to 8 bytes and set its length */
+static void tcci_eh_entry_end(CString *cs, int start)
+{
+  uint32_t len;
+
+  while ((cs->size - start) & 7)
+    cstr_ccat(cs, 0); /* DW_CFA_nop */
+  len = cs->size - start - 4;
+  memcpy((char *)cs->data + start, &len, 4);
+}
+
+/* Appends the DW_CFA_offset rules of the callee-saved registers which the prolog of
+   @code stores after its sub $n,%rsp (see gfunc_epilog() in x86_64-gen.c), each one at
+   the end of its mov %reg,disp8(%rbp). Returns their number and their DWARF numbers in
+   @saved */
+static int tcci_eh_saves(CString *cs, const unsigned char *code, int size, unsigned char *saved)
+{
+  /* the registers in the order of their save slots, -8 * (i + 1) from %rbp */
+  static const unsigned char regvars[] = {3, 12, 13, 14, 15}; /* rbx, r12 - r15 */
+  int i, reg, pc = 4, at = 11, nb = 0;
+
+  if (size < at || code[4] != 0x48 || code[5] != 0x81 || code[6] != 0xec)
+    return 0;
+  for (i = 0; i < (int)sizeof regvars && at + 4 <= size; ++i) {
+    /* movq %reg, disp8(%rbp): REX.W[R] 89 modrm(01 reg 101) disp8 */
+    if ((code[at] & ~4) != 0x48 || code[at + 1] != 0x89 || (code[at + 2] & 0xc7) != 0x45)
+      break;
+    reg = (code[at] & 4) << 1 | (code[at + 2] >> 3 & 7);
+    while (i < (int)sizeof regvars && regvars[i] != reg)
+      ++i;
+    if (i == sizeof regvars || (signed char)code[at + 3] != -8 * (i + 1))
+      break;
+    at += 4;
+    cstr_ccat(cs, 0x40 | (at - pc)); /* DW_CFA_advance_loc */
+    cstr_ccat(cs, 0x80 | reg);       /* DW_CFA_offset reg, cfa - 16 - 8 * (i + 1) */
+    cstr_ccat(cs, 3 + i);
+    pc = at;
+    saved[nb++] = reg;
+  }
+  return nb;
+}
+
+/* .eh_frame of the bodies of a unit: a CIE with the state on entry, CFA = rsp + 8, and
+   an FDE per body following the push %rbp; mov %rsp,%rbp prolog, the register saves
+   after it and the leave of its epilog */
+static void tcci_eh_frame(CString *cs, TCCIUnit *unit)
+{
+  static const unsigned char cie[] = {
+      0, 0, 0, 0, 0, 0, 0, 0, 1, 0, /* length, CIE id, version, augmentation "" */
+      1, 0x78, 16,                  /* code & data alignment 1 & -8, return address rip */
+      0x0c, 7, 8,                   /* DW_CFA_def_cfa rsp 8 */
+      0x90, 1,                      /* DW_CFA_offset rip, cfa - 8 */
+  };
+  static const unsigned char prolog[] = {
+      0x55, 0x48, 0x89, 0xe5, /* push %rbp; mov %rsp,%rbp */
+  };
+  static const unsigned char frame[] = {
+      0x41, 0x0e, 16, /* DW_CFA_advance_loc 1, DW_CFA_def_cfa_offset 16 */
+      0x86, 2,        /* DW_CFA_offset rbp, cfa - 16 */
+      0x43, 0x0d, 6,  /* DW_CFA_advance_loc 3, DW_CFA_def_cfa_register rbp */
+  };
+  TCCIBody *body;
+  unsigned char *code, saved[5];
+  uint64_t range[2];
+  uint32_t cie_ptr;
+  int i, j, start, leave, pc, nb_saved;
+
+  tcci_put(cs, cie, sizeof cie);
+  tcci_eh_entry_end(cs, 0);
+  for (i = 0; i < unit->nb_bodies; ++i) {
+    body = unit->bodies + i;
+    code = body->addr;
+    start = cs->size;
+    cstr_cat(cs, "\0\0\0", 4);
+    cie_ptr = cs->size;
+    tcci_put(cs, &cie_ptr, 4);
+    range[0] = (addr_t)body->addr;
+    range[1] = body->size;
+    tcci_put(cs, range, sizeof range);
+    if (body->size > sizeof prolog + 2 && !memcmp(code, prolog, sizeof prolog)) {
+      tcci_put(cs, frame, sizeof frame);
+      nb_saved = tcci_eh_saves(cs, code, body->size, saved);
+      pc = nb_saved ? 11 + 4 * nb_saved : 4;
+      /* leave; ret or leave; ret $n */
+      leave = code[body->size - 1] == 0xc3 ? 2 : code[body->size - 3] == 0xc2 ? 4 : 0;
+      if (leave && code[body->size - leave] == 0xc9 && body->size - leave + 1 > pc) {
+        cstr_ccat(cs, 0x03); /* DW_CFA_advance_loc2 */
+        cstr_ccat(cs, (body->size - leave + 1 - pc) & 0xff);
+        cstr_ccat(cs, (body->size - leave + 1 - pc) >> 8);
+        cstr_ccat(cs, 0x0c), cstr_ccat(cs, 7), cstr_ccat(cs, 8); /* DW_CFA_def_cfa rsp 8 */
+        /* restored before the leave */
+        for (j = 0; j < nb_saved; ++j)
+          cstr_ccat(cs, 0xc0 | saved[j]); /* DW_CFA_restore */
+      }
+    }
+    tcci_eh_entry_end(cs, start);
+  }
+  cstr_cat(cs, "\0\0\0", 4); /* terminator */
+}
+
+/* the ELF object of a unit: a .text section without contents at the address of its code,
+   .eh_frame and the symbols of its bodies, the static ones first */
+static void tcci_jit_image(CString *img, TCCIUnit *unit)
+{
+  static const char shstr[] = "\0.text\0.eh_frame\0.symtab\0.strtab\0.shstrtab";
+  ElfW(Ehdr) ehdr;
+  ElfW(Shdr) sh[6];
+  ElfW(Sym) sym;
+  CString eh, str;
+  TCCIBody *body;
+  int i, pass, nb_locals = 1, symtab;
+
+  memset(&ehdr, 0, sizeof ehdr);
+  memset(sh, 0, sizeof sh);
+  cstr_new(&eh);
+  cstr_new(&str);
+  cstr_ccat(&str, 0);
+
+  tcci_put(img, &ehdr, sizeof ehdr);
+  tcci_eh_frame(&eh, unit);
+  sh[2].sh_offset = img->size;
+  tcci_put(img, eh.data, eh.size);
+  sh[2].sh_size = eh.size;
+  while (img->size & 7)
+    cstr_ccat(img, 0);
+
+  symtab = img->size;
+  memset(&sym, 0, sizeof sym);
+  tcci_put(img, &sym, sizeof sym);
+  for (pass = 0; pass < 2; ++pass)
+    for (i = 0; i < unit->nb_bodies; ++i) {
+      body = unit->bodies + i;
+      if ((body->sym->binding == STB_LOCAL) != !pass)
+        continue;
+      sym.st_name = str.size;
+      cstr_cat(&str, body->sym->name, strlen(body->sym->name) + 1);
+      sym.st_info = ELFW(ST_INFO)(pass ? STB_GLOBAL : STB_LOCAL, STT_FUNC);
+      sym.st_shndx = 1;
+      sym.st_value = (addr_t)body->addr - (addr_t)unit->code;
+      sym.st_size = body->size;
+      tcci_put(img, &sym, sizeof sym);
+      nb_locals += !pass;
+    }
+  sh[3].sh_offset = symtab;
+  sh[3].sh_size = img->size - symtab;
+  sh[4].sh_offset = img->size;
+  sh[4].sh_size = str.size;
+  tcci_put(img, str.data, str.size);
+  sh[5].sh_offset = img->size;
+  sh[5].sh_size = sizeof shstr;
+  tcci_put(img, shstr, sizeof shstr);
+  while (img->size & 7)
+    cstr_ccat(img, 0);
+
+  sh[1].sh_name = 1;
+  sh[1].sh_type = SHT_NOBITS;
+  sh[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  sh[1].sh_addr = (addr_t)unit->code;
+  sh[1].sh_size = unit->code_size;
+  sh[1].sh_addralign = 16;
+  sh[2].sh_name = 7;
+  sh[2].sh_type = SHT_PROGBITS;
+  sh[2].sh_flags = SHF_ALLOC;
+  sh[2].sh_addralign = 8;
+  sh[3].sh_name = 17;
+  sh[3].sh_type = SHT_SYMTAB;
+  sh[3].sh_link = 4;
+  sh[3].sh_info = nb_locals;
+  sh[3].sh_entsize = sizeof sym;
+  sh[3].sh_addralign = 8;
+  sh[4].sh_name = 25;
+  sh[4].sh_type = SHT_STRTAB;
+  sh[4].sh_addralign = 1;
+  sh[5].sh_name = 33;
+  sh[5].sh_type = SHT_STRTAB;
+  sh[5].sh_addralign = 1;
+
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_type = ET_REL;
+  ehdr.e_machine = EM_TCC_TARGET;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_shoff = img->size;
+  ehdr.e_ehsize = sizeof ehdr;
+  ehdr.e_shentsize = sizeof sh[0];
+  ehdr.e_shnum = 6;
+  ehdr.e_shstrndx = 5;
+  memcpy(img->data, &ehdr, sizeof ehdr);
+  tcci_put(img, sh, sizeof sh);
+  /* the image doesn't move anymore */
+  ((ElfW(Shdr) *)((char *)img->data + ehdr.e_shoff))[2].sh_addr = (addr_t)img->data + sh[2].sh_offset;
+  cstr_free(&eh);
+  cstr_free(&str);
+}
+
+static void tcci_jit_register(TCCIUnit *unit)
+{
+  TCCIJitEntry *entry = tcc_mallocz(sizeof(TCCIJitEntry));
+  CString img;
+
+  cstr_new(&img);
+  tcci_jit_image(&img, unit);
+  entry->image = img.data;
+  entry->image_size = img.size;
+  unit->jit_entry = entry;
+
+  pthread_mutex_lock(&tcci_jit_lock);
+  entry->next = __jit_debug_descriptor.first_entry;
+  if (entry->next)
+    entry->next->prev = entry;
+  __jit_debug_descriptor.first_entry = entry;
+  tcci_jit_notify(entry, TCCI_JIT_REGISTER);
+  pthread_mutex_unlock(&tcci_jit_lock);
+}
+
+static void tcci_jit_unregister(TCCIUnit *unit)
+{
+  TCCIJitEntry *entry = unit->jit_entry;
+
+  if (!entry)
+    return;
+  pthread_mutex_lock(&tcci_jit_lock);
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    __jit_debug_descriptor.first_entry = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  tcci_jit_notify(entry, TCCI_JIT_UNREGISTER);
+  pthread_mutex_unlock(&tcci_jit_lock);
+  tcc_free((void *)entry->image);
+  tcc_free(entry);
+  unit->jit_entry = NULL;
+}
+
+LIBTCCINTERPAPI int tcci_set_debugger_info(TCCInterpState *itp, unsigned char enabled)
+{
+  itp->debugger_info = enabled;
+  return 0;
+}
+#else
+#define tcci_jit_register(unit)
+#define tcci_jit_unregister(unit)
+
+LIBTCCINTERPAPI int tcci_set_debugger_info(TCCInterpState *itp, unsigned char enabled) { return enabled ? -1 : 0; }
+#endif
+
+/* ------------------------------------------------------------- */
+/* the address index of the bodies, see tcci_find_symbol_by_addr(). Lookups take no lock: the
+   writer makes seq odd while changing the index and readers retry when seq changed under
+   them. An outgrown index stays readable until tcci_collect() */
+#if defined __GNUC__ && !defined __TINYC__
+#define TCCI_BARRIER() __atomic_thread_fence(__ATOMIC_ACQ_REL)
+#else
+#define TCCI_BARRIER() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* the number of ranges of ix starting at or below addr. The halving takes no branch on the
+   compares, which would mostly mispredict on the addresses of samples */
+static int tcci_addr_index_upper(TCCIAddrIndex *ix, int nb, addr_t addr)
+{
+  TCCIAddrRange *r = ix->ranges;
+  int half;
+
+  if (!nb)
+    return 0;
+  while (nb > 1) {
+    half = nb >> 1;
+    r = r[half].start <= addr ? r + half : r;
+    nb -= half;
+  }
+  return r - ix->ranges + (r->start <= addr);
+}
+
+static void tcci_addr_index_add(TCCInterpState *itp, TCCISymbol *sym, addr_t start, addr_t size)
+{
+  TCCIAddrIndex *ix = itp->addr_index.index, *grown;
+  TCCIAddrRange *r;
+  int i, size2;
+
+  if (!ix || ix->nb == ix->size) {
+    size2 = ix ? ix->size * 2 : 64;
+    grown = tcc_malloc(sizeof(TCCIAddrIndex) + (size2 - 1) * sizeof(TCCIAddrRange));
+    grown->size = size2;
+    grown->nb = 0;
+    if (ix) {
+      grown->nb = ix->nb;
+      memcpy(grown->ranges, ix->ranges, ix->nb * sizeof(TCCIAddrRange));
+      dynarray_add(&itp->addr_index.retired, &itp->addr_index.nb_retired, ix);
+    }
+    TCCI_BARRIER();
+    itp->addr_index.index = ix = grown;
+  }
+  /* new units are mostly placed above the others */
+  i = ix->nb && ix->ranges[ix->nb - 1].start < start ? ix->nb : tcci_addr_index_upper(ix, ix->nb, start);
+
+  ++itp->addr_index.seq;
+  TCCI_BARRIER();
+  r = ix->ranges + i;
+  memmove(r + 1, r, (ix->nb - i) * sizeof(TCCIAddrRange));
+  r->start = start;
+  r->end = start + size;
+  r->sym = sym;
+  ++ix->nb;
+  TCCI_BARRIER();
+  ++itp->addr_index.seq;
+}
+
+/* drop the ranges within [start, end) */
+static void tcci_addr_index_remove(TCCInterpState *itp, addr_t start, addr_t end)
+{
+  TCCIAddrIndex *ix = itp->addr_index.index;
+  int i, j;
+
+  if (!ix)
+    return;
+  ++itp->addr_index.seq;
+  TCCI_BARRIER();
+  for (i = j = 0; i < ix->nb; ++i)
+    if (ix->ranges[i].start < start || ix->ranges[i].start >= end)
+      ix->ranges[j++] = ix->ranges[i];
+  ix->nb = j;
+  TCCI_BARRIER();
+  ++itp->addr_index.seq;
+}
+
+static void tcci_addr_index_free(TCCInterpState *itp, int all)
+{
+  dynarray_reset(&itp->addr_index.retired, &itp->addr_index.nb_retired);
+  if (all) {
+    tcc_free(itp->addr_index.index);
+    itp->addr_index.index = NULL;
+  }
+}
+
+LIBTCCINTERPAPI const char *tcci_find_symbol_by_addr(TCCInterpState *itp, const void *pc, const char **filename,
+                                                     unsigned long *offset)
+{
+  TCCIAddrIndex *ix;
+  TCCIAddrRange *r;
+  TCCISymbol *sym;
+  addr_t off = 0;
+  unsigned seq;
+  int i, nb, tries;
+
+  for (tries = 0; tries < 1000; ++tries) {
+    seq = itp->addr_index.seq;
+    if (seq & 1)
+      continue;
+    TCCI_BARRIER();
+    sym = NULL;
+    ix = itp->addr_index.index;
+    if (ix) {
+      nb = ix->nb < ix->size ? ix->nb : ix->size;
+      i = tcci_addr_index_upper(ix, nb, (addr_t)pc);
+      r = ix->ranges + (i ? i - 1 : 0);
+      if (i && (addr_t)pc < r->end) {
+        sym = r->sym;
+        off = (addr_t)pc - r->start;
+      }
+    }
+    TCCI_BARRIER();
+    if (seq != itp->addr_index.seq)
+      continue;
+    if (!sym)
+      return NULL;
+    if (filename)
+      *filename = sym->filename;
+    if (offset)
+      *offset = off;
+    return sym->name;
+  }
+  return NULL;
+}
+
 void tcci_set_interp_symbol(TCCInterpState *itp, const char *filename, const char *symbol_name, u_char binding,
-                            u_char type, void *addr)
+                            u_char type, void *addr, addr_t size)
 {
   long unsigned hash = hash_djb2(symbol_name);
+  unsigned char *cell;
   // printf("tcci_set_interp_symbol: '%s' bnd:%u type:%u '%s'\n", symbol_name, binding, type, filename);
   if (binding == STB_LOCAL) {
     hash *= hash_djb2(filename);
@@ -472,7 +1149,14 @@ void tcci_set_interp_symbol(TCCInterpState *itp, const char *filename, const cha
 
     // void *prev_addr = hash_table_get_by_hash(hash, &itp->redir.hash_to_addr);
     hash_table_set_by_hash(hash, addr, &itp->redir.hash_to_addr);
-    hash_table_set_by_hash((unsigned long)sym->addr, addr, &itp->redir.addr_to_addr);
+    // Every previous address maps straight to the symbol (and so to its newest address)
+    hash_table_set_by_hash((unsigned long)sym->addr, sym, &itp->redir.addr_to_sym);
+
+    if (sym->unit) {
+      --sym->unit->nb_live;
+      sym->dead_size += sym->size;
+    }
+    tcci_single_use_invalidate(itp, hash);
   }
   else {
     sym = tcc_mallocz(sizeof(TCCISymbol));
@@ -486,17 +1170,448 @@ void tcci_set_interp_symbol(TCCInterpState *itp, const char *filename, const cha
     hash_table_set_by_hash(hash, (void *)addr, &itp->redir.hash_to_addr);
   }
 
+  cell = hash_table_get_by_hash(hash, &itp->redir.hash_to_cell);
+  if (cell)
+    tcci_set_redirect_cell(cell, addr);
+
   // Set Properties
   sym->binding = binding;
   sym->type = type;
   sym->addr = addr;
+  sym->size = size;
+  sym->unit = itp->unit;
+  if (sym->unit) {
+    TCCIUnit *unit = sym->unit;
+    TCCIBody *body;
+
+    if (!(unit->nb_bodies & 15))
+      unit->bodies = tcc_realloc(unit->bodies, (unit->nb_bodies + 16) * sizeof(TCCIBody));
+    body = unit->bodies + unit->nb_bodies++;
+    body->sym = sym;
+    body->addr = addr;
+    body->size = size;
+    ++unit->nb_live;
+    if (size)
+      tcci_addr_index_add(itp, sym, (addr_t)addr, size);
+  }
+  if (sym->unit && itp->perf_flags)
+    tcci_perf_add(sym);
 
   if (sym->nb_got_users) {
-    printf("has %u users>\n", sym->nb_got_users);
-    for (int b = 0; b < sym->nb_got_users; ++b) {
-      printf("--%p %p  before:%p\n", sym->got_users[b], sym->got_users[b], *(void **)sym->got_users[b]);
-      *(void **)sym->got_users[b] = (void *)addr;
-      printf("--%p %p  after:%p\n", sym->got_users[b], sym->got_users[b], *(void **)sym->got_users[b]);
+    for (unsigned b = 0; b < sym->got_users_size; ++b)
+      if (sym->got_users[b])
+        *(void **)sym->got_users[b] = (void *)addr;
+  }
+}
+
+/* ------------------------------------------------------------- */
+/* interpreter arenas: the code and data of compiled units are allocated from
+   one reserved address range, code from its lower half and data from its
+   upper half, so that both stay in pc-relative reach of each other and the
+   code of all units stays packed together. Pages get committed a chunk at a
+   time. The code half is backed by a file mapped twice, executable at its
+   addresses and writable at an alias which relocation and the redirect cells
+   write through, so that no page is both. Without such a file (and on
+   Windows) code pages are committed rwx. */
+#define TCCI_ARENA_SIZE ((addr_t)1 << (PTR_SIZE == 8 ? 30 : 26))
+#define TCCI_ARENA_CHUNK ((addr_t)1 << 20)
+
+static void tcci_heap_init(TCCIArenaHeap *h, addr_t start, addr_t end, int exec)
+{
+  memset(h, 0, sizeof *h);
+  h->start = h->top = h->committed = start;
+  h->end = end;
+  h->exec = exec;
+  h->fd = -1;
+}
+
+#ifndef _WIN32
+/* an unlinked file of size bytes for the two views of arena code, -1 if there is none */
+static int tcci_code_file(addr_t size)
+{
+  char tmpfname[] = "/tmp/.tcciXXXXXX";
+  int fd = -1;
+
+#if defined __linux__ && defined SYS_memfd_create
+  fd = syscall(SYS_memfd_create, "tcci-code", 1 /* MFD_CLOEXEC */);
+#endif
+  if (fd < 0) {
+    fd = mkstemp(tmpfname);
+    if (fd >= 0)
+      unlink(tmpfname);
+  }
+  if (fd >= 0 && ftruncate(fd, size)) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+#endif
+
+static TCCIArena *tcci_arena_new(TCCState *s1)
+{
+  TCCIArena *arena = tcc_mallocz(sizeof(TCCIArena));
+  addr_t base;
+
+  arena->size = TCCI_ARENA_SIZE;
+#ifdef _WIN32
+  arena->base = VirtualAlloc(NULL, arena->size, MEM_RESERVE, PAGE_NOACCESS);
+  if (!arena->base)
+#else
+  arena->base = mmap(NULL, arena->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (arena->base == MAP_FAILED)
+#endif
+  {
+    tcc_free(arena);
+    tcc_error("could not reserve interpreter memory");
+  }
+
+  base = (addr_t)arena->base;
+  tcci_heap_init(&arena->code, base, base + arena->size / 2, 1);
+  tcci_heap_init(&arena->data, base + arena->size / 2, base + arena->size, 0);
+#ifndef _WIN32
+  arena->code.fd = tcci_code_file(arena->size / 2);
+  if (arena->code.fd >= 0) {
+    arena->alias = mmap(NULL, arena->size / 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena->alias != MAP_FAILED)
+      arena->code.alias = (addr_t)arena->alias - base;
+    else {
+      close(arena->code.fd);
+      arena->code.fd = -1;
+      arena->alias = NULL;
+    }
+  }
+#endif
+  return arena;
+}
+
+static void tcci_heap_commit(TCCState *s1, TCCIArenaHeap *h, addr_t end)
+{
+  addr_t size;
+  uint64_t start;
+
+  while (h->committed < end) {
+    start = tcc_clock_ns();
+    size = TCCI_ARENA_CHUNK;
+    if (size > h->end - h->committed)
+      size = h->end - h->committed;
+#ifdef _WIN32
+    if (!VirtualAlloc((void *)h->committed, size, MEM_COMMIT, h->exec ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE))
+#else
+    if (h->alias ? mmap((void *)h->committed, size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, h->fd,
+                        h->committed - h->start) == MAP_FAILED ||
+                       mmap((void *)(h->committed + h->alias), size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                            h->fd, h->committed - h->start) == MAP_FAILED
+                 : mprotect((void *)h->committed, size, PROT_READ | PROT_WRITE | (h->exec ? PROT_EXEC : 0)))
+#endif
+      tcc_error("mprotect failed: did you mean to configure --with-selinux?");
+    h->committed += size;
+    s1->stats.set_pages_ns += tcc_clock_ns() - start;
+    ++s1->stats.nb_set_pages;
+  }
+}
+
+static void tcci_heap_add_range(TCCIArenaHeap *h, addr_t start, addr_t end)
+{
+  if (!(h->nb_free_ranges & 15))
+    h->free_ranges = tcc_realloc(h->free_ranges, (h->nb_free_ranges + 16) * sizeof(addr_t));
+  h->free_ranges[h->nb_free_ranges++] = start;
+  h->free_ranges[h->nb_free_ranges++] = end;
+}
+
+static void tcci_heap_remove_range(TCCIArenaHeap *h, int i)
+{
+  h->nb_free_ranges -= 2;
+  h->free_ranges[i] = h->free_ranges[h->nb_free_ranges];
+  h->free_ranges[i + 1] = h->free_ranges[h->nb_free_ranges + 1];
+}
+
+/* Returns 0 when the heap has no room left for size bytes */
+static addr_t tcci_heap_alloc(TCCState *s1, TCCIArenaHeap *h, addr_t size, addr_t align)
+{
+  addr_t p, start, end;
+  int i;
+
+  if (!size)
+    size = 1;
+
+  /* first fit from the freed ranges */
+  for (i = 0; i < h->nb_free_ranges; i += 2) {
+    start = h->free_ranges[i];
+    end = h->free_ranges[i + 1];
+    p = (start + align) & ~align;
+    if (p + size > end)
+      continue;
+    tcci_heap_remove_range(h, i);
+    if (p > start)
+      tcci_heap_add_range(h, start, p);
+    if (p + size < end)
+      tcci_heap_add_range(h, p + size, end);
+    return p;
+  }
+
+  p = (h->top + align) & ~align;
+  if (p + size > h->end)
+    return 0;
+  tcci_heap_commit(s1, h, p + size);
+  if (p > h->top)
+    tcci_heap_add_range(h, h->top, p);
+  h->top = p + size;
+  return p;
+}
+
+static void tcci_heap_free(TCCIArenaHeap *h, addr_t p, addr_t size)
+{
+  addr_t end;
+  int i;
+
+  if (!size)
+    size = 1;
+  end = p + size;
+
+  /* merge with the adjacent freed ranges */
+  for (i = 0; i < h->nb_free_ranges;) {
+    if (h->free_ranges[i + 1] == p)
+      p = h->free_ranges[i];
+    else if (h->free_ranges[i] == end)
+      end = h->free_ranges[i + 1];
+    else {
+      i += 2;
+      continue;
+    }
+    tcci_heap_remove_range(h, i);
+  }
+
+  if (end == h->top)
+    h->top = p;
+  else
+    tcci_heap_add_range(h, p, end);
+}
+
+/* allocate the code and data of one unit from the same arena */
+static void tcci_arena_alloc(TCCInterpState *itp, addr_t code_size, addr_t code_align, addr_t data_size,
+                             addr_t data_align, addr_t *code, addr_t *data)
+{
+  TCCState *s1 = itp->s1;
+  TCCIArena *arena;
+
+  if (code_size + code_align >= TCCI_ARENA_SIZE / 2 || data_size + data_align >= TCCI_ARENA_SIZE / 2)
+    tcc_error("compiled unit too large for the interpreter arena");
+
+  if (itp->nb_arenas) {
+    arena = itp->arenas[itp->nb_arenas - 1];
+    *code = tcci_heap_alloc(s1, &arena->code, code_size, code_align);
+    if (*code) {
+      *data = tcci_heap_alloc(s1, &arena->data, data_size, data_align);
+      if (*data)
+        return;
+      tcci_heap_free(&arena->code, *code, code_size);
+    }
+  }
+
+  arena = tcci_arena_new(s1);
+  dynarray_add(&itp->arenas, &itp->nb_arenas, arena);
+  *code = tcci_heap_alloc(s1, &arena->code, code_size, code_align);
+  *data = tcci_heap_alloc(s1, &arena->data, data_size, data_align);
+}
+
+/* the writable view of the code at ptr */
+static unsigned char *tcci_code_rw(TCCInterpState *itp, addr_t ptr)
+{
+  TCCIArena *arena;
+  int i;
+
+  for (i = 0; i < itp->nb_arenas; ++i) {
+    arena = itp->arenas[i];
+    if (ptr >= arena->code.start && ptr < arena->code.end)
+      return (unsigned char *)(ptr + arena->code.alias);
+  }
+  return (unsigned char *)ptr;
+}
+
+/* give back memory of a unit that will not be run again */
+ST_FUNC void tcci_arena_free(TCCInterpState *itp, void *ptr, addr_t size)
+{
+  TCCIArena *arena;
+  addr_t p = (addr_t)ptr;
+  int i;
+
+  for (i = 0; i < itp->nb_arenas; ++i) {
+    arena = itp->arenas[i];
+    if (p >= arena->code.start && p < arena->code.end)
+      tcci_heap_free(&arena->code, p, size);
+    else if (p >= arena->data.start && p < arena->data.end)
+      tcci_heap_free(&arena->data, p, size);
+  }
+}
+
+/* Release the units whose function bodies have all been superseded. Only safe at a point where no superseded
+   code is running, see libtccinterp.h */
+LIBTCCINTERPAPI unsigned long tcci_collect(TCCInterpState *itp)
+{
+  TCCIUnit *unit, **dead = NULL;
+  TCCIBody *body;
+  TCCISymbol *sym;
+  hash_table_entry_t *ent;
+  unsigned long released = 0;
+  addr_t p;
+  int i, j, k, nb_dead = 0;
+  unsigned nb_users;
+
+  for (i = 0; i < itp->nb_units;) {
+    unit = itp->units[i];
+    if (!unit->nb_bodies || unit->nb_live) {
+      ++i;
+      continue;
+    }
+    itp->units[i] = itp->units[--itp->nb_units];
+    dynarray_add(&dead, &nb_dead, unit);
+  }
+  if (!nb_dead)
+    return 0;
+
+  /* drop the GOT entries of dead units from the symbols they were using */
+  for (ent = hash_table_first(&itp->symbols); ent; ent = hash_table_next(&itp->symbols, ent)) {
+    sym = (TCCISymbol *)ent->value;
+    if (!sym->nb_got_users)
+      continue;
+    nb_users = sym->nb_got_users;
+    for (j = 0; j < (int)sym->got_users_size; ++j) {
+      p = (addr_t)sym->got_users[j];
+      if (!p)
+        continue;
+      for (k = 0; k < nb_dead; ++k)
+        if (p >= (addr_t)dead[k]->data && p < (addr_t)dead[k]->data + dead[k]->data_size)
+          break;
+      if (k < nb_dead) {
+        sym->got_users[j] = NULL;
+        --sym->nb_got_users;
+      }
+    }
+    /* removing entries cuts the probe chains going past them */
+    if (sym->nb_got_users != nb_users)
+      tcci_got_users_rehash(sym, sym->got_users_size);
+  }
+
+  for (k = 0; k < nb_dead; ++k) {
+    unit = dead[k];
+    /* the addresses may be reused by new bodies */
+    for (j = 0; j < unit->nb_bodies; ++j) {
+      body = unit->bodies + j;
+      body->sym->dead_size -= body->size;
+      if (hash_table_get_by_hash((unsigned long)body->addr, &itp->redir.addr_to_sym))
+        hash_table_remove((unsigned long)body->addr, &itp->redir.addr_to_sym);
+    }
+    tcci_jit_unregister(unit);
+    tcci_addr_index_remove(itp, (addr_t)unit->code, (addr_t)unit->code + unit->code_size);
+    tcci_arena_free(itp, unit->code, unit->code_size);
+    tcci_arena_free(itp, unit->data, unit->data_size);
+    released += unit->code_size + unit->data_size;
+    itp->runtime_mem_size -= unit->code_size + unit->data_size;
+    tcc_free(unit->bodies);
+  }
+  dynarray_reset(&dead, &nb_dead);
+  tcci_addr_index_free(itp, 0);
+
+  return released;
+}
+
+/* whether ptr is in the arena the next unit gets allocated from (unless
+   it has no room left), so that pc-relative references of the unit reach it */
+ST_FUNC int tcci_arena_in_reach(TCCInterpState *itp, void *ptr)
+{
+  TCCIArena *arena;
+
+  if (!itp->nb_arenas)
+    return 0;
+  arena = itp->arenas[itp->nb_arenas - 1];
+  return (addr_t)ptr >= (addr_t)arena->base && (addr_t)ptr < (addr_t)arena->base + arena->size;
+}
+
+ST_FUNC void tcci_arenas_delete(TCCInterpState *itp)
+{
+  TCCIArena *arena;
+  int i;
+
+  for (i = 0; i < itp->nb_units; ++i) {
+    tcci_jit_unregister(itp->units[i]);
+    tcc_free(itp->units[i]->bodies);
+  }
+  dynarray_reset(&itp->units, &itp->nb_units);
+  tcci_addr_index_free(itp, 1);
+
+  for (i = 0; i < itp->nb_arenas; ++i) {
+    arena = itp->arenas[i];
+#ifdef _WIN32
+    VirtualFree(arena->base, 0, MEM_RELEASE);
+#else
+    munmap(arena->base, arena->size);
+    if (arena->alias)
+      munmap(arena->alias, arena->size / 2);
+    if (arena->code.fd >= 0)
+      close(arena->code.fd);
+#endif
+    tcc_free(arena->code.free_ranges);
+    tcc_free(arena->data.free_ranges);
+  }
+  dynarray_reset(&itp->arenas, &itp->nb_arenas);
+}
+
+/* lay out the allocated code (exec) or data (!exec) sections from addr on.
+   Returns their total size and raises *palign to their alignment */
+static addr_t tcci_layout_sections(TCCState *s1, int exec, addr_t addr, addr_t *palign)
+{
+  Section *s;
+  addr_t offset = 0, align;
+  int i, f = 0;
+
+  for (i = 1; i < s1->nb_sections; i++) {
+    s = s1->sections[i];
+    if (0 == (s->sh_flags & SHF_ALLOC))
+      continue;
+    if (exec != !!(s->sh_flags & SHF_EXECINSTR))
+      continue;
+    align = s->sh_addralign - 1;
+    if (++f == 1 && align < RUN_SECTION_ALIGNMENT)
+      align = RUN_SECTION_ALIGNMENT;
+    if (*palign < align)
+      *palign = align;
+    offset += -(addr + offset) & align;
+    s->sh_addr = addr ? addr + offset : 0;
+    offset += s->data_offset;
+  }
+  return offset;
+}
+
+/* remember the definitions unit compiled in incremental mode. A variable keeps
+   the unit alive until it is compiled again */
+static void tcci_commit_definitions(TCCInterpState *itp, TCCIUnit *unit)
+{
+  TCCState *s1 = itp->s1;
+  TCCIPendingDef *pd;
+  TCCIDefinition *def;
+  ElfW(Sym) * sym;
+  int i;
+
+  for (i = 0; i < s1->nb_pending_defs; ++i) {
+    pd = s1->pending_defs + i;
+    sym = (ElfW(Sym) *)symtab_section->data + pd->sym_index;
+    def = hash_table_get_by_hash(pd->key, &itp->definitions);
+    if (!def) {
+      def = tcc_mallocz(sizeof(TCCIDefinition));
+      hash_table_set_by_hash(pd->key, def, &itp->definitions);
+    }
+    if (def->unit)
+      --def->unit->nb_live;
+    def->fingerprint = pd->fingerprint;
+    def->addr = NULL;
+    def->size = 0;
+    def->unit = NULL;
+    if (ELFW(ST_TYPE)(sym->st_info) == STT_OBJECT) {
+      def->addr = (void *)sym->st_value;
+      def->size = sym->st_size;
+      def->unit = unit;
+      ++unit->nb_live;
     }
   }
 }
@@ -505,8 +1620,11 @@ LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *itp)
 {
   TCCState *s1 = itp->s1;
   Section *s;
-  unsigned offset, length, align, max_align, i, k, f;
-  addr_t mem, addr;
+  unsigned length, i;
+  addr_t code, data, code_size, data_size, code_align, data_align;
+  TCCIUnit *unit = NULL;
+  void *ptr;
+  uint64_t start;
 
   s1->nb_errors = 0;
 #ifdef TCC_TARGET_PE
@@ -515,100 +1633,60 @@ LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *itp)
   tcc_add_runtime(s1);     // TODO -- this gets called multiple times - probably not good, but doesn't break anything
   resolve_common_syms(s1); // TODO -- caused error .. didn't need it .. but should have it, same as line above
 
+  start = tcc_clock_ns();
   build_got_entries(s1);
+  s1->stats.got_ns += tcc_clock_ns() - start;
 #endif
   if (s1->nb_errors)
     return 1;
 
-  offset = max_align = 0, mem = (addr_t)NULL;
-#ifdef _WIN64
-  offset += sizeof(void *); /* space for function_table pointer */
-#endif
-  for (k = 0; k < 2; ++k) {
-    f = 0, addr = k ? mem : mem + 0 /*ptr_diff*/;
-    for (i = 1; i < s1->nb_sections; i++) {
-      s = s1->sections[i];
-      if (0 == (s->sh_flags & SHF_ALLOC))
-        continue;
-      if (k != !(s->sh_flags & SHF_EXECINSTR))
-        continue;
-      align = s->sh_addralign - 1;
-      if (++f == 1 && align < RUN_SECTION_ALIGNMENT)
-        align = RUN_SECTION_ALIGNMENT;
-      if (max_align < align)
-        max_align = align;
-      offset += -(addr + offset) & align;
-      // printf("rex0, s1->sections[%i]('%s')->data_offset:%lu %i\n", i, s1->sections[i]->name,
-      //        s1->sections[i]->data_offset, offset);
-      s->sh_addr = mem ? addr + offset : 0;
-      offset += s->data_offset;
-#if 0
-            if (mem)
-                printf("%-16s %p  len %04x  align %2d\n",
-                    s->name, (void*)s->sh_addr, (unsigned)s->data_offset, align + 1);
-#endif
-    }
-  }
+  /* sizes */
+  code_align = data_align = 0;
+  code_size = tcci_layout_sections(s1, 1, 0, &code_align);
+  data_size = tcci_layout_sections(s1, 0, 0, &data_align);
 
   // printf("##'L.0' [before relocate_syms] st_value=%p\n",
   //        (void *)((ElfW(Sym) *)symtab_section->data)[ELFW(R_SYM)(((ElfW_Rel *)text_section->reloc->data)->r_info)]
   //            .st_value);
   /* relocate symbols */
+  start = tcc_clock_ns();
   tcci_relocate_syms(itp, s1->symtab, !(s1->nostdlib), 0);
+  s1->stats.relocate_syms_ns += tcc_clock_ns() - start;
   if (s1->nb_errors)
     return 2;
 
-  // printf("offset=%i max_align=%i\n", offset, max_align);
-  void *ptr = tcc_malloc(offset + max_align);
+  tcci_arena_alloc(itp, code_size, code_align, data_size, data_align, &code, &data);
   if (itp->in_single_use_state) {
-    itp->single_use.runtime_mem = ptr;
+    itp->single_use.code_mem = (void *)code;
+    itp->single_use.code_size = code_size;
+    itp->single_use.data_mem = (void *)data;
+    itp->single_use.data_size = data_size;
   }
   else {
-    dynarray_add(&itp->runtime_mem_blocks, &itp->nb_runtime_mem_blocks, ptr);
-    itp->runtime_mem_size += (uint64_t)offset + max_align;
+    unit = tcc_mallocz(sizeof(TCCIUnit));
+    unit->code = (void *)code;
+    unit->code_size = code_size;
+    unit->data = (void *)data;
+    unit->data_size = data_size;
+    dynarray_add(&itp->units, &itp->nb_units, unit);
+    itp->runtime_mem_size += (uint64_t)code_size + data_size;
   }
-  // printf("ptr @%p allocated:%i\n", ptr, offset + max_align);
 
-  offset = max_align = 0, mem = (addr_t)ptr;
-#ifdef _WIN64
-  offset += sizeof(void *); /* space for function_table pointer */
-#endif
-  for (k = 0; k < 2; ++k) {
-    f = 0, addr = k ? mem : mem + 0 /*ptr_diff*/;
-    for (i = 1; i < s1->nb_sections; i++) {
-      s = s1->sections[i];
-      if (0 == (s->sh_flags & SHF_ALLOC))
-        continue;
-      if (k != !(s->sh_flags & SHF_EXECINSTR))
-        continue;
-      align = s->sh_addralign - 1;
-      if (++f == 1 && align < RUN_SECTION_ALIGNMENT)
-        align = RUN_SECTION_ALIGNMENT;
-      if (max_align < align)
-        max_align = align;
-      offset += -(addr + offset) & align;
-      // printf("rex0, s1->sections[%i]('%s')->data_offset:%lu %i\n", i, s1->sections[i]->name,
-      //        s1->sections[i]->data_offset, offset);
-      s->sh_addr = mem ? addr + offset : 0;
-      offset += s->data_offset;
-#if 0
-            if (mem)
-                printf("%-16s %p  len %04x  align %2d\n",
-                    s->name, (void*)s->sh_addr, (unsigned)s->data_offset, align + 1);
-#endif
-    }
-  }
+  tcci_layout_sections(s1, 1, code, &code_align);
+  tcci_layout_sections(s1, 0, data, &data_align);
 
   // printf("##'L.0' [before relocate_syms] st_value=%p\n",
   //        (void *)((ElfW(Sym) *)symtab_section->data)[ELFW(R_SYM)(((ElfW_Rel *)text_section->reloc->data)->r_info)]
   //            .st_value);
   /* relocate symbols */
+  start = tcc_clock_ns();
   tcci_relocate_syms(itp, s1->symtab, !(s1->nostdlib), 1);
+  s1->stats.relocate_syms_ns += tcc_clock_ns() - start;
   if (s1->nb_errors)
     return 3;
 
 #ifdef TCC_TARGET_PE
-  s1->pe_imagebase = mem;
+  s1->pe_imagebase = code;
 #endif
 
   // printf("##'L.0' [before relocate_sections] st_value=%p\n",
@@ -616,6 +1694,7 @@ LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *itp)
   //            .st_value);
   // puts("xxx");
   /* relocate each section */
+  start = tcc_clock_ns();
   for (i = 1; i < s1->nb_sections; i++) {
     s = s1->sections[i];
     if (s->reloc) {
@@ -624,6 +1703,7 @@ LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *itp)
       // puts("zzz");
     }
   }
+  s1->stats.relocate_sections_ns += tcc_clock_ns() - start;
   // printf("##'L.0' [before relocate_plt] st_value=%p\n",
   //        (void *)((ElfW(Sym) *)symtab_section->data)[ELFW(R_SYM)(((ElfW_Rel *)text_section->reloc->data)->r_info)]
   //            .st_value);
@@ -638,17 +1718,18 @@ LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *itp)
     length = s->data_offset;
     ptr = (void *)s->sh_addr;
     if (s->sh_flags & SHF_EXECINSTR)
-      ptr = (char *)((addr_t)ptr - 0 /*ptr_diff*/);
+      ptr = tcci_code_rw(itp, s->sh_addr);
     if (NULL == s->data || s->sh_type == SHT_NOBITS)
       memset(ptr, 0, length);
     else
       memcpy(ptr, s->data, length);
-    /* mark executable sections as executable in memory */
-    // printf("preexec-section:%i '%s' (void *)s->sh_addr:%p\n", i, s->name, (void *)s->sh_addr);
+    /* the arena code pages are already executable */
+#if !defined _WIN32 && (defined TCC_TARGET_ARM || defined TCC_TARGET_ARM64)
     if (s->sh_flags & SHF_EXECINSTR) {
-      // printf("exec-section:%i '%s'\n", i, s->name);
-      set_pages_executable(s1, (char *)((addr_t)ptr + 0 /*ptr_diff*/), length);
+      void __clear_cache(void *beginning, void *end);
+      __clear_cache(ptr, (char *)ptr + length);
     }
+#endif
     // for (int b = 0; b < length;) {
     //   printf("      ");
     //   for (int bi = 0; bi < 8 && b < length; ++bi, ++b) {
@@ -662,6 +1743,7 @@ LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *itp)
   ElfW(Sym) * sym;
   Section *symtab = symtab_section;
   u_char binding, type;
+  itp->unit = unit;
   for_each_elem(symtab, 1, sym, ElfW(Sym))
   {
     // if (!strcmp((char *)symtab->link->data + sym->st_name, "register_midge_error_tag"))
@@ -669,7 +1751,7 @@ LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *itp)
     // printf("sym->st_name:%s binding:%u st_shndx:%i st_other:%u\n", (char *)symtab->link->data + sym->st_name,
     //        ELF64_ST_BIND(sym->st_info), sym->st_shndx, sym->st_other);
     type = ELF64_ST_TYPE(sym->st_info);
-    if (type != STT_FUNC || sym->st_shndx == 0)
+    if (type != STT_FUNC || sym->st_shndx == 0 || sym->st_shndx >= SHN_LORESERVE)
       continue;
 
     if (s1->sections[sym->st_shndx] != text_section)
@@ -702,7 +1784,7 @@ LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *itp)
       }
 
       tcci_set_interp_symbol(itp, sym_fn, (char *)symtab->link->data + sym->st_name, binding, type,
-                             (void *)sym->st_value);
+                             (void *)sym->st_value, sym->st_size);
 
       // if (binding != STB_GLOBAL)
       //   continue;
@@ -714,6 +1796,14 @@ LIBTCCINTERPAPI int tcci_relocate_into_memory(TCCInterpState *itp)
       // tcci_set_global_symbol(itp, (char *)symtab->link->data + sym->st_name, binding, type, (void *)sym->st_value);
     }
   }
+  itp->unit = NULL;
+  if (itp->perf_flags)
+    tcci_perf_flush();
+  if (unit && unit->nb_bodies && itp->debugger_info)
+    tcci_jit_register(unit);
+
+  if (unit)
+    tcci_commit_definitions(itp, unit);
 
   return 0;
 }
@@ -999,6 +2089,7 @@ static void set_pages_executable(TCCState *s1, void *ptr, unsigned long length)
   //   fclose(f);
   // }
 
+  uint64_t clock_start = tcc_clock_ns();
 #ifdef _WIN32
   unsigned long old_protect;
   VirtualProtect(ptr, length, PAGE_EXECUTE_READWRITE, &old_protect);
@@ -1019,6 +2110,8 @@ static void set_pages_executable(TCCState *s1, void *ptr, unsigned long length)
   __clear_cache(ptr, (char *)ptr + length);
 #endif
 #endif
+  s1->stats.set_pages_ns += tcc_clock_ns() - clock_start;
+  ++s1->stats.nb_set_pages;
 }
 
 //   static void remove_pages_executable(void *ptr, unsigned long length) {
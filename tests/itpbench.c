@@ -0,0 +1,300 @@
+/*
+ * Micro benchmarks for the tcc interpreter (libtccinterp)
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+#include "libtcc.h"
+#include "help/hash_table.h"
+
+static double time_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* overhead of a call from one interpreted function to another */
+static void bench_redirect_mode(int mode, const char *name, long n)
+{
+  TCCInterpState *itp;
+  long (*loop)(long);
+  double t;
+
+  itp = tcci_new();
+  if (tcci_set_redirect_mode(itp, mode)) {
+    printf("%-12s not supported\n", name);
+    tcci_delete(itp);
+    return;
+  }
+  if (tcci_add_string(itp, "bench.c",
+                      "int bench_inc(long x) { return x & 1; }\n"
+                      "long bench_loop(long n) {\n"
+                      "  long i, s = 0;\n"
+                      "  for (i = 0; i < n; ++i)\n"
+                      "    s += bench_inc(i);\n"
+                      "  return s;\n"
+                      "}\n"))
+    exit(1);
+  loop = (long (*)(long))tcci_get_symbol(itp, "bench_loop");
+
+  loop(n / 10);
+  t = time_ms();
+  if (loop(n) != n / 2)
+    exit(2);
+  t = time_ms() - t;
+  printf("%-12s %6.2f ns/call\n", name, t * 1e6 / n);
+
+  tcci_delete(itp);
+}
+
+/* a call through a pointer taken before n redefinitions of the callee, which is resolved
+   to the newest body in one lookup however long the chain of redefinitions is */
+static void bench_redefinition_chain(int n, long calls)
+{
+  TCCInterpState *itp;
+  int (*first)(void), (*chain_call)(int (*)(void));
+  char buf[256];
+  double t;
+  long i;
+  int a;
+
+  itp = tcci_new();
+  if (tcci_add_string(itp, "chain.c",
+                      "int chain_nb(void) { return 0; }\n"
+                      "int chain_call(int (*fp)(void)) { return fp(); }\n"))
+    exit(1);
+  first = (int (*)(void))tcci_get_symbol(itp, "chain_nb");
+  chain_call = (int (*)(int (*)(void)))tcci_get_symbol(itp, "chain_call");
+  for (a = 1; a <= n; ++a) {
+    sprintf(buf, "int chain_nb(void) { return %i; }\n", a);
+    if (tcci_add_string(itp, "chain2.c", buf))
+      exit(1);
+  }
+
+  chain_call(first);
+  t = time_ms();
+  for (i = 0; i < calls; ++i)
+    if (chain_call(first) != n)
+      exit(2);
+  t = time_ms() - t;
+  printf("chain of %-6i %6.2f ns/call\n", n, t * 1e6 / calls);
+
+  tcci_delete(itp);
+}
+
+/* lookup throughput and memory of the hash table keeping the interpreter symbols and the
+   redirection targets, filled with n random keys. Hits & misses are looked up in random
+   order, about 2 * 10M lookups in all */
+static void bench_hash_table(size_t n)
+{
+  hash_table_t ht;
+  unsigned long *keys, x = 88172645463325252ul, sum = 0;
+  size_t i, r, rounds = n < 10000000 ? 10000000 / n : 1;
+  double t_hit, t_miss;
+
+  keys = (unsigned long *)malloc(n * sizeof(unsigned long));
+  init_hash_table(0, &ht);
+  for (i = 0; i < n; ++i) {
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    keys[i] = x & ~1ul; /* misses are odd */
+    hash_table_set_by_hash(keys[i], keys + i, &ht);
+  }
+  /* shuffle, so the lookups don't follow the insertion order */
+  for (i = n - 1; i > 0; --i) {
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    r = x % (i + 1);
+    x = keys[i], keys[i] = keys[r], keys[r] = x;
+  }
+
+  t_hit = time_ms();
+  for (r = 0; r < rounds; ++r)
+    for (i = 0; i < n; ++i)
+      sum += *(unsigned long *)hash_table_get_by_hash(keys[i], &ht);
+  t_hit = time_ms() - t_hit;
+  t_miss = time_ms();
+  for (r = 0; r < rounds; ++r)
+    for (i = 0; i < n; ++i)
+      sum += (unsigned long)hash_table_get_by_hash(keys[i] | 1, &ht);
+  t_miss = time_ms() - t_miss;
+  if (sum == 1)
+    exit(2);
+
+  printf("hash table %8lu entries: hit %6.2f ns, miss %6.2f ns, %6.1f bytes/entry\n", (unsigned long)n,
+         t_hit * 1e6 / (rounds * n), t_miss * 1e6 / (rounds * n),
+         (double)(ht.capacity + 1) * sizeof(hash_table_entry_t) / n);
+  destroy_hash_table(&ht);
+  free(keys);
+}
+
+/* tcci_find_symbol_by_addr() over nb_funcs functions of nb_units units, at random
+   addresses within the code of the functions */
+static void bench_find_symbol(int nb_funcs, int nb_units)
+{
+  TCCInterpState *itp = tcci_new();
+  char name[32], *src, **funcs;
+  unsigned long x = 88172645463325252ul, offset, sum = 0;
+  int i, u, n, lookups = 10000000;
+  double t;
+
+  funcs = (char **)malloc(nb_funcs * sizeof(char *));
+  src = (char *)malloc(nb_funcs / nb_units * 64 + 1);
+  for (u = 0; u < nb_units; ++u) {
+    for (i = n = 0; i < nb_funcs / nb_units; ++i)
+      n += sprintf(src + n, "int fsb%d(int x) { return x + %d; }\n", u * (nb_funcs / nb_units) + i, i);
+    if (tcci_add_string(itp, "fsb.c", src))
+      exit(1);
+  }
+  for (i = 0; i < nb_funcs; ++i) {
+    sprintf(name, "fsb%d", i);
+    funcs[i] = (char *)tcci_get_symbol(itp, name);
+  }
+
+  t = time_ms();
+  for (i = 0; i < lookups; ++i) {
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    if (tcci_find_symbol_by_addr(itp, funcs[x % nb_funcs] + (x >> 32) % 8, NULL, &offset))
+      sum += offset;
+  }
+  t = time_ms() - t;
+  if (sum == 1)
+    exit(2);
+  printf("find symbol %8d functions: %6.2f ns/lookup\n", nb_funcs, t * 1e6 / lookups);
+
+  free(src);
+  free(funcs);
+  tcci_delete(itp);
+}
+
+#ifndef _WIN32
+typedef struct {
+  int ok;
+  unsigned long long code_bytes;
+  double run_ms;
+} TestRun;
+
+/* compile tests2 program file at the optimization level and run its main(), in a child
+   process as some of the programs crash or exit on purpose */
+static TestRun run_test(const char *dir, const char *file, int level)
+{
+  TestRun res = {0};
+  char path[1024];
+  int fds[2], fd, status;
+  pid_t pid;
+
+  if (pipe(fds))
+    exit(3);
+  pid = fork();
+  if (!pid) {
+    TCCInterpState *itp;
+    TCCStats stats;
+    const char *files[1];
+    int (*prog_main)(int, char **);
+    char *args[] = {path, NULL};
+    double t;
+
+    close(fds[0]);
+    fd = open("/dev/null", O_RDWR);
+    dup2(fd, 0), dup2(fd, 1), dup2(fd, 2);
+    alarm(10);
+    itp = tcci_new();
+    tcci_set_optimize(itp, level);
+    tcci_add_include_path(itp, dir);
+    snprintf(path, sizeof path, "%s/../../include", dir);
+    tcci_add_include_path(itp, path);
+    snprintf(path, sizeof path, "%s/%s", dir, file);
+    files[0] = path;
+    if (tcci_add_files(itp, files, 1))
+      _exit(1);
+    prog_main = (int (*)(int, char **))tcci_get_symbol(itp, "main");
+    if (!prog_main)
+      _exit(1);
+    tcci_get_stats(itp, &stats);
+    res.code_bytes = stats.code_bytes;
+    t = time_ms();
+    prog_main(1, args);
+    res.run_ms = time_ms() - t;
+    fflush(stdout);
+    res.ok = 1;
+    if (write(fds[1], &res, sizeof res) != sizeof res)
+      _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  if (read(fds[0], &res, sizeof res) != sizeof res)
+    res.ok = 0;
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  return res;
+}
+
+/* size of the code generated for the tests/tests2 programs, and their run time, at two
+   optimization levels. Only the programs which compile and run at both levels count. A
+   few of them sleep or wait for signals, so the run time change is the geometric mean of
+   the per program ratios */
+static void bench_tests2(const char *dir, int level0, int level1)
+{
+  DIR *d;
+  struct dirent *de;
+  TestRun r0, r1;
+  unsigned long long size0 = 0, size1 = 0;
+  double ms0 = 0, ms1 = 0, log_ratio = 0;
+  int nb = 0;
+  size_t len;
+
+  d = opendir(dir);
+  if (!d) {
+    printf("tests2: cannot open '%s'\n", dir);
+    return;
+  }
+  while ((de = readdir(d))) {
+    len = strlen(de->d_name);
+    if (len < 3 || strcmp(de->d_name + len - 2, ".c"))
+      continue;
+    r0 = run_test(dir, de->d_name, level0);
+    r1 = run_test(dir, de->d_name, level1);
+    if (!r0.ok || !r1.ok)
+      continue;
+    size0 += r0.code_bytes, size1 += r1.code_bytes;
+    ms0 += r0.run_ms, ms1 += r1.run_ms;
+    log_ratio += log((r1.run_ms + 1e-3) / (r0.run_ms + 1e-3));
+    ++nb;
+  }
+  closedir(d);
+  if (!nb)
+    return;
+  printf("tests2 (%d programs) -O%d -> -O%d:\n", nb, level0, level1);
+  printf("  code %10llu -> %10llu bytes (%+.2f%%)\n", size0, size1, (size1 - (double)size0) * 100 / size0);
+  printf("  run  %10.2f -> %10.2f ms (%+.2f%% geometric mean)\n", ms0, ms1, (exp(log_ratio / nb) - 1) * 100);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+  long n = argc > 1 ? atol(argv[1]) : 20000000;
+
+  bench_redirect_mode(TCCI_REDIRECT_HASH_LOOKUP, "hash-lookup", n);
+  bench_redirect_mode(TCCI_REDIRECT_CELLS, "cells", n);
+  bench_redefinition_chain(10, n / 10);
+  bench_redefinition_chain(10000, n / 10);
+  bench_hash_table(1000);
+  bench_hash_table(100000);
+  bench_hash_table(1000000);
+  bench_find_symbol(1000, 10);
+  bench_find_symbol(100000, 100);
+#ifndef _WIN32
+  /* itpbench <n> <tests2 directory> */
+  if (argc > 2)
+    bench_tests2(argv[2], 1, 2);
+#endif
+  return 0;
+}
@@ -0,0 +1,7 @@
+static int obtippit(void) { return 7; }
+
+static int itpf2_table[4] = {1, 2, 3, 4};
+
+int checkit0(int expected);
+
+int checkit2(int expected) { return expected - obtippit() - itpf2_table[3] - checkit0(88) - (int)sizeof("abc"); }
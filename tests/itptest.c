@@ -1,5 +1,6 @@
 
 #include "tinycc/tcc.h"
+#include <sys/stat.h>
 
 #define MCtest(function)                                                              \
   {                                                                                   \
@@ -581,6 +582,972 @@ void _test_use_set_global_symbol(TCCInterpState *itp)
   MCtest(doit(44));
 }
 
+void _test_flat_redefinition_chain(TCCInterpState *itp)
+{
+  char buf[2048];
+  void *addrs[100];
+  TCCISymbol *sym;
+  int a, i;
+
+  sprintf(buf, "int _chainnb(void) {\n"
+               "  return 0;\n"
+               "}\n"
+               "\n"
+               "int chain_call(int (*fp)(void)) {\n"
+               "  return fp();\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "chain.c", buf));
+
+  // -- a pointer taken before any redefinition
+  int (*first)(void) = (int (*)(void))tcci_get_symbol(itp, "_chainnb");
+  int (*chain_call)(int (*)(void)) = (int (*)(int (*)(void)))tcci_get_symbol(itp, "chain_call");
+
+  for (a = 0; a < 100; ++a) {
+    addrs[a] = tcci_get_symbol(itp, "_chainnb");
+    sprintf(buf, "int _chainnb(void) {\n"
+                 "  return %i;\n"
+                 "}\n",
+            a + 1);
+    MCtest(tcci_add_string(itp, "chain2.c", buf));
+  }
+  MCtest(chain_call(first) != 100);
+
+  // -- every superseded address resolves to the current body in one lookup, however
+  //    many redefinitions came after it (timed by itpbench)
+  for (i = 0; i < 100; ++i) {
+    sym = hash_table_get_by_hash((unsigned long)addrs[i], &itp->redir.addr_to_sym);
+    MCtest(!sym || sym->addr != tcci_get_symbol(itp, "_chainnb"));
+  }
+}
+
+void _test_redirect_cells(TCCInterpState *itp)
+{
+  char buf[2048];
+
+  MCtest(tcci_set_redirect_mode(itp, TCCI_REDIRECT_CELLS));
+
+  sprintf(buf, "int _cellnb(void) {\n"
+               "  return 7;\n"
+               "}\n"
+               "\n"
+               "int cell_doit(int expect) {\n"
+               "  return _cellnb() - expect;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "cells.c", buf));
+
+  int (*doit)(int) = (int (*)(int))tcci_get_symbol(itp, "cell_doit");
+  MCtest(doit(7));
+
+  // -- redefinition patches the cell
+  sprintf(buf, "int _cellnb(void) {\n"
+               "  return 414;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "cells2.c", buf));
+  MCtest(doit(414));
+
+  MCtest(tcci_set_redirect_mode(itp, TCCI_REDIRECT_HASH_LOOKUP));
+}
+
+void _test_exec_arena(TCCInterpState *itp)
+{
+  char buf[2048];
+  TCCIArena *arena;
+  addr_t top;
+  void *result;
+  const char *decl = "int arena_a(void);";
+  int i;
+
+  sprintf(buf, "int arena_a(void) {\n"
+               "  return 3;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "arena_a.c", buf));
+  sprintf(buf, "int arena_b(void) {\n"
+               "  return 4;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "arena_b.c", buf));
+
+  // -- the code of both units is packed into the code half of the same arena
+  MCtest(!itp->nb_arenas);
+  arena = itp->arenas[itp->nb_arenas - 1];
+  addr_t a = (addr_t)tcci_get_symbol(itp, "arena_a"), b = (addr_t)tcci_get_symbol(itp, "arena_b");
+  MCtest(a < arena->code.start || a >= arena->code.top);
+  MCtest(b < arena->code.start || b >= arena->code.top);
+  MCtest(b < a || b - a > 4096);
+
+  // -- single-use code gives its memory back
+  top = arena->code.top;
+  for (i = 0; i < 50; ++i) {
+    MCtest(tcci_execute_single_use_code(itp, "arena_su.c", 1, &decl, "return (void *)(long)arena_a();", NULL,
+                                        &result));
+    MCtest((long)result - 3);
+  }
+  MCtest(itp->arenas[itp->nb_arenas - 1] != arena);
+  MCtest(arena->code.top != top);
+}
+
+void _test_collect(TCCInterpState *itp)
+{
+  char buf[2048];
+  unsigned long live, dead, released;
+  uint64_t mem;
+  int (*user)(void);
+
+  sprintf(buf, "int coll_val(void) {\n"
+               "  return 1;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "coll_a.c", buf));
+  sprintf(buf, "int coll_val(void);\n"
+               "int coll_user(void) {\n"
+               "  return coll_val() * 10;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "coll_b.c", buf));
+  user = (int (*)(void))tcci_get_symbol(itp, "coll_user");
+  MCtest(user() - 10);
+
+  MCtest(tcci_get_symbol_bytes(itp, "coll_val", &live, &dead));
+  MCtest(!live);
+  MCtest(dead);
+
+  // -- supersede coll_val, its first unit holds nothing else
+  sprintf(buf, "int coll_val(void) {\n"
+               "  return 2;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "coll_c.c", buf));
+  MCtest(tcci_get_symbol_bytes(itp, "coll_val", &live, &dead));
+  MCtest(!dead);
+
+  mem = itp->runtime_mem_size;
+  released = tcci_collect(itp);
+  MCtest(!released);
+  MCtest(itp->runtime_mem_size != mem - released);
+  MCtest(tcci_get_symbol_bytes(itp, "coll_val", &live, &dead));
+  MCtest(dead);
+  MCtest(tcci_collect(itp));
+
+  // -- released memory is reused and redirection still holds
+  sprintf(buf, "int coll_val(void) {\n"
+               "  return 3;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "coll_d.c", buf));
+  MCtest(user() - 30);
+  MCtest(!tcci_collect(itp));
+  MCtest(user() - 30);
+}
+
+void _test_incremental(TCCInterpState *itp)
+{
+  char buf[2048];
+  void *bump, *calc, *px;
+  int (*fbump)(void), (*fcalc)(int);
+  struct {
+    int a, b, c;
+  } pt = {1, 2, 3};
+
+  tcci_set_incremental(itp, 1);
+  sprintf(buf, "struct inc_pt { int x, y; };\n"
+               "static int inc_count;\n"
+               "int inc_total = 100;\n"
+               "static int inc_twice(int v) { return v * 2; }\n"
+               "int inc_bump(void) { return ++inc_count; }\n"
+               "int inc_calc(int v) { return inc_twice(v) + inc_total; }\n"
+               "int inc_px(struct inc_pt *p) { return p->y; }\n");
+  MCtest(tcci_add_string(itp, "inc.c", buf));
+  bump = tcci_get_symbol(itp, "inc_bump");
+  calc = tcci_get_symbol(itp, "inc_calc");
+  px = tcci_get_symbol(itp, "inc_px");
+  fbump = (int (*)(void))bump;
+  MCtest(fbump() - 1);
+  MCtest(fbump() - 2);
+
+  // -- only the changed function is compiled again, variables keep their values
+  sprintf(buf, "struct inc_pt { int x, y; };\n"
+               "static int inc_count;\n"
+               "int inc_total = 100;\n"
+               "static int inc_twice(int v) { return v * 2; }\n"
+               "int inc_bump(void) { return ++inc_count; }\n"
+               "int inc_calc(int v) { return inc_twice(v) + inc_total + inc_count; }\n"
+               "int inc_px(struct inc_pt *p) { return p->y; }\n");
+  MCtest(tcci_add_string(itp, "inc.c", buf));
+  MCtest(tcci_get_symbol(itp, "inc_bump") != bump);
+  MCtest(tcci_get_symbol(itp, "inc_px") != px);
+  MCtest(tcci_get_symbol(itp, "inc_calc") == calc);
+  fcalc = (int (*)(int))tcci_get_symbol(itp, "inc_calc");
+  MCtest(fcalc(5) - 112);
+  MCtest(fbump() - 3);
+
+  // -- a changed declaration recompiles the functions using it
+  sprintf(buf, "struct inc_pt { int z, x, y; };\n"
+               "static int inc_count;\n"
+               "int inc_total = 100;\n"
+               "static int inc_twice(int v) { return v * 2; }\n"
+               "int inc_bump(void) { return ++inc_count; }\n"
+               "int inc_calc(int v) { return inc_twice(v) + inc_total + inc_count; }\n"
+               "int inc_px(struct inc_pt *p) { return p->y; }\n");
+  MCtest(tcci_add_string(itp, "inc.c", buf));
+  MCtest(tcci_get_symbol(itp, "inc_px") == px);
+  MCtest(tcci_get_symbol(itp, "inc_bump") != bump);
+  MCtest(((int (*)(void *))tcci_get_symbol(itp, "inc_px"))(&pt) - 3);
+  MCtest(fcalc(5) - 113);
+
+  // -- a changed initializer gives the variable new storage, the others keep theirs
+  sprintf(buf, "struct inc_pt { int z, x, y; };\n"
+               "static int inc_count;\n"
+               "int inc_total = 50;\n"
+               "static int inc_twice(int v) { return v * 2; }\n"
+               "int inc_bump(void) { return ++inc_count; }\n"
+               "int inc_calc(int v) { return inc_twice(v) + inc_total + inc_count; }\n"
+               "int inc_px(struct inc_pt *p) { return p->y; }\n");
+  MCtest(tcci_add_string(itp, "inc.c", buf));
+  fcalc = (int (*)(int))tcci_get_symbol(itp, "inc_calc");
+  MCtest(fcalc(5) - 63);
+  MCtest(fbump() - 4);
+
+  tcci_set_incremental(itp, 0);
+}
+
+void _test_single_use_cache(TCCInterpState *itp)
+{
+  char buf[2048];
+  const char *decl = "int suc_val(void);";
+  void *result;
+  unsigned uid;
+
+  sprintf(buf, "int suc_val(void) {\n"
+               "  return 5;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "suc_a.c", buf));
+
+  tcci_set_single_use_cache(itp, 2);
+  uid = itp->single_use.uid_counter;
+  MCtest(tcci_execute_single_use_code(itp, "suc.c", 1, &decl, "return (void *)(long)suc_val();", NULL, &result));
+  MCtest((long)result - 5);
+  MCtest(tcci_execute_single_use_code(itp, "suc.c", 1, &decl, "return (void *)(long)suc_val();", NULL, &result));
+  MCtest((long)result - 5);
+  MCtest(itp->single_use.uid_counter - uid - 1);
+
+  // -- static data of cached code lives on
+  MCtest(tcci_execute_single_use_code(itp, "suc.c", 0, NULL, "static long n; return (void *)++n;", NULL, &result));
+  MCtest(tcci_execute_single_use_code(itp, "suc.c", 0, NULL, "static long n; return (void *)++n;", NULL, &result));
+  MCtest((long)result - 2);
+  MCtest(itp->single_use.nb_cache - 2);
+
+  // -- redefining a function the code uses drops it
+  sprintf(buf, "int suc_val(void) {\n"
+               "  return 6;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "suc_b.c", buf));
+  MCtest(itp->single_use.nb_cache - 1);
+  MCtest(tcci_execute_single_use_code(itp, "suc.c", 1, &decl, "return (void *)(long)suc_val();", NULL, &result));
+  MCtest((long)result - 6);
+
+  // -- the least recently used code makes room
+  MCtest(tcci_execute_single_use_code(itp, "suc.c", 0, NULL, "return (void *)7;", NULL, &result));
+  MCtest(itp->single_use.nb_cache - 2);
+  uid = itp->single_use.uid_counter;
+  MCtest(tcci_execute_single_use_code(itp, "suc.c", 0, NULL, "static long n; return (void *)++n;", NULL, &result));
+  MCtest((long)result - 1);
+  MCtest(itp->single_use.uid_counter - uid - 1);
+
+  // -- code of the same hash is not mistaken for cached code ("Ab" and "BA" hash alike)
+  MCtest(tcci_execute_single_use_code(itp, "suc.c", 0, NULL, "int Ab = 8; return (void *)(long)Ab;", NULL, &result));
+  MCtest((long)result - 8);
+  MCtest(tcci_execute_single_use_code(itp, "suc.c", 0, NULL, "int BA = 9; return (void *)(long)BA;", NULL, &result));
+  MCtest((long)result - 9);
+
+  tcci_set_single_use_cache(itp, 0);
+  MCtest(itp->single_use.nb_cache);
+}
+
+void _test_stats(TCCInterpState *itp)
+{
+  char buf[2048];
+  TCCStats st;
+
+  tcci_reset_stats(itp);
+  tcci_set_pp_timing(itp, 1);
+  sprintf(buf, "#include <string.h>\n"
+               "#define STS_N 3\n"
+               "int sts_a(int v) {\n"
+               "  return v + STS_N;\n"
+               "}\n"
+               "int sts_b(int v) {\n"
+               "  return sts_a(v) + sts_a(v) + (int)strcspn(\"ab\", \"\");\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "sts.c", buf));
+  tcci_set_pp_timing(itp, 0);
+
+  tcci_get_stats(itp, &st);
+  MCtest(st.nb_compiles - 1);
+  MCtest(st.nb_redirected_calls - 2);
+  MCtest(!st.pp_ns || !st.gen_ns);
+  MCtest(!st.code_bytes);
+  MCtest(!st.nb_dlsym);
+
+  // -- names resolved before are not looked up again, until a library is added
+  tcci_reset_stats(itp);
+  MCtest(tcci_add_string(itp, "sts.c", buf));
+  tcci_get_stats(itp, &st);
+  MCtest(st.nb_dlsym);
+  tcci_add_library(itp, "m");
+  MCtest(tcci_add_string(itp, "sts.c", buf));
+  tcci_get_stats(itp, &st);
+  MCtest(!st.nb_dlsym);
+
+  tcci_reset_stats(itp);
+  tcci_get_stats(itp, &st);
+  MCtest(st.nb_compiles);
+}
+
+void _test_optimize_regvars(TCCInterpState *itp)
+{
+  char buf[4096];
+
+  tcci_set_optimize(itp, 1);
+  sprintf(buf, "#include <setjmp.h>\n"
+               "static int opt_id(int x) { return x; }\n"
+               "long opt_sum(int n) {\n"
+               "  long acc = 0;\n"
+               "  for (int i = 0; i < n; i++)\n"
+               "    acc += opt_id(i) * 2;\n"
+               "  return acc;\n"
+               "}\n"
+               "int opt_narrow(void) {\n"
+               "  char c = 0; unsigned char u = 250; short s = -3; unsigned short us = 65535;\n"
+               "  for (int k = 0; k < 300; ++k) { c++; u++; s--; us++; }\n"
+               "  return c * 1000000 + u * 1000 + s + us;\n"
+               "}\n"
+               "int opt_many(int n) {\n"
+               "  int a = 1, b = 2, c = 3, d = 4, e = 5, f = 6, g = 7;\n"
+               "  while (n--) { a += b; b += c; c += d; d += e; e += f; f += g; g += a; }\n"
+               "  return a ^ b ^ c ^ d ^ e ^ f ^ g;\n"
+               "}\n"
+               "int opt_addr(void) { int x = 5; int *p = &x; *p = 7; return x; }\n"
+               "int opt_scopes(int v) {\n"
+               "  int t = ({ int q = v * 3; q + 1; });\n"
+               "  { int a = 3; t += a; } { int b = 4; t += b++ + b++; }\n"
+               "  return t;\n"
+               "}\n"
+               "int opt_rec(int n) { int k = n; return k <= 1 ? 1 : k * opt_rec(k - 1); }\n"
+               "int opt_setjmp(void) {\n"
+               "  jmp_buf jb; int m = 0;\n"
+               "  if (setjmp(jb) < 3) longjmp(jb, ++m);\n"
+               "  return m;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "opt.c", buf));
+  tcci_set_optimize(itp, 0);
+
+  MCtest(((long (*)(int))tcci_get_symbol(itp, "opt_sum"))(1000) - 999000);
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "opt_narrow"))() - 44037996);
+  MCtest(((int (*)(int))tcci_get_symbol(itp, "opt_many"))(17) - 198114);
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "opt_addr"))() - 7);
+  MCtest(((int (*)(int))tcci_get_symbol(itp, "opt_scopes"))(4) - 25);
+  MCtest(((int (*)(int))tcci_get_symbol(itp, "opt_rec"))(10) - 3628800);
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "opt_setjmp"))() - 3);
+}
+
+void _test_optimize_peephole(TCCInterpState *itp)
+{
+  const char *src = "static int P(id)(int x) { return x; }\n"
+                    "long P(spill)(int n) {\n"
+                    "  int i = n * 3; long l = n; int *pi = &i; long *pl = &l;\n"
+                    "  i = i + 1; l = l * i; i = i - 2; l = l + i;\n"
+                    "  return *pi + *pl;\n"
+                    "}\n"
+                    "int P(flow)(int n, double d) {\n"
+                    "  int r = 0;\n"
+                    "  do { if (n > 5) break; r += 1; } while (0);\n"
+                    "  switch (n) { case 1: r += 10; case 2: r += 20; break; case 7: break; default: r += 40; }\n"
+                    "  if (d < 1.5 || d != d) r += 100; else if (d >= 2.5 && n) r += 200;\n"
+                    "  for (int k = 0; k < n; ++k) { if (k == 3) continue; if (k == 9) goto out; r += P(id)(k); }\n"
+                    "out:\n"
+                    "  return n & 1 ? r : -r;\n"
+                    "}\n";
+  char buf[2048];
+  TCCStats stats;
+  unsigned long long bytes0, bytes1, bytes2;
+  int n;
+
+  tcci_get_stats(itp, &stats);
+  bytes0 = stats.code_bytes;
+  tcci_set_optimize(itp, 1);
+  sprintf(buf, "#define P(name) name##_o1\n%s", src);
+  MCtest(tcci_add_string(itp, "peep1.c", buf));
+  tcci_get_stats(itp, &stats);
+  bytes1 = stats.code_bytes - bytes0;
+  tcci_set_optimize(itp, 2);
+  sprintf(buf, "#define P(name) name##_o2\n%s", src);
+  MCtest(tcci_add_string(itp, "peep2.c", buf));
+  tcci_get_stats(itp, &stats);
+  bytes2 = stats.code_bytes - bytes0 - bytes1;
+  tcci_set_optimize(itp, 0);
+
+  // -- same results from less code
+  MCtest(bytes2 >= bytes1);
+  for (n = 0; n < 12; ++n) {
+    MCtest(((long (*)(int))tcci_get_symbol(itp, "spill_o1"))(n) != ((long (*)(int))tcci_get_symbol(itp, "spill_o2"))(n));
+    MCtest(((int (*)(int, double))tcci_get_symbol(itp, "flow_o1"))(n, n * 0.5) !=
+           ((int (*)(int, double))tcci_get_symbol(itp, "flow_o2"))(n, n * 0.5));
+  }
+  MCtest(((long (*)(int))tcci_get_symbol(itp, "spill_o2"))(4) - 74);
+  MCtest(((int (*)(int, double))tcci_get_symbol(itp, "flow_o2"))(1, 3.0) - 231);
+}
+
+/* write a source of exactly size bytes: n_vars variables, then a function returning their sum
+   after a padding comment. Files larger than IO_BUF_SIZE are mapped by tcc_open() */
+static void _write_sized_source(const char *path, int size, const char *fn, int n_vars, const char *tail)
+{
+  FILE *f = fopen(path, "w");
+  int i, len = 0;
+
+  for (i = 0; i < n_vars; ++i)
+    len += fprintf(f, "static int %s_v%d = %d;\n", fn, i, i);
+  len += fprintf(f, "int %s(void) {\n  return 0", fn);
+  for (i = 0; i < n_vars; ++i)
+    len += fprintf(f, " + %s_v%d", fn, i);
+  len += fprintf(f, ";\n}\n/*");
+  while (len < size - 2 - (int)strlen(tail))
+    len += fprintf(f, "-");
+  fprintf(f, "*/%s", tail);
+  fclose(f);
+}
+
+void _test_mapped_sources(TCCInterpState *itp)
+{
+  const char *files[2] = {"/tmp/itp_mapped0.c", "/tmp/itp_mapped1.c"};
+
+  // -- a size multiple of the page size puts the sentinel in the page after the file
+  _write_sized_source(files[0], 4 * 4096, "mapped_a", 300, "\n");
+  _write_sized_source("/tmp/itp_mapped.h", 3 * 4096 + 123, "mapped_h", 200, "\n#define MAPPED_H 7");
+  _write_sized_source(files[1], 2 * 4096 + 77, "mapped_b", 100, "\n#include \"itp_mapped.h\"\nint mapped_c(void) { return MAPPED_H; }");
+  MCtest(tcci_add_files(itp, files, 2));
+
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "mapped_a"))() - 299 * 300 / 2);
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "mapped_b"))() - 99 * 100 / 2);
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "mapped_h"))() - 199 * 200 / 2);
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "mapped_c"))() - 7);
+  remove(files[0]);
+  remove(files[1]);
+  remove("/tmp/itp_mapped.h");
+}
+
+void _test_lexer_runs(TCCInterpState *itp)
+{
+  // -- runs longer than the vector scans, escapes and line splices inside them, and a
+  //    comment which runs into the end of the source
+  const char *code = "/* a comment long enough to take more than one vector load ** / * */\n"
+                     "int an_identifier_much_longer_than_thirty_two_bytes_0123456789 = 3;\n"
+                     "const char *lexer_str(void) { return \"a string long enough for two \\\"loads\\\" \\\n"
+                     "with a splice\"; }\n"
+                     "int lexer_runs(void) {\n"
+                     "  \t      \t        return an_identifier_much_longer_than_thirty_two_bytes_0123456789 // x \\\n"
+                     "    + 4;\n"
+                     "  ;\n"
+                     "}\n"
+                     "// no newline after this comment, which ends right at the end of the buffer";
+
+  MCtest(tcci_add_string(itp, "lexer_runs.c", code));
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "lexer_runs"))() - 3);
+  MCtest(strcmp(((const char *(*)(void))tcci_get_symbol(itp, "lexer_str"))(), "a string long enough for two \"loads\" with a splice"));
+}
+
+static void _write_text(const char *path, const char *text)
+{
+  FILE *f = fopen(path, "w");
+  fputs(text, f);
+  fclose(f);
+}
+
+void _test_include_cache(TCCInterpState *itp)
+{
+  const char *code = "#include <itp_inc.h>\n"
+                     "int inc_val(void) { return INC_VAL; }\n";
+
+  mkdir("/tmp/itp_inc_cache", 0755);
+  mkdir("/tmp/itp_inc_a", 0755);
+  mkdir("/tmp/itp_inc_b", 0755);
+  remove("/tmp/itp_inc_a/itp_inc.h");
+  _write_text("/tmp/itp_inc_b/itp_inc.h", "#ifndef ITP_INC_H\n#define ITP_INC_H\n#define INC_VAL 1\n#endif\n");
+  tcci_add_include_path(itp, "/tmp/itp_inc_a");
+  tcci_add_include_path(itp, "/tmp/itp_inc_b");
+
+  tcci_set_include_cache(itp, "/tmp/itp_inc_cache");
+  MCtest(tcci_add_string(itp, "inc0.c", code));
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "inc_val"))() - 1);
+
+  // -- read back from the disk: the header found first now shadows the cached lookup
+  tcci_set_include_cache(itp, NULL);
+  tcci_set_include_cache(itp, "/tmp/itp_inc_cache");
+  MCtest(tcci_add_string(itp, "inc1.c", code));
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "inc_val"))() - 1);
+  _write_text("/tmp/itp_inc_a/itp_inc.h", "#define INC_VAL 2\n");
+  MCtest(tcci_add_string(itp, "inc2.c", code));
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "inc_val"))() - 2);
+
+  // -- a header whose guard is defined is skipped
+  remove("/tmp/itp_inc_a/itp_inc.h");
+  MCtest(tcci_add_string(itp, "inc3.c", "#define ITP_INC_H\n"
+                                        "#define INC_VAL 3\n"
+                                        "#include <itp_inc.h>\n"
+                                        "int inc_val(void) { return INC_VAL; }\n"));
+  MCtest(((int (*)(void))tcci_get_symbol(itp, "inc_val"))() - 3);
+  tcci_set_include_cache(itp, NULL);
+  remove("/tmp/itp_inc_b/itp_inc.h");
+}
+
+void _test_hash_table(TCCInterpState *itp)
+{
+  hash_table_t ht;
+  hash_table_entry_t *ent;
+  unsigned long i, n;
+
+  /* addresses like keys: many share their low bits */
+  init_hash_table(0, &ht);
+  for (i = 0; i < 3000; ++i)
+    hash_table_set_by_hash(i << 12, (void *)(i + 1), &ht);
+  MCtest(ht.n != 3000 || (ht.capacity & (ht.capacity - 1)));
+  for (i = 0; i < 3000; i += 2)
+    MCtest(hash_table_remove(i << 12, &ht));
+  MCtest(ht.n != 1500 || hash_table_get_by_hash(0, &ht) || hash_table_get_by_hash(2 << 12, &ht));
+  for (i = 1; i < 3000; i += 2)
+    MCtest(hash_table_get_by_hash(i << 12, &ht) != (void *)(i + 1));
+
+  hash_table_set_by_hash(0, (void *)7, &ht);
+  hash_table_set("hash_table", (void *)9, &ht);
+  MCtest(hash_table_get_by_hash(0, &ht) != (void *)7 || hash_table_get("hash_table", &ht) != (void *)9);
+  for (n = 0, ent = hash_table_first(&ht); ent; ent = hash_table_next(&ht, ent))
+    n += (unsigned long)ent->value;
+  MCtest(n != 1500UL * 1500 + 1500 + 7 + 9);
+
+  hash_table_clear(&ht);
+  MCtest(ht.n || hash_table_first(&ht) || hash_table_get_by_hash(1 << 12, &ht));
+  destroy_hash_table(&ht);
+}
+
+void _test_got_users(TCCInterpState *itp)
+{
+  char buf[8192];
+  int i, n, (*user)(void);
+  TCCISymbol *sym;
+
+  for (i = n = 0; i < 100; ++i)
+    n += sprintf(buf + n, "int gu_f%i(void) { return %i; }\n", i, i);
+  MCtest(tcci_add_string(itp, "gu_a.c", buf));
+
+  // -- one unit calling many interpreted functions, gu_f0 also by address
+  n = sprintf(buf, "int gu_f0(void);\n");
+  for (i = 1; i < 100; ++i)
+    n += sprintf(buf + n, "int gu_f%i(void);\n", i);
+  n += sprintf(buf + n, "int gu_user(void) {\n"
+                        "  int (*f)(void) = gu_f0;\n"
+                        "  int s = f() * 1000 + gu_f0() * 100000;\n");
+  for (i = 1; i < 100; ++i)
+    n += sprintf(buf + n, "  s += gu_f%i();\n", i);
+  sprintf(buf + n, "  return s;\n"
+                   "}\n");
+  MCtest(tcci_add_string(itp, "gu_b.c", buf));
+  user = (int (*)(void))tcci_get_symbol(itp, "gu_user");
+  MCtest(user() - 4950);
+
+  // -- gu_f0 has a GOT and a PLT entry
+  sym = hash_table_get("gu_f0", &itp->symbols);
+  MCtest(!sym || sym->nb_got_users != 2);
+  sym = hash_table_get("gu_f99", &itp->symbols);
+  MCtest(!sym || sym->nb_got_users != 1);
+
+  // -- every GOT entry of gu_f0 follows its redefinition
+  sprintf(buf, "int gu_f0(void) {\n"
+               "  return 1;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "gu_c.c", buf));
+  MCtest(user() - 4950 - 101000);
+}
+
+void _test_inline_calls(TCCInterpState *itp)
+{
+  char buf[2048];
+  int (*run)(int), (*total)(void);
+
+  tcci_set_optimize(itp, 1);
+  sprintf(buf, "struct inl_pt { int x, y; };\n"
+               "static int inl_calls;\n"
+               "static inline int inl_y(const struct inl_pt *p) { return p->y; }\n"
+               "static inline int inl_add(int a, int b) { return a + b; }\n"
+               "static inline char inl_low(int v) { return v; }\n"
+               "static inline void inl_count(int n) { inl_calls += n; }\n"
+               "static inline int inl_fact(int n) { return n > 1 ? n * inl_fact(n - 1) : 1; }\n"
+               "static int inl_next(int *c) { return ++*c; }\n"
+               "int inl_run(int v) {\n"
+               "  struct inl_pt pt = {1, v};\n"
+               "  int c = 0;\n"
+               "  inl_count(inl_add(inl_next(&c), 1));\n"
+               "  {\n"
+               "    int inl_calls = 100;\n"
+               "    inl_count(inl_calls);\n"
+               "  }\n"
+               "  return inl_y(&pt) + inl_add(c, 10) * 100 + inl_low(0x141) * 10000 + inl_fact(6) * 1000000;\n"
+               "}\n"
+               "int inl_total(void) { return inl_calls; }\n");
+  MCtest(tcci_add_string(itp, "inl.c", buf));
+  run = (int (*)(int))tcci_get_symbol(itp, "inl_run");
+  total = (int (*)(void))tcci_get_symbol(itp, "inl_total");
+
+  // -- arguments evaluated once, converted to the parameter and return types, the
+  //    shadowed inl_calls reached through a call
+  MCtest(run(7) - (7 + 1100 + 650000 + 720000000));
+  MCtest(total() - 102);
+
+  tcci_set_optimize(itp, 0);
+}
+
+static long long _swt_expect(long long x, long long base)
+{
+  long long i = x - base;
+
+  if (i >= 0 && i < 60 && i % 5 != 2)
+    return i * 3 + i;
+  return i == 1000 ? 7 : i == -100000 ? 9 : -1;
+}
+
+void _test_switch_tables(TCCInterpState *itp)
+{
+  char buf[8192];
+  int i, n;
+  long long x;
+  int (*swt)(int);
+  long long (*swtll)(long long);
+
+  // -- dense cases with holes & two outliers, at -O2 where the peephole pass moves the
+  //    code the table entries go to
+  tcci_set_optimize(itp, 2);
+  n = sprintf(buf, "int swt(int x) {\n"
+                   "  int r, t, *p = &t;\n"
+                   "  switch (x) {\n");
+  for (i = 0; i < 60; ++i)
+    if (i % 5 != 2)
+      n += sprintf(buf + n, "  case %i: r = x * 3; *p = r; t = r; return t + %i;\n", i, i);
+  n += sprintf(buf + n, "  case 1000: return 7;\n"
+                        "  case -100000: return 9;\n"
+                        "  }\n"
+                        "  return -1;\n"
+                        "}\n"
+                        "long long swtll(long long x) {\n"
+                        "  switch (x) {\n");
+  for (i = 0; i < 60; ++i)
+    if (i % 5 != 2)
+      n += sprintf(buf + n, "  case %iLL + (1LL << 40): return %i;\n", i, i * 4);
+  sprintf(buf + n, "  case 1000 + (1LL << 40): return 7;\n"
+                   "  default: return -1;\n"
+                   "  }\n"
+                   "}\n");
+  MCtest(tcci_add_string(itp, "swt.c", buf));
+  swt = (int (*)(int))tcci_get_symbol(itp, "swt");
+  swtll = (long long (*)(long long))tcci_get_symbol(itp, "swtll");
+
+  for (x = -100001; x < 1002; ++x) {
+    if (x == -99999)
+      x = -5;
+    if (x == 65)
+      x = 998;
+    MCtest(swt(x) != _swt_expect(x, 0));
+    MCtest(swtll(x + (1LL << 40)) != (x == -100000 ? -1 : _swt_expect(x, 0)));
+  }
+  MCtest(swt(0x7fffffff) != -1 || swt(-0x7fffffff - 1) != -1 || swtll(59) != -1);
+
+  // -- tables of several files compiled into one state
+  const char *files[2] = {"/tmp/itp_swt0.c", "/tmp/itp_swt1.c"};
+  FILE *fp;
+  for (i = 0; i < 2; ++i) {
+    fp = fopen(files[i], "w");
+    MCtest(!fp);
+    fprintf(fp, "int swf%i(int x) {\n"
+                "  switch (x) {\n",
+            i);
+    for (n = 0; n < 12; ++n)
+      fprintf(fp, "  case %i: return %i;\n", n, n * 10 + i);
+    fprintf(fp, "  }\n"
+                "  return -1;\n"
+                "}\n");
+    fclose(fp);
+  }
+  MCtest(tcci_add_files(itp, files, 2));
+  MCtest(((int (*)(int))tcci_get_symbol(itp, "swf0"))(7) - 70);
+  MCtest(((int (*)(int))tcci_get_symbol(itp, "swf1"))(11) - 111);
+  remove(files[0]);
+  remove(files[1]);
+
+  tcci_set_optimize(itp, 0);
+}
+
+void _test_struct_copies(TCCInterpState *itp)
+{
+  static const int sizes[] = {1, 3, 9, 12, 24, 33, 64, 65};
+  char buf[8192], name[16];
+  int i, n, (*cp)(void);
+
+  // -- assignments, self assignments, arguments & return values of the sizes around the
+  //    chunks of the inline copies and of the registers structures are returned in
+  for (i = n = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+    n += sprintf(buf + n,
+                 "struct sc%1$i { unsigned char b[%1$i]; };\n"
+                 "static struct sc%1$i sc_mk%1$i(int k) {\n"
+                 "  struct sc%1$i r;\n"
+                 "  int i;\n"
+                 "  for (i = 0; i < %1$i; ++i)\n"
+                 "    r.b[i] = i * 7 + k;\n"
+                 "  return r;\n"
+                 "}\n"
+                 "static struct sc%1$i sc_id%1$i(struct sc%1$i a) { return a; }\n"
+                 "int sc_cp%1$i(void) {\n"
+                 "  struct sc%1$i arr[3], *p = &arr[1];\n"
+                 "  int i, t = 0;\n"
+                 "  arr[0] = sc_mk%1$i(1);\n"
+                 "  *p = arr[0];\n"
+                 "  arr[2] = sc_id%1$i(*p);\n"
+                 "  arr[2] = arr[2];\n"
+                 "  for (i = 0; i < %1$i; ++i)\n"
+                 "    t += arr[0].b[i] == (unsigned char)(i * 7 + 1) && arr[2].b[i] == arr[0].b[i];\n"
+                 "  return t;\n"
+                 "}\n",
+                 sizes[i]);
+  MCtest(tcci_add_string(itp, "sc.c", buf));
+
+  for (i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+    sprintf(name, "sc_cp%i", sizes[i]);
+    cp = (int (*)(void))tcci_get_symbol(itp, name);
+    MCtest(cp() != sizes[i]);
+  }
+}
+
+void _test_perf_map(TCCInterpState *itp)
+{
+  char path[64], line[256], name[64];
+  unsigned long addr, size, last = 0;
+  unsigned magic;
+  FILE *f;
+  int nb = 0;
+
+  MCtest(tcci_set_perf_map(itp, TCCI_PERF_MAP | TCCI_PERF_JITDUMP));
+  MCtest(tcci_add_string(itp, "perf0.c", "int perf_fn(void) { return 1; }"));
+  MCtest(tcci_add_string(itp, "perf1.c", "int perf_fn(void) { return 2; }"));
+  MCtest(tcci_set_perf_map(itp, 0));
+  MCtest(tcci_add_string(itp, "perf2.c", "int perf_fn(void) { return 3; }"));
+
+  // -- the two bodies compiled while enabled are listed, the current one isn't
+  sprintf(path, "/tmp/perf-%d.map", (int)getpid());
+  MCtest(!(f = fopen(path, "r")));
+  while (fgets(line, sizeof line, f))
+    if (sscanf(line, "%lx %lx %63s", &addr, &size, name) == 3 && !strcmp(name, "perf_fn") && size)
+      ++nb, last = addr;
+  fclose(f);
+  remove(path);
+  MCtest(nb != 2);
+  MCtest(!last || (void *)last == tcci_get_symbol(itp, "perf_fn"));
+
+  sprintf(path, "/tmp/jit-%d.dump", (int)getpid());
+  MCtest(!(f = fopen(path, "r")));
+  MCtest(fread(&magic, sizeof magic, 1, f) != 1 || magic != 0x4A695444);
+  fclose(f);
+  remove(path);
+}
+
+struct _jit_entry {
+  struct _jit_entry *next, *prev;
+  const char *image;
+  unsigned long long image_size;
+};
+extern struct {
+  unsigned version, action;
+  struct _jit_entry *relevant, *first;
+} __jit_debug_descriptor;
+
+static int _nb_jit_entries(void)
+{
+  struct _jit_entry *e;
+  int nb = 0;
+
+  for (e = __jit_debug_descriptor.first; e; e = e->next)
+    ++nb;
+  return nb;
+}
+
+void _test_debugger_info(TCCInterpState *itp)
+{
+  ElfW(Ehdr) * ehdr;
+  ElfW(Shdr) * text, *eh;
+  unsigned char *cfa;
+  char *fn;
+  int i, nb = _nb_jit_entries();
+
+  MCtest(tcci_set_debugger_info(itp, 1));
+  MCtest(tcci_add_string(itp, "dbg0.c", "int dbg_fn(void) { return 1; }"));
+  MCtest(tcci_add_string(itp, "dbg1.c", "int dbg_fn(void) { return 2; }"));
+  MCtest(_nb_jit_entries() != nb + 2);
+
+  // -- the newest entry describes the code of the current body
+  ehdr = (ElfW(Ehdr) *)__jit_debug_descriptor.first->image;
+  MCtest(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) || ehdr->e_type != ET_REL);
+  text = (ElfW(Shdr) *)((char *)ehdr + ehdr->e_shoff) + 1;
+  fn = tcci_get_symbol(itp, "dbg_fn");
+  MCtest(fn < (char *)text->sh_addr || fn >= (char *)text->sh_addr + text->sh_size);
+
+  // -- the callee-saved registers of register variables are described
+  tcci_set_optimize(itp, 1);
+  MCtest(tcci_add_string(itp, "dbg3.c", "int dbg_sum(int n) {\n"
+                                        "  int i, s = 0;\n"
+                                        "  for (i = 0; i < n; ++i) s += i;\n"
+                                        "  return s;\n"
+                                        "}\n"));
+  tcci_set_optimize(itp, 0);
+  ehdr = (ElfW(Ehdr) *)__jit_debug_descriptor.first->image;
+  eh = (ElfW(Shdr) *)((char *)ehdr + ehdr->e_shoff) + 2;
+  cfa = (unsigned char *)ehdr + eh->sh_offset;
+  for (i = 0; i + 1 < (int)eh->sh_size; ++i)
+    if (cfa[i] == (0x80 | 3) && cfa[i + 1] == 3) /* DW_CFA_offset rbx, cfa - 24 */
+      break;
+  MCtest(i + 1 >= (int)eh->sh_size);
+
+  // -- released with their units
+  tcci_set_debugger_info(itp, 0);
+  MCtest(tcci_add_string(itp, "dbg2.c", "int dbg_fn(void) { return 3; }"));
+  MCtest(tcci_add_string(itp, "dbg4.c", "int dbg_sum(int n) { return n; }"));
+  tcci_collect(itp);
+  MCtest(_nb_jit_entries() != nb);
+}
+
+void _test_find_symbol_by_addr(TCCInterpState *itp)
+{
+  const char *fn, *file;
+  unsigned long offset;
+  char *old, *cur, *other, *st;
+
+  MCtest(tcci_add_string(itp, "addr0.c", "int addr_fn(int x) { return x + 1; }"));
+  MCtest(tcci_add_string(itp, "addr1.c", "static int addr_st(int x) { return x * 3; }\n"
+                                         "void *addr_st_ptr(void) { return (void *)addr_st; }\n"
+                                         "int addr_other(void) { return 7; }\n"));
+  old = tcci_get_symbol(itp, "addr_fn");
+  other = tcci_get_symbol(itp, "addr_other");
+  st = ((void *(*)(void))tcci_get_symbol(itp, "addr_st_ptr"))();
+
+  fn = tcci_find_symbol_by_addr(itp, old + 3, NULL, &offset);
+  MCtest(!fn || strcmp(fn, "addr_fn") || offset != 3);
+  fn = tcci_find_symbol_by_addr(itp, other, NULL, &offset);
+  MCtest(!fn || strcmp(fn, "addr_other") || offset);
+  fn = tcci_find_symbol_by_addr(itp, st + 1, &file, NULL);
+  MCtest(!fn || strcmp(fn, "addr_st") || strcmp(file, "addr1.c"));
+  MCtest(tcci_find_symbol_by_addr(itp, (void *)&offset, NULL, NULL) != NULL);
+
+  // -- a superseded body is found until it is released
+  MCtest(tcci_add_string(itp, "addr2.c", "int addr_fn(int x) { return x; }"));
+  cur = tcci_get_symbol(itp, "addr_fn");
+  fn = tcci_find_symbol_by_addr(itp, cur, NULL, &offset);
+  MCtest(!fn || strcmp(fn, "addr_fn") || offset);
+  fn = tcci_find_symbol_by_addr(itp, old, NULL, NULL);
+  MCtest(!fn || strcmp(fn, "addr_fn"));
+  tcci_collect(itp);
+  MCtest(tcci_find_symbol_by_addr(itp, old, NULL, NULL) != NULL);
+  MCtest(!tcci_find_symbol_by_addr(itp, other, NULL, NULL));
+}
+
+void _test_parallel_add_files(TCCInterpState *itp)
+{
+  const char *files[3] = {"dep/tinycc/tests/itpf0.c", "dep/tinycc/tests/itpf1.c", "dep/tinycc/tests/itpf2.c"};
+  char buf[2048];
+
+  tcci_set_compile_threads(itp, 3);
+  MCtest(tcci_add_files(itp, files, 3));
+  tcci_set_compile_threads(itp, 1);
+
+  int (*checkit0)(int) = (int (*)(int))tcci_get_symbol(itp, "checkit0");
+  MCtest(checkit0(88));
+  int (*checkit1)(int) = (int (*)(int))tcci_get_symbol(itp, "checkit1");
+  MCtest(checkit1(242));
+  int (*checkit2)(int) = (int (*)(int))tcci_get_symbol(itp, "checkit2");
+  MCtest(checkit2(15));
+
+  // -- static functions still belong to the file they were compiled from
+  sprintf(buf, "static int obtippit(void) {\n"
+               "  return 1;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, files[2], buf));
+  MCtest(checkit2(9));
+  MCtest(checkit1(242));
+
+  // -- a file which fails fails the call, in both modes
+  files[1] = "dep/tinycc/tests/itpf_missing.c";
+  tcci_set_compile_threads(itp, 3);
+  MCtest(!tcci_add_files(itp, files, 2));
+  tcci_set_compile_threads(itp, 1);
+  MCtest(!tcci_add_files(itp, files, 2));
+  MCtest(checkit1(242));
+}
+
+void _test_header_snapshot(TCCInterpState *itp)
+{
+  char buf[2048];
+  int (*snap_b)(void);
+
+  tcci_set_header_snapshot(itp, 1);
+
+  sprintf(buf, "#include <stdio.h>\n"
+               "#include <string.h>\n"
+               "\n"
+               "#define SNAP_VAL 5\n"
+               "#undef EOF\n"
+               "int snap_a(void) {\n"
+               "  return SNAP_VAL + (int)strlen(\"ab\");\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "snap_a.c", buf));
+  MCtest(itp->nb_header_snapshots - 1);
+
+  // -- macros of a compilation don't leak into the snapshot
+  sprintf(buf, "// uses the snapshot\n"
+               "#include <stdio.h>\n"
+               "\n"
+               "#ifdef SNAP_VAL\n"
+               "#error SNAP_VAL leaked\n"
+               "#endif\n"
+               "int snap_a(void);\n"
+               "int snap_b(void) {\n"
+               "  return snap_a() + EOF;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "snap_b.c", buf));
+  snap_b = (int (*)(void))tcci_get_symbol(itp, "snap_b");
+  MCtest(snap_b() - 6);
+
+  // -- redefinitions still redirect, other include sets stay invisible
+  sprintf(buf, "#include <string.h>\n"
+               "#ifdef EOF\n"
+               "#error EOF of another include set\n"
+               "#endif\n"
+               "int snap_a(void) {\n"
+               "  return 40 + (int)strlen(\"\");\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "snap_a2.c", buf));
+  MCtest(snap_b() - 39);
+  MCtest(itp->nb_header_snapshots - 3);
+
+  // -- further include sets get a snapshot of their own
+  sprintf(buf, "#include <stdlib.h>\n"
+               "int snap_a(void) {\n"
+               "  return abs(-3);\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "snap_a3.c", buf));
+  MCtest(snap_b() - 2);
+
+  // -- defines discard the snapshot
+  tcci_define_symbol(itp, "SNAP_DEF", "9");
+  MCtest(itp->nb_header_snapshots);
+  sprintf(buf, "#include <stdio.h>\n"
+               "int snap_a(void) {\n"
+               "  return SNAP_DEF;\n"
+               "}\n");
+  MCtest(tcci_add_string(itp, "snap_a4.c", buf));
+  MCtest(snap_b() - 8);
+  tcci_undefine_symbol(itp, "SNAP_DEF");
+
+  tcci_set_header_snapshot(itp, 0);
+}
+
 #define titp(tfunc)                 \
   if (!itp->debug_verbose)          \
     printf("test '%s'...", #tfunc); \
@@ -614,6 +1581,28 @@ void test_itp()
   titp(_test_static_func_replace_from_files);
   titp(_test_use_set_global_symbol);
   titp(_test_func_ptr_indirect_call);
+  titp(_test_flat_redefinition_chain);
+  titp(_test_redirect_cells);
+  titp(_test_header_snapshot);
+  titp(_test_exec_arena);
+  titp(_test_collect);
+  titp(_test_parallel_add_files);
+  titp(_test_incremental);
+  titp(_test_single_use_cache);
+  titp(_test_stats);
+  titp(_test_optimize_regvars);
+  titp(_test_optimize_peephole);
+  titp(_test_mapped_sources);
+  titp(_test_lexer_runs);
+  titp(_test_include_cache);
+  titp(_test_hash_table);
+  titp(_test_got_users);
+  titp(_test_inline_calls);
+  titp(_test_switch_tables);
+  titp(_test_struct_copies);
+  titp(_test_perf_map);
+  titp(_test_debugger_info);
+  titp(_test_find_symbol_by_addr);
 
   itp->debug_verbose = 0;
   exit(0);
@@ -217,6 +217,24 @@ TF_TYPE(thread_test_complex, vn)
     return 0;
 }
 
+/* compilations per thread for the scaling test */
+#define SCALE_N 10
+
+/* compile only, so that the threads don't wait on anything else */
+TF_TYPE(thread_test_scaling, vn)
+{
+    TCCState *s;
+    int i;
+
+    for (i = 0; i < SCALE_N; ++i) {
+        s = new_state(0);
+        if (tcc_compile_string(s, my_program) == -1)
+            exit(1);
+        tcc_delete(s);
+    }
+    return 0;
+}
+
 void time_tcc(int n, const char *src)
 {
     TCCState *s;
@@ -241,6 +259,27 @@ static unsigned getclock_ms(void)
 #endif
 }
 
+/* the same work per thread on 1 up to M threads: with states compiling in
+   parallel the time stays flat until the threads outnumber the cores */
+void scaling_test(void)
+{
+    int n, k;
+    unsigned t, t1 = 0;
+
+    for (k = 1; k <= M; k = k < M && k * 2 > M ? M : k * 2) {
+        t = getclock_ms();
+        for (n = 0; n < k; ++n)
+            create_thread(thread_test_scaling, n);
+        wait_threads(n);
+        t = getclock_ms() - t;
+        if (k == 1)
+            t1 = t ? t : 1;
+        printf(" %2d threads: %5u ms (%.2f compiles per ms, %.1fx)\n",
+            k, t, (double)k * SCALE_N / (t ? t : 1), (double)k * t1 / (t ? t : 1));
+        fflush(stdout);
+    }
+}
+
 int main(int argc, char **argv)
 {
     int n;
@@ -276,6 +315,10 @@ int main(int argc, char **argv)
     wait_threads(n);
     printf("\n (%u ms)\n", getclock_ms() - t);
 #endif
+#if 1
+    printf("compiling fib on 1 to %d threads, %d times each\n", M, SCALE_N), fflush(stdout);
+    scaling_test();
+#endif
 #if 1
     printf("compiling tcc.c 10 times\n"), fflush(stdout);
     t = getclock_ms();
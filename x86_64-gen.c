@@ -58,6 +58,7 @@ enum {
   TREG_RAX = 0,
   TREG_RCX = 1,
   TREG_RDX = 2,
+  TREG_RBX = 3,
   TREG_RSP = 4,
   TREG_RSI = 6,
   TREG_RDI = 7,
@@ -66,6 +67,10 @@ enum {
   TREG_R9 = 9,
   TREG_R10 = 10,
   TREG_R11 = 11,
+  TREG_R12 = 12,
+  TREG_R13 = 13,
+  TREG_R14 = 14,
+  TREG_R15 = 15,
 
   TREG_XMM0 = 16,
   TREG_XMM1 = 17,
@@ -105,6 +110,20 @@ enum {
 /* define if return values need to be extended explicitely
    at caller side (for interfacing with non-TCC compilers) */
 #define PROMOTE_RET
+
+#ifndef TCC_TARGET_PE
+/* with -O, scalar locals whose address is never taken may live in the callee-saved
+   registers (see gen_regvar_alloc()). Such a local is a VT_LOCAL lvalue whose frame
+   offset is TCC_REGVAR_BASE plus the register, which only load() and store() accept */
+#define TCC_REGVAR_BASE 0x7fff0000
+#define IS_REGVAR(c) ((unsigned)(c)-TCC_REGVAR_BASE < 16)
+/* with -O2, the code of each function gets a peephole pass (see gen_peephole()) */
+#define TCC_PEEPHOLE
+#endif
+/* dense switch statements jump through a table (see gjmp_table()) */
+#define TCC_JUMP_TABLES
+/* structures up to this size are copied by gen_struct_copy() rather than memmove() */
+#define TCC_STRUCT_COPY_MAX 64
 /******************************************************/
 #else /* ! TARGET_DEFS_ONLY */
 /******************************************************/
@@ -128,17 +147,17 @@ ST_DATA const int reg_classes[NB_REGS] = {
     RC_XMM6, RC_XMM7,
     /* st0 */ RC_ST0};
 
-static unsigned long func_sub_sp_offset;
-static int func_ret_sub;
+static TCC_TLS unsigned long func_sub_sp_offset;
+static TCC_TLS int func_ret_sub;
 
 #if defined(CONFIG_TCC_BCHECK)
-static addr_t func_bound_offset;
-static unsigned long func_bound_ind;
+static TCC_TLS addr_t func_bound_offset;
+static TCC_TLS unsigned long func_bound_ind;
 ST_DATA int func_bound_add_epilog;
 #endif
 
 #ifdef TCC_TARGET_PE
-static int func_scratch, func_alloca;
+static TCC_TLS int func_scratch, func_alloca;
 #endif
 
 /* XXX: make it faster ? */
@@ -291,6 +310,10 @@ static void gen_modrm_impl(int op_reg, int r, Sym *sym, int c, int is_got)
     }
   }
   else if ((r & VT_VALMASK) == VT_LOCAL) {
+#ifdef TCC_REGVAR_BASE
+    if (IS_REGVAR(c))
+      tcc_error("internal error: register variable used as memory");
+#endif
     /* currently, we use only ebp as base */
     if (c == (char)c) {
       /* short reference */
@@ -329,10 +352,256 @@ static void gen_modrm64(int opcode, int op_reg, int r, Sym *sym, int c)
   gen_modrm_impl(op_reg, r, sym, c, is_got);
 }
 
+#ifdef TCC_REGVAR_BASE
+/* callee-saved registers given to locals, saved by the prolog when used */
+static const unsigned char regvar_regs[] = {TREG_RBX, TREG_R12, TREG_R13, TREG_R14, TREG_R15};
+#define NB_REGVARS ((int)sizeof regvar_regs)
+#define REGVAR_SAVE_SIZE 4 /* movq %reg, disp8(%rbp) */
+#define REGVAR_SLOT(i) (-8 * ((i) + 1)) /* where the prolog saves regvar_regs[i] */
+static TCC_TLS unsigned char regvars_busy, regvars_used;
+
+/* return the frame offset of a register for a local of the current function, or 0 if
+   all are taken */
+ST_FUNC int gen_regvar_alloc(void)
+{
+  int i;
+
+  for (i = 0; i < NB_REGVARS; ++i) {
+    if (!(regvars_busy & (1 << i))) {
+      regvars_busy |= 1 << i;
+      regvars_used |= 1 << i;
+      return TCC_REGVAR_BASE + regvar_regs[i];
+    }
+  }
+  return 0;
+}
+
+/* the local at offset c went out of scope */
+ST_FUNC void gen_regvar_free(int c)
+{
+  int i;
+
+  for (i = 0; i < NB_REGVARS; ++i)
+    if (regvar_regs[i] == c - TCC_REGVAR_BASE)
+      regvars_busy &= ~(1 << i);
+}
+
+/* load 'r' from the register variable 'rv'. Stores write the whole register so loads
+   extend from the width of the type */
+static void load_regvar(int r, int rv, int ft)
+{
+  int b, ll = 0;
+
+  if ((ft & VT_TYPE) == VT_BYTE || (ft & VT_TYPE) == VT_BOOL)
+    b = 0xbe0f; /* movsbl */
+  else if ((ft & VT_TYPE) == (VT_BYTE | VT_UNSIGNED))
+    b = 0xb60f; /* movzbl */
+  else if ((ft & VT_TYPE) == VT_SHORT)
+    b = 0xbf0f; /* movswl */
+  else if ((ft & VT_TYPE) == (VT_SHORT | VT_UNSIGNED))
+    b = 0xb70f; /* movzwl */
+  else
+    b = 0x8b, ll = is64_type(ft); /* mov */
+  orex(ll, rv, r, b);
+  o(0xc0 + REG_VALUE(rv) + REG_VALUE(r) * 8);
+}
+#endif
+
+#ifdef TCC_PEEPHOLE
+/* the jumps and the stores & loads of locals emitted for the current function, for the
+   peephole pass run by gfunc_epilog() */
+enum { PEEP_JMP8, PEEP_JMP32, PEEP_STORE, PEEP_LOAD, PEEP_TABLE };
+
+typedef struct PeepOp {
+  int kind;
+  int start, end; /* bytes of the instruction */
+  int r, c, size; /* register, frame offset & size of a store or load, target of a jump */
+} PeepOp; /* a PEEP_TABLE entry has the target c and the relocation r of data_section */
+
+/* an instruction replaced by the bytes b[0..len-1] */
+typedef struct PeepEdit {
+  int start, end, len, removed; /* removed: bytes removed up to the end of this edit */
+  unsigned char b[4];
+} PeepEdit;
+
+static TCC_TLS PeepOp *peep_ops;
+static TCC_TLS int nb_peep_ops, peep_ops_size, peep_on;
+
+/* record the instruction emitted from start on */
+static void peep_record(int kind, int start, int r, int c, int size)
+{
+  PeepOp *op;
+
+  if (!peep_on || ind == start) /* no code wanted */
+    return;
+  if (nb_peep_ops == peep_ops_size) {
+    peep_ops_size = peep_ops_size ? peep_ops_size * 2 : 256;
+    peep_ops = tcc_realloc(peep_ops, peep_ops_size * sizeof(PeepOp));
+  }
+  op = &peep_ops[nb_peep_ops++];
+  op->kind = kind;
+  op->start = start;
+  op->end = ind;
+  op->r = r;
+  op->c = c;
+  op->size = size;
+}
+
+/* record the entry of the jump table used by the jump from start on, relocation rel of
+   data_section, going to target */
+static void peep_record_table(int start, int target, int rel)
+{
+  peep_record(PEEP_TABLE, start, rel, target, 0);
+}
+
+ST_FUNC void gen_peephole_free(void)
+{
+  tcc_free(peep_ops);
+  peep_ops = NULL;
+  nb_peep_ops = peep_ops_size = 0;
+}
+
+/* position of the old code address a once the edits are applied */
+static int peep_map(PeepEdit *edits, int nb_edits, int a)
+{
+  int lo = 0, hi = nb_edits, m;
+
+  /* find the first edit which does not end before a */
+  while (lo < hi) {
+    m = (lo + hi) >> 1;
+    if (edits[m].end <= a)
+      lo = m + 1;
+    else
+      hi = m;
+  }
+  return lo ? a - edits[lo - 1].removed : a;
+}
+
+/* add the edit replacing the instruction of op by len bytes b */
+static void peep_edit(PeepEdit **edits, int *nb_edits, PeepOp *op, const unsigned char *b, int len)
+{
+  PeepEdit *e;
+
+  if (!(*nb_edits & 63))
+    *edits = tcc_realloc(*edits, (*nb_edits + 64) * sizeof(PeepEdit));
+  e = &(*edits)[(*nb_edits)++];
+  e->start = op->start;
+  e->end = op->end;
+  e->len = len;
+  e->removed = (*nb_edits > 1 ? e[-1].removed : 0) + op->end - op->start - len;
+  memcpy(e->b, b, len);
+}
+
+/* one round of the peephole pass over the body of the function, from start to ind:
+   - a load of a local from the slot stored to by the previous instruction becomes a move
+     from the stored register (or nothing when it is the same register & 64-bit)
+   - jumps to the next instruction are removed
+   The code is moved up over the removed bytes and the jumps, jump table entries &
+   relocations are adjusted.
+   Jumps not recorded (jp over a setcc, ...) never span an edited instruction. Returns
+   the number of edits */
+static int peep_round(int start)
+{
+  unsigned char *code = cur_text_section->data, *is_target, b[4];
+  PeepOp *op, *end = peep_ops + nb_peep_ops, *kept;
+  PeepEdit *edits = NULL, *e;
+  int nb_edits = 0, len, from, to, n, size;
+  Section *sr;
+  ElfW_Rel *rel;
+
+  /* jump targets: no edit may join the code before a label with the code after it */
+  is_target = tcc_mallocz(ind - start + 1);
+  for (op = peep_ops; op < end; ++op) {
+    if (op->kind == PEEP_JMP8)
+      op->c = op->end + (signed char)code[op->end - 1];
+    else if (op->kind == PEEP_JMP32)
+      op->c = op->end + (int)read32le(code + op->end - 4);
+    else if (op->kind != PEEP_TABLE)
+      continue;
+    if (op->c >= start && op->c <= ind)
+      is_target[op->c - start] = 1;
+  }
+
+  for (op = peep_ops; op < end; ++op) {
+    if (op->kind == PEEP_JMP8 || op->kind == PEEP_JMP32) {
+      if (op->c == op->end)
+        peep_edit(&edits, &nb_edits, op, b, 0);
+    }
+    else if (op->kind == PEEP_LOAD && op > peep_ops && op[-1].kind == PEEP_STORE && op[-1].end == op->start &&
+             op[-1].c == op->c && op[-1].size == op->size && !is_target[op->start - start]) {
+      len = 0;
+      if (op[-1].r != op->r || op->size == 4) {
+        /* mov %src, %dst (a 32-bit move clears the upper half like the load did) */
+        n = (op->size == 8) << 3 | REX_BASE(op[-1].r) << 2 | REX_BASE(op->r);
+        if (n)
+          b[len++] = 0x40 | n;
+        b[len++] = 0x89;
+        b[len++] = 0xc0 + REG_VALUE(op[-1].r) * 8 + REG_VALUE(op->r);
+      }
+      peep_edit(&edits, &nb_edits, op, b, len);
+    }
+  }
+  tcc_free(is_target);
+  if (!nb_edits)
+    return 0;
+
+  /* retarget the remaining jumps and keep the unedited instructions for the next round */
+  for (op = kept = peep_ops, e = edits; op < end; ++op) {
+    while (e < edits + nb_edits && e->end <= op->start)
+      ++e;
+    if (e < edits + nb_edits && e->start == op->start)
+      continue;
+    if (op->kind == PEEP_JMP8)
+      code[op->end - 1] = peep_map(edits, nb_edits, op->c) - peep_map(edits, nb_edits, op->end);
+    else if (op->kind == PEEP_JMP32)
+      write32le(code + op->end - 4, peep_map(edits, nb_edits, op->c) - peep_map(edits, nb_edits, op->end));
+    else if (op->kind == PEEP_TABLE) {
+      op->c = peep_map(edits, nb_edits, op->c);
+      ((ElfW_Rel *)data_section->reloc->data)[op->r].r_addend = op->c;
+    }
+    *kept = *op;
+    kept->start = peep_map(edits, nb_edits, op->start);
+    kept->end = peep_map(edits, nb_edits, op->end);
+    ++kept;
+  }
+  nb_peep_ops = kept - peep_ops;
+
+  /* move the code */
+  to = edits[0].start;
+  for (e = edits; e < edits + nb_edits; ++e) {
+    memcpy(code + to, e->b, e->len);
+    to += e->len;
+    from = e->end;
+    size = (e + 1 < edits + nb_edits ? e[1].start : ind) - from;
+    memmove(code + to, code + from, size);
+    to += size;
+  }
+
+  sr = cur_text_section->reloc;
+  if (sr) {
+    for (rel = (ElfW_Rel *)(sr->data + sr->data_offset); rel-- > (ElfW_Rel *)sr->data && rel->r_offset >= start;)
+      rel->r_offset = peep_map(edits, nb_edits, rel->r_offset);
+  }
+  ind = to;
+  tcc_free(edits);
+  return nb_edits;
+}
+
+/* removing a jump may make the jump before it one to the next instruction */
+static void gen_peephole(int start)
+{
+  while (peep_round(start))
+    ;
+}
+#else
+#define peep_record(kind, start, r, c, size) ((void)(start))
+#define peep_record_table(start, target, rel) ((void)(start))
+#endif
+
 /* load 'r' from value 'sv' */
 void load(int r, SValue *sv)
 {
-  int v, t, ft, fc, fr;
+  int v, t, ft, fc, fr, start;
   SValue v1;
 
 #ifdef TCC_TARGET_PE
@@ -369,6 +638,12 @@ void load(int r, SValue *sv)
   v = fr & VT_VALMASK;
   if (fr & VT_LVAL) {
     int b, ll;
+#ifdef TCC_REGVAR_BASE
+    if (v == VT_LOCAL && IS_REGVAR(fc)) {
+      load_regvar(r, fc - TCC_REGVAR_BASE, ft);
+      return;
+    }
+#endif
     if (v == VT_LLOCAL) {
       v1.type.t = VT_PTR;
       v1.r = VT_LOCAL | VT_LVAL;
@@ -449,6 +724,7 @@ void load(int r, SValue *sv)
       ll = is64_type(ft);
       b = 0x8b;
     }
+    start = ind;
     if (ll) {
       gen_modrm64(b, r, fr, sv->sym, fc);
     }
@@ -456,6 +732,8 @@ void load(int r, SValue *sv)
       orex(ll, fr, r, b);
       gen_modrm(r, fr, sv->sym, fc);
     }
+    if (b == 0x8b && (fr & VT_VALMASK) == VT_LOCAL && !(sv->type.t & VT_VOLATILE))
+      peep_record(PEEP_LOAD, start, r, fc, ll ? 8 : 4);
   }
   else {
     if (v == VT_CONST) {
@@ -558,7 +836,7 @@ void load(int r, SValue *sv)
 /* store register 'r' in lvalue 'v' */
 void store(int r, SValue *v)
 {
-  int fr, bt, ft, fc;
+  int fr, bt, ft, fc, start = ind;
   int op64 = 0;
   /* store the REX prefix in this variable when PIC is enabled */
   int pic = 0;
@@ -576,6 +854,14 @@ void store(int r, SValue *v)
   ft &= ~(VT_VOLATILE | VT_CONSTANT);
   bt = ft & VT_BTYPE;
 
+#ifdef TCC_REGVAR_BASE
+  if ((v->r & (VT_VALMASK | VT_LVAL)) == (VT_LOCAL | VT_LVAL) && IS_REGVAR(fc)) {
+    orex(1, fc - TCC_REGVAR_BASE, r, 0x89); /* mov r, rv */
+    o(0xc0 + REG_VALUE(fc - TCC_REGVAR_BASE) + REG_VALUE(r) * 8);
+    return;
+  }
+#endif
+
 #ifndef TCC_TARGET_PE
   /* we need to access the variable via got */
   if (fr == VT_CONST && (v->r & VT_SYM)) {
@@ -639,6 +925,9 @@ void store(int r, SValue *v)
       o(0xc0 + fr + r * 8); /* mov r, fr */
     }
   }
+  if ((v->r & (VT_VALMASK | VT_LVAL)) == (VT_LOCAL | VT_LVAL) && (bt == VT_INT || bt == VT_LLONG || bt == VT_PTR) &&
+      !(v->type.t & VT_VOLATILE))
+    peep_record(PEEP_STORE, start, r, fc, op64 ? 8 : 4);
 }
 
 /* 'is_jmp' is '1' if it is a jump */
@@ -1493,9 +1782,19 @@ void gfunc_prolog(Sym *func_sym)
   sym = func_type->ref;
   addr = PTR_SIZE * 2;
   loc = 0;
+#ifdef TCC_REGVAR_BASE
+  /* the registers are saved at the top of the frame */
+  regvars_busy = regvars_used = 0;
+  if (func_regvars) {
+    loc -= NB_REGVARS * 8;
+    ind += NB_REGVARS * REGVAR_SAVE_SIZE;
+  }
+#endif
   ind += FUNC_PROLOG_SIZE;
   func_sub_sp_offset = ind;
   func_ret_sub = 0;
+  nb_peep_ops = 0;
+  peep_on = tcc_state->optimize >= 2 && !tcc_state->do_debug && !tcc_state->do_bounds_check;
 
   if (func_var) {
     int seen_reg_num, seen_sse_num, seen_stack_size;
@@ -1640,10 +1939,22 @@ void gfunc_prolog(Sym *func_sym)
 void gfunc_epilog(void)
 {
   int v, saved_ind;
+#ifdef TCC_REGVAR_BASE
+  int i;
+#endif
 
+  if (peep_on && !func_code_fixed)
+    gen_peephole(func_sub_sp_offset);
+  peep_on = 0;
 #ifdef CONFIG_TCC_BCHECK
   if (tcc_state->do_bounds_check)
     gen_bounds_epilog();
+#endif
+#ifdef TCC_REGVAR_BASE
+  /* restore the callee-saved registers used by locals */
+  for (i = 0; i < NB_REGVARS; ++i)
+    if (regvars_used & (1 << i))
+      gen_modrm64(0x8b, regvar_regs[i], VT_LOCAL, NULL, REGVAR_SLOT(i));
 #endif
   o(0xc9); /* leave */
   if (func_ret_sub == 0) {
@@ -1658,9 +1969,24 @@ void gfunc_epilog(void)
   v = (-loc + 15) & -16;
   saved_ind = ind;
   ind = func_sub_sp_offset - FUNC_PROLOG_SIZE;
+#ifdef TCC_REGVAR_BASE
+  if (func_regvars)
+    ind -= NB_REGVARS * REGVAR_SAVE_SIZE;
+#endif
   o(0xe5894855); /* push %rbp, mov %rsp, %rbp */
   o(0xec8148);   /* sub rsp, stacksize */
   gen_le32(v);
+#ifdef TCC_REGVAR_BASE
+  for (i = 0; i < NB_REGVARS; ++i)
+    if (regvars_used & (1 << i))
+      gen_modrm64(0x89, regvar_regs[i], VT_LOCAL, NULL, REGVAR_SLOT(i));
+  /* jump over the room of the unused saves */
+  if (func_sub_sp_offset - ind >= 2) {
+    g(0xeb);
+    g(func_sub_sp_offset - ind - 1);
+  }
+  gen_fill_nops(func_sub_sp_offset - ind);
+#endif
   ind = saved_ind;
 }
 
@@ -1673,12 +1999,18 @@ ST_FUNC void gen_fill_nops(int bytes)
 }
 
 /* generate a jump to a label */
-int gjmp(int t) { return gjmp2(0xe9, t); }
+int gjmp(int t)
+{
+  int start = ind;
+  t = gjmp2(0xe9, t);
+  peep_record(PEEP_JMP32, start, 0, 0, 0);
+  return t;
+}
 
 /* generate a jump to a fixed address */
 void gjmp_addr(int a)
 {
-  int r;
+  int r, start = ind;
   r = a - ind - 2;
   if (r == (char)r) {
     g(0xeb);
@@ -1687,6 +2019,82 @@ void gjmp_addr(int a)
   else {
     oad(0xe9, a - ind - 5);
   }
+  peep_record(r == (char)r ? PEEP_JMP8 : PEEP_JMP32, start, 0, 0, 0);
+}
+
+#ifdef TCC_JUMP_TABLES
+/* jump to targets[vtop], through a table of nb entries in data_section. vtop, which is
+   popped, must be in range. Entries of -1 go to the code following the jump */
+ST_FUNC void gjmp_table(int *targets, int nb)
+{
+  int r, i, start, sec_sym;
+  unsigned long offset;
+
+  r = gv(RC_INT);
+  offset = section_add(data_section, nb * PTR_SIZE, PTR_SIZE);
+  /* the entries are offsets in the section of the code */
+  sec_sym = put_section_sym(symtab_section, cur_text_section);
+  if ((vtop->type.t & VT_BTYPE) != VT_LLONG) {
+    orex(0, r, r, 0x89); /* mov %eR, %eR: clear the upper half */
+    o(0xc0 + REG_VALUE(r) * 9);
+  }
+  o(0x1d8d4c); /* lea table(%rip), %r11 */
+  gen_addrpc32(VT_SYM, get_sym_ref(&char_pointer_type, data_section, offset, nb * PTR_SIZE), 0);
+  start = ind;
+  o(0x41 | REX_BASE(r) << 1); /* jmp *(%r11,%R,8) */
+  o(0x24ff);
+  g(0xc3 + REG_VALUE(r) * 8);
+  for (i = 0; i < nb; ++i) {
+    if (targets[i] < 0)
+      targets[i] = ind;
+    put_elf_reloca(symtab_section, data_section, offset + i * PTR_SIZE, R_DATA_PTR, sec_sym, targets[i]);
+    peep_record_table(start, targets[i], data_section->reloc->data_offset / sizeof(ElfW_Rel) - 1);
+  }
+  vtop--;
+}
+#endif
+
+/* load (or store) the n bytes at offset c from the address in register b into (from) %r11,
+   or %xmm8 when n is 16 */
+static void struct_copy_chunk(int load, int b, int c, int n)
+{
+  if (n == 2)
+    g(0x66);
+  g(0x44 | (n == 8) << 3 | REX_BASE(b));
+  if (n == 16) {
+    g(0x0f);
+    g(load ? 0x10 : 0x11); /* movups */
+  }
+  else
+    g((load ? 0x8a : 0x88) | (n > 1)); /* mov */
+  g(0x40 | (n == 16 ? 0 : 3 << 3) | REG_VALUE(b));
+  if (REG_VALUE(b) == 4)
+    g(0x24);
+  g(c);
+}
+
+/* copy size bytes, at most TCC_STRUCT_COPY_MAX, from the address vtop to the address
+   vtop[-1], both popped. The source and destination are the same or don't overlap */
+ST_FUNC void gen_struct_copy(int size)
+{
+  int d, s, c, n;
+
+  gv2(RC_INT, RC_INT);
+  d = vtop[-1].r;
+  s = vtop->r;
+  for (c = 0; c < size; c += n) {
+    /* %xmm8 is callee saved on Windows */
+#ifdef TCC_TARGET_PE
+    n = 8;
+#else
+    n = tcc_state->nosse ? 8 : 16;
+#endif
+    while (n > size - c)
+      n >>= 1;
+    struct_copy_chunk(1, s, c, n);
+    struct_copy_chunk(0, d, c, n);
+  }
+  vtop -= 2;
 }
 
 ST_FUNC int gjmp_append(int n, int t)
@@ -1705,6 +2113,8 @@ ST_FUNC int gjmp_append(int n, int t)
 
 ST_FUNC int gjmp_cond(int op, int t)
 {
+  int start = ind;
+
   if (op & 0x100) {
     /* This was a float compare.  If the parity flag is set
        the result was unordered.  For anything except != this
@@ -1715,15 +2125,20 @@ ST_FUNC int gjmp_cond(int op, int t)
        otherwise if unordered we don't want to jump.  */
     int v = vtop->cmp_r;
     op &= ~0x100;
-    if (op ^ v ^ (v != TOK_NE))
+    if (op ^ v ^ (v != TOK_NE)) {
       o(0x067a); /* jp +6 */
+      peep_record(PEEP_JMP8, start, 0, 0, 0);
+    }
     else {
       g(0x0f);
       t = gjmp2(0x8a, t); /* jp t */
+      peep_record(PEEP_JMP32, start, 0, 0, 0);
     }
   }
+  start = ind;
   g(0x0f);
   t = gjmp2(op - 16, t);
+  peep_record(PEEP_JMP32, start, 0, 0, 0);
   return t;
 }
 